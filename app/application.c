@@ -3,6 +3,7 @@
 #include <stdint.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdatomic.h>
 
 #include "stm32u5xx_hal.h"
 #include "mv_syscalls.h"
@@ -10,6 +11,9 @@
 
 #include "work.h"
 #include "log_helper.h"
+#include "tunables_helper.h"
+
+#define LOG_MODULE LOG_MODULE_APP
 
 #if defined(APPLICATION_TEMPERATURE)
 #  include "i2c_helper.h"
@@ -25,6 +29,8 @@ static void application_init();
 static void application_poll();
 static void application_process_message(const uint8_t* topic, size_t topic_len,
                                         const uint8_t* payload, size_t payload_len);
+static bool application_is_urgent(const uint8_t* topic, size_t topic_len,
+                                   const uint8_t* payload, size_t payload_len);
 /*
  *  GENERIC DATA
  */
@@ -34,16 +40,21 @@ static bool mqtt_connected = false;
 static bool message_in_flight = false;
 osMessageQueueId_t applicationMessageQueue;
 
+// Readings at or above this are sent as urgent, which wakes a duty-cycled radio
+#define URGENT_TEMPERATURE_CELSIUS 40.0
+
 /*
  *  APPLICATION_SPECIFIC DATA
  */
 #if defined(APPLICATION_DUMMY)
 static uint64_t last_send_microsec = 0;
 static float sensor_data = 0.0;
-static bool application_running = true;
+// Urgent commands write this from the work task, see application_handle_urgent_message()
+static atomic_bool application_running = true;
 #elif defined(APPLICATION_TEMPERATURE)
 static uint64_t last_send_microsec = 0;
-static bool application_running = true;
+// Urgent commands write this from the work task, see application_handle_urgent_message()
+static atomic_bool application_running = true;
 static bool i2c_initialised = true;
 
 #define TH02_ADDR 0x80
@@ -114,6 +125,59 @@ void start_application_task(void *argument) {
     }
 }
 
+/**
+ * @brief Action an urgent command straight away, ahead of any queued work.
+ *
+ * Called by the work task as soon as a message has been read, so the command
+ * runs in the work task's context rather than waiting for this task's queue.
+ *
+ * @retval true if the message was urgent and has been actioned.
+ */
+bool application_handle_urgent_message(const uint8_t* topic, size_t topic_len,
+                                       const uint8_t* payload, size_t payload_len) {
+    if (!application_is_urgent(topic, topic_len, payload, payload_len)) {
+        return false;
+    }
+
+    application_process_message(topic, topic_len, payload, payload_len);
+    return true;
+}
+
+/**
+ * @brief Is it time a reading could be handed to the work task?
+ *
+ * Duty-cycled builds keep taking readings while offline; the work task holds them.
+ */
+static inline bool ready_to_send() {
+#if defined(DUTY_CYCLE)
+    return !message_in_flight;
+#else
+    return mqtt_connected && !message_in_flight;
+#endif
+}
+
+/**
+ * @brief Check whether a payload's first whitespace-delimited token is the given command.
+ *
+ * Used by both the urgent and the queued path, so "stop" and " stop now" are
+ * treated the same whichever task actions them.
+ */
+static inline bool leading_token_is(const uint8_t* payload, size_t payload_len, const char* token) {
+    size_t index = 0;
+    while (index < payload_len && (payload[index] == ' ' || payload[index] == '\t')) {
+        index++;
+    }
+
+    size_t token_len = strlen(token);
+    if (payload_len - index < token_len || strncmp(token, (const char*) &payload[index], token_len) != 0) {
+        return false;
+    }
+
+    index += token_len;
+    return index == payload_len || payload[index] == ' ' || payload[index] == '\t'
+           || payload[index] == '\r' || payload[index] == '\n';
+}
+
 #if defined(APPLICATION_DUMMY)
 void application_init() {
     last_send_microsec = 0;
@@ -125,15 +189,14 @@ void application_poll() {
     uint64_t current_microsec = 0;
     mvGetMicroseconds(&current_microsec);
 
-    if (application_running && mqtt_connected && !message_in_flight && ((current_microsec - last_send_microsec) > 60*1000*1000)) { // trigger approx every 60 seconds, depending on how chatty other messages are (relying on 100ms timeout for osMessageQueueGet above)
+    if (application_running && ready_to_send() && ((current_microsec - last_send_microsec) > (uint64_t)tunable_sample_interval_s()*1000*1000)) { // trigger approx every sample_interval_s (60 seconds by default), depending on how chatty other messages are (relying on 100ms timeout for osMessageQueueGet above)
        last_send_microsec = current_microsec;
        message_in_flight = true;
 
        sprintf(application_message_payload, "{\"temperature_celsius\":%.2f}", sensor_data);
-#if defined(APPLICATION_DEBUGGING)
-       server_log("publishing: %s", application_message_payload);
-#endif
-       pushWorkMessage(OnApplicationProducedMessage);
+       server_trace("publishing: %s", application_message_payload);
+       pushWorkMessage(sensor_data >= URGENT_TEMPERATURE_CELSIUS ? OnApplicationProducedUrgentMessage
+                                                                 : OnApplicationProducedMessage);
 
        sensor_data += 0.1;
        if (sensor_data > 50.0) {
@@ -147,15 +210,21 @@ void application_process_message(const uint8_t* topic, size_t topic_len,
     // server_log("Got a message on topic '%.*s' with payload '%.*s",
     //            (int) topic_len, topic,
     //            (int) payload_len, payload);
-    if (strncmp("stop", (char*) payload, payload_len) == 0) {
+    if (leading_token_is(payload, payload_len, "stop")) {
         application_running = false;
     }
 
-    if (strncmp("restart", (char*) payload, payload_len) == 0) {
+    if (leading_token_is(payload, payload_len, "restart")) {
         application_running = true;
     }
 }
 
+bool application_is_urgent(const uint8_t* topic, size_t topic_len,
+                           const uint8_t* payload, size_t payload_len) {
+    // Stopping is never held up behind other work
+    return leading_token_is(payload, payload_len, "stop");
+}
+
 #elif defined(APPLICATION_TEMPERATURE)
 void application_init() {
     last_send_microsec = 0;
@@ -201,7 +270,7 @@ void application_poll() {
     uint64_t current_microsec = 0;
     mvGetMicroseconds(&current_microsec);
 
-    if (application_running && mqtt_connected && !message_in_flight && ((current_microsec - last_send_microsec) > 60*1000*1000)) { // trigger approx every 60 seconds, depending on how chatty other messages are (relying on 100ms timeout for osMessageQueueGet above)
+    if (application_running && ready_to_send() && ((current_microsec - last_send_microsec) > (uint64_t)tunable_sample_interval_s()*1000*1000)) { // trigger approx every sample_interval_s (60 seconds by default), depending on how chatty other messages are (relying on 100ms timeout for osMessageQueueGet above)
        last_send_microsec = current_microsec;
        message_in_flight = true;
 
@@ -210,7 +279,8 @@ void application_poll() {
        if (get_temperature(&temperature)) {
            // server_log("Temperature is %f", temperature);
            sprintf(application_message_payload, "{\"temperature_celsius\":%.2f}", temperature);
-           pushWorkMessage(OnApplicationProducedMessage);
+           pushWorkMessage(temperature >= URGENT_TEMPERATURE_CELSIUS ? OnApplicationProducedUrgentMessage
+                                                                     : OnApplicationProducedMessage);
        } else {
            server_error("Failed to read temperature from sensor");
        }
@@ -222,15 +292,21 @@ void application_process_message(const uint8_t* topic, size_t topic_len,
     // server_log("Got a message on topic '%.*s' with payload '%.*s",
     //            (int) topic_len, topic,
     //            (int) payload_len, payload);
-    if (strncmp("stop", (char*) payload, payload_len) == 0) {
+    if (leading_token_is(payload, payload_len, "stop")) {
         application_running = false;
     }
 
-    if (strncmp("restart", (char*) payload, payload_len) == 0) {
+    if (leading_token_is(payload, payload_len, "restart")) {
         application_running = true;
     }
 }
 
+bool application_is_urgent(const uint8_t* topic, size_t topic_len,
+                           const uint8_t* payload, size_t payload_len) {
+    // Stopping is never held up behind other work
+    return leading_token_is(payload, payload_len, "stop");
+}
+
 #elif defined(APPLICATION_SWITCH)
 void application_init() {
     switch_init();
@@ -260,15 +336,10 @@ static inline size_t skip_whitespace(const uint8_t* str, size_t index, size_t le
     return index;
 }
 
-void application_process_message(const uint8_t* topic, size_t topic_len,
-                                 const uint8_t* payload, size_t payload_len) {
-    // server_log("Got a message on topic '%.*s' with payload '%.*s",
-    //            (int) topic_len, topic,
-    //            (int) payload_len, payload);
-
+static size_t find_action_value(const uint8_t* payload, size_t payload_len) {
     const char* action_str = strnstr((const char*)payload, "\"action\"", payload_len);
     if (action_str == NULL) {
-       return;
+       return payload_len;
     }
 
     size_t index = (size_t) (action_str - (const char*) payload);
@@ -277,10 +348,27 @@ void application_process_message(const uint8_t* topic, size_t topic_len,
     index = skip_whitespace(payload, index, payload_len);
 
     if (index == payload_len || payload[index] != ':') {
-	return; // colon not found
+	return payload_len; // colon not found
     }
 
-    index = skip_whitespace(payload, index+1, payload_len);
+    return skip_whitespace(payload, index+1, payload_len);
+}
+
+static inline bool action_is(const uint8_t* payload, size_t payload_len, size_t index, const char* command) {
+    return payload_len - index >= strlen(command)
+           && strncmp(command, (const char*) &payload[index], strlen(command)) == 0;
+}
+
+void application_process_message(const uint8_t* topic, size_t topic_len,
+                                 const uint8_t* payload, size_t payload_len) {
+    // server_log("Got a message on topic '%.*s' with payload '%.*s",
+    //            (int) topic_len, topic,
+    //            (int) payload_len, payload);
+
+    size_t index = find_action_value(payload, payload_len);
+    if (index == payload_len) {
+        return;
+    }
 
     size_t rest_len = payload_len - index;
     const char* close_command = "\"switch_close\"";
@@ -302,5 +390,12 @@ void application_process_message(const uint8_t* topic, size_t topic_len,
     }
 }
 
+bool application_is_urgent(const uint8_t* topic, size_t topic_len,
+                           const uint8_t* payload, size_t payload_len) {
+    // Opening the switch is the safe state, so it is never held up behind other work
+    size_t index = find_action_value(payload, payload_len);
+    return index != payload_len && action_is(payload, payload_len, index, "\"switch_open\"");
+}
+
 #endif
 
@@ -10,6 +10,10 @@
 #ifndef APPLICATION_H
 #define APPLICATION_H
 
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -29,6 +33,8 @@ enum ApplicationMessageType {
  */
 void start_application_task(void *argument);
 void pushApplicationMessage(enum ApplicationMessageType type);
+bool application_handle_urgent_message(const uint8_t* topic, size_t topic_len,
+                                       const uint8_t* payload, size_t payload_len);
 
 /*
  * GLOBALS
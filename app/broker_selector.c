@@ -0,0 +1,237 @@
+/**
+ *
+ * Microvisor Broker Selector
+ * Version 1.0.0
+ * Copyright © 2023, Twilio
+ * Licence: Apache 2.0
+ *
+ */
+
+#include "broker_selector.h"
+#include <string.h>
+
+
+static struct BrokerEndpoint endpoints[BROKER_MAX_ENDPOINTS];
+static uint32_t num_endpoints = 0;
+
+// The list as it was before the current update, so endpoints that survive a
+// config refresh keep their measurements
+static struct BrokerEndpoint previous[BROKER_MAX_ENDPOINTS];
+static uint32_t num_previous = 0;
+
+static int32_t current = -1;
+static int32_t previous_current = -1;
+
+
+static bool same_endpoint(const struct BrokerEndpoint *endpoint, const uint8_t *host, size_t host_len, uint16_t port) {
+    return endpoint->port == port && endpoint->host_len == host_len && memcmp(endpoint->host, host, host_len) == 0;
+}
+
+/**
+ * @brief Is a over b as a choice of endpoint?
+ */
+static bool better(const struct BrokerEndpoint *a, const struct BrokerEndpoint *b) {
+    if ((a->samples == 0) != (b->samples == 0)) {
+        return a->samples == 0;
+    }
+    if (a->samples != 0 && a->connect_us != b->connect_us) {
+        return a->connect_us < b->connect_us;
+    }
+    return a->health > b->health;
+}
+
+
+/**
+ * @brief Start replacing the endpoint list; follow with broker_selector_add() calls.
+ */
+void broker_selector_begin_update() {
+    memcpy(previous, endpoints, sizeof(endpoints));
+    num_previous = num_endpoints;
+    num_endpoints = 0;
+    previous_current = current;
+    current = -1;
+}
+
+
+/**
+ * @brief Add an endpoint, carrying over its history if it was in the previous list.
+ *
+ * @retval false if the list is full, the host is empty or too long, or it is a duplicate.
+ */
+bool broker_selector_add(const uint8_t *host, size_t host_len, uint16_t port) {
+    if (host_len == 0 || host_len >= BUF_ENDPOINT_HOST || num_endpoints == BROKER_MAX_ENDPOINTS) {
+        return false;
+    }
+
+    for (uint32_t ndx = 0; ndx < num_endpoints; ndx++) {
+        if (same_endpoint(&endpoints[ndx], host, host_len, port)) {
+            return false;
+        }
+    }
+
+    struct BrokerEndpoint *endpoint = &endpoints[num_endpoints++];
+
+    for (uint32_t ndx = 0; ndx < num_previous; ndx++) {
+        if (same_endpoint(&previous[ndx], host, host_len, port)) {
+            *endpoint = previous[ndx];
+            if ((int32_t)ndx == previous_current) {
+                // Still the one in use, eg. after a config refresh that left it in the list
+                current = num_endpoints - 1;
+            }
+            return true;
+        }
+    }
+
+    memset(endpoint, 0, sizeof(struct BrokerEndpoint));
+    memcpy(endpoint->host, host, host_len);
+    endpoint->host_len = host_len;
+    endpoint->port = port;
+    endpoint->health = BROKER_INITIAL_HEALTH;
+    return true;
+}
+
+
+/**
+ * @brief Add endpoints from a list such as "a.example.com:8883, b.example.com".
+ *
+ * @param list         Comma or whitespace separated host[:port] entries
+ * @param list_len     Length of the list
+ * @param default_port Port for entries that do not give one
+ *
+ * @retval The number of endpoints added.
+ */
+uint32_t broker_selector_add_list(const uint8_t *list, size_t list_len, uint16_t default_port) {
+    uint32_t added = 0;
+    size_t index = 0;
+
+    while (index < list_len) {
+        while (index < list_len && (list[index] == ',' || list[index] == ' ' || list[index] == '\t'
+                                    || list[index] == '\r' || list[index] == '\n')) {
+            index++;
+        }
+
+        size_t start = index;
+        size_t colon = list_len;
+        while (index < list_len && list[index] != ',' && list[index] != ' ' && list[index] != '\t'
+               && list[index] != '\r' && list[index] != '\n') {
+            if (list[index] == ':') {
+                colon = index;
+            }
+            index++;
+        }
+
+        if (index == start) {
+            break;
+        }
+
+        size_t host_len = (colon < index ? colon : index) - start;
+        uint32_t port = colon < index ? 0 : default_port;
+        for (size_t ndx = colon + 1; colon < index && ndx < index; ndx++) {
+            if (list[ndx] < '0' || list[ndx] > '9') {
+                port = 0;
+                break;
+            }
+            port = port * 10 + (list[ndx] - '0');
+            if (port > 0xffff) {
+                port = 0;
+                break;
+            }
+        }
+
+        if (port != 0 && broker_selector_add(&list[start], host_len, (uint16_t)port)) {
+            added++;
+        }
+    }
+
+    return added;
+}
+
+
+/**
+ * @brief Pick the endpoint for the next connection attempt.
+ *
+ * @retval The endpoint, or NULL if there are none.
+ */
+const struct BrokerEndpoint *broker_selector_choose(uint64_t now_us) {
+    int32_t best = -1;
+    int32_t soonest = -1;
+
+    for (uint32_t ndx = 0; ndx < num_endpoints; ndx++) {
+        struct BrokerEndpoint *endpoint = &endpoints[ndx];
+
+        if (endpoint->quarantined_until_us != 0) {
+            if (now_us < endpoint->quarantined_until_us) {
+                if (soonest < 0 || endpoint->quarantined_until_us < endpoints[soonest].quarantined_until_us) {
+                    soonest = ndx;
+                }
+                continue;
+            }
+
+            // Quarantine over: one more failure puts it straight back
+            endpoint->quarantined_until_us = 0;
+            endpoint->consecutive_failures = BROKER_FAILOVER_THRESHOLD - 1;
+        }
+
+        if (best < 0 || better(endpoint, &endpoints[best])) {
+            best = ndx;
+        }
+    }
+
+    // Everything is quarantined: try whichever comes out first rather than nothing
+    current = best >= 0 ? best : soonest;
+    return current >= 0 ? &endpoints[current] : NULL;
+}
+
+
+/**
+ * @brief Record a successful connect to the last chosen endpoint.
+ *
+ * @param connect_us Time from starting the connect to CONNACK
+ */
+void broker_selector_report_success(uint32_t connect_us) {
+    if (current < 0) {
+        return;
+    }
+
+    struct BrokerEndpoint *endpoint = &endpoints[current];
+    endpoint->connect_us = endpoint->samples == 0 ? connect_us : (endpoint->connect_us * 3 + connect_us) / 4;
+    endpoint->samples++;
+    endpoint->health += (100 - endpoint->health + 3) / 4;
+    endpoint->consecutive_failures = 0;
+    endpoint->quarantined_until_us = 0;
+}
+
+
+/**
+ * @brief Record a failed connect to the last chosen endpoint.
+ */
+void broker_selector_report_failure(uint64_t now_us) {
+    if (current < 0) {
+        return;
+    }
+
+    struct BrokerEndpoint *endpoint = &endpoints[current];
+    endpoint->health -= (endpoint->health + 3) / 4;
+    endpoint->consecutive_failures++;
+    if (endpoint->consecutive_failures >= BROKER_FAILOVER_THRESHOLD) {
+        endpoint->quarantined_until_us = now_us + (uint64_t)BROKER_QUARANTINE_MS * 1000;
+    }
+}
+
+
+/**
+ * @brief The endpoint last chosen, eg. so a second connection can follow the first.
+ */
+const struct BrokerEndpoint *broker_selector_current() {
+    return current >= 0 ? &endpoints[current] : NULL;
+}
+
+
+uint32_t broker_selector_count() {
+    return num_endpoints;
+}
+
+
+const struct BrokerEndpoint *broker_selector_endpoint(uint32_t index) {
+    return index < num_endpoints ? &endpoints[index] : NULL;
+}
@@ -0,0 +1,85 @@
+/**
+ *
+ * Microvisor Broker Selector
+ * Version 1.0.0
+ * Copyright © 2023, Twilio
+ * Licence: Apache 2.0
+ *
+ */
+
+/* Chooses which of several equivalent broker endpoints to connect to.
+ *
+ * Each endpoint keeps a smoothed connect time (channel open to CONNACK) and a
+ * 0-100 health score that moves towards 100 on each successful connect and
+ * towards 0 on each failure.  An endpoint that fails
+ * BROKER_FAILOVER_THRESHOLD times in a row is set aside for
+ * BROKER_QUARANTINE_MS, after which it gets one more chance.  Only the
+ * endpoint's own failures are reported: a refused connect, or no CONNACK with
+ * the network up.  Losing the network, or being unable to open the channel,
+ * says nothing about the endpoint.
+ *
+ * The selector picks the healthy endpoint with the lowest smoothed connect
+ * time; endpoints that have not been measured yet are tried first so every
+ * candidate gets a measurement.
+ *
+ * This file has no Microvisor dependencies and takes the time as a parameter,
+ * so it can be exercised on a host machine against stand-in brokers.
+ */
+#ifndef BROKER_SELECTOR_H
+#define BROKER_SELECTOR_H
+
+/*
+ * INCLUDES
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * DEFINES
+ */
+#define BROKER_MAX_ENDPOINTS 4
+#define BUF_ENDPOINT_HOST 128
+
+#define BROKER_FAILOVER_THRESHOLD 3
+#define BROKER_QUARANTINE_MS (5*60*1000)
+#define BROKER_INITIAL_HEALTH 100
+
+/*
+ * TYPES
+ */
+struct BrokerEndpoint {
+    uint8_t  host[BUF_ENDPOINT_HOST];
+    size_t   host_len;
+    uint16_t port;
+
+    uint32_t connect_us;            // smoothed connect time, valid once samples > 0
+    uint32_t samples;
+    uint32_t health;                // 0-100
+    uint32_t consecutive_failures;
+    uint64_t quarantined_until_us;  // 0 when not quarantined
+};
+
+/*
+ * PROTOTYPES
+ */
+void broker_selector_begin_update();
+bool broker_selector_add(const uint8_t *host, size_t host_len, uint16_t port);
+uint32_t broker_selector_add_list(const uint8_t *list, size_t list_len, uint16_t default_port);
+const struct BrokerEndpoint *broker_selector_choose(uint64_t now_us);
+void broker_selector_report_success(uint32_t connect_us);
+void broker_selector_report_failure(uint64_t now_us);
+const struct BrokerEndpoint *broker_selector_current();
+uint32_t broker_selector_count();
+const struct BrokerEndpoint *broker_selector_endpoint(uint32_t index);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BROKER_SELECTOR_H */
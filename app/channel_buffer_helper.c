@@ -0,0 +1,152 @@
+/**
+ *
+ * Microvisor Channel Buffer Helper
+ * Version 1.0.0
+ * Copyright © 2023, Twilio
+ * Licence: Apache 2.0
+ *
+ */
+
+#include "channel_buffer_helper.h"
+#include <string.h>
+
+#include "work.h"
+#include "log_helper.h"
+#include "config_handler.h"
+#include "mqtt_handler.h"
+#include "command_handler.h"
+
+#define LOG_MODULE LOG_MODULE_WORK
+
+
+#if !defined(CHANNEL_BUFFER_BUDGET)
+#if defined(COMMAND_CHANNEL)
+#define CHANNEL_BUFFER_BUDGET (BUF_CONFIG_SEND_SIZE + BUF_CONFIG_RECEIVE_SIZE + BUF_SEND_SIZE + BUF_RECEIVE_SIZE \
+                               + BUF_COMMAND_SEND + BUF_COMMAND_RECEIVE)
+#else
+#define CHANNEL_BUFFER_BUDGET (BUF_CONFIG_SEND_SIZE + BUF_CONFIG_RECEIVE_SIZE + BUF_SEND_SIZE + BUF_RECEIVE_SIZE)
+#endif // COMMAND_CHANNEL
+#endif // CHANNEL_BUFFER_BUDGET
+
+#define CHANNEL_BUFFER_BLOCKS ((CHANNEL_BUFFER_BUDGET + CHANNEL_BUFFER_BLOCK - 1) / CHANNEL_BUFFER_BLOCK)
+
+static uint8_t pool[CHANNEL_BUFFER_BLOCKS * CHANNEL_BUFFER_BLOCK] __attribute__ ((aligned(CHANNEL_BUFFER_BLOCK)));
+
+// Owner of each block plus one, or zero if it is free
+static uint8_t block_owner[CHANNEL_BUFFER_BLOCKS];
+
+static struct ChannelBuffers leases[CHANNEL_BUFFERS_OWNERS];
+static struct ChannelBufferStats stats[CHANNEL_BUFFERS_OWNERS];
+static uint32_t blocks_in_use = 0;
+static uint32_t blocks_high_water = 0;
+
+static const char *owner_names[CHANNEL_BUFFERS_OWNERS] = {
+    "config",
+    "mqtt",
+    "command"
+};
+
+
+static uint32_t blocks_for(uint32_t len) {
+    return (len + CHANNEL_BUFFER_BLOCK - 1) / CHANNEL_BUFFER_BLOCK;
+}
+
+
+/**
+ * @brief Lease send and receive buffers for a channel about to be opened.
+ *
+ * Both come from one run of contiguous blocks, first fit.  An owner that
+ * already holds a lease gets the same buffers back.
+ *
+ * @retval false if the pool has no run of free blocks large enough.
+ */
+bool channel_buffers_acquire(enum ChannelBufferOwner owner, uint32_t send_len, uint32_t receive_len,
+                             struct ChannelBuffers *buffers) {
+    if (stats[owner].blocks_held != 0) {
+        *buffers = leases[owner];
+        return true;
+    }
+
+    uint32_t send_blocks = blocks_for(send_len);
+    uint32_t needed = send_blocks + blocks_for(receive_len);
+
+    uint32_t run = 0;
+    for (uint32_t ndx = 0; ndx < CHANNEL_BUFFER_BLOCKS; ndx++) {
+        run = block_owner[ndx] == 0 ? run + 1 : 0;
+        if (run == needed) {
+            uint32_t first = ndx + 1 - needed;
+            memset(&block_owner[first], owner + 1, needed);
+
+            leases[owner].send_buffer = &pool[first * CHANNEL_BUFFER_BLOCK];
+            leases[owner].send_buffer_len = send_len;
+            leases[owner].receive_buffer = &pool[(first + send_blocks) * CHANNEL_BUFFER_BLOCK];
+            leases[owner].receive_buffer_len = receive_len;
+            *buffers = leases[owner];
+
+            stats[owner].opens++;
+            stats[owner].blocks_held = needed;
+            blocks_in_use += needed;
+            if (blocks_in_use > blocks_high_water) {
+                blocks_high_water = blocks_in_use;
+            }
+            return true;
+        }
+    }
+
+    stats[owner].pool_failures++;
+    server_error("no channel buffers for %s: %lu blocks needed, %lu free",
+                 owner_names[owner], needed, CHANNEL_BUFFER_BLOCKS - blocks_in_use);
+    return false;
+}
+
+
+/**
+ * @brief mvOpenChannel() failed with the owner's lease: count it and give the buffers back.
+ */
+void channel_buffers_open_failed(enum ChannelBufferOwner owner, enum MvStatus status) {
+    stats[owner].open_failures++;
+    stats[owner].last_open_status = status;
+    channel_buffers_release(owner);
+}
+
+
+/**
+ * @brief The owner's channel is closed; return its buffers to the pool.
+ *
+ * Safe to call when the owner holds nothing.
+ */
+void channel_buffers_release(enum ChannelBufferOwner owner) {
+    if (stats[owner].blocks_held == 0) {
+        return;
+    }
+
+    for (uint32_t ndx = 0; ndx < CHANNEL_BUFFER_BLOCKS; ndx++) {
+        if (block_owner[ndx] == owner + 1) {
+            block_owner[ndx] = 0;
+        }
+    }
+
+    blocks_in_use -= stats[owner].blocks_held;
+    stats[owner].blocks_held = 0;
+    memset(&leases[owner], 0, sizeof(struct ChannelBuffers));
+}
+
+
+void channel_buffers_get_stats(enum ChannelBufferOwner owner, struct ChannelBufferStats *out) {
+    *out = stats[owner];
+}
+
+
+uint32_t channel_buffers_blocks_free() {
+    return CHANNEL_BUFFER_BLOCKS - blocks_in_use;
+}
+
+
+uint32_t channel_buffers_blocks_high_water() {
+    return blocks_high_water;
+}
+
+
+const char *channel_buffers_owner_name(enum ChannelBufferOwner owner) {
+    return owner < CHANNEL_BUFFERS_OWNERS ? owner_names[owner] : "?";
+}
@@ -0,0 +1,86 @@
+/**
+ *
+ * Microvisor Channel Buffer Helper
+ * Version 1.0.0
+ * Copyright © 2023, Twilio
+ * Licence: Apache 2.0
+ *
+ */
+
+/* A pool of 512-byte aligned blocks for channel send and receive buffers.
+ *
+ * Each channel acquires its buffers just before mvOpenChannel() and releases
+ * them once mvCloseChannel() has returned, so the config channel no longer
+ * has to borrow the mqtt connection's buffers and can be open alongside it.
+ * CHANNEL_BUFFER_BUDGET defaults to enough for the config channel and every
+ * mqtt connection at once (see channel_buffer_helper.c); define it lower to
+ * trade that for RAM.
+ *
+ * Each owner holds at most one lease.  Leases, and failures to get one or to
+ * open the channel with it, are counted per owner.  Only the work task
+ * opens and closes channels, so there is no locking.
+ */
+#ifndef CHANNEL_BUFFER_HELPER_H
+#define CHANNEL_BUFFER_HELPER_H
+
+/*
+ * INCLUDES
+ */
+#include <stdint.h>
+#include <stdbool.h>
+
+// Microvisor includes
+#include "mv_syscalls.h"
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * DEFINES
+ */
+#define CHANNEL_BUFFER_BLOCK 512
+
+/*
+ * TYPES
+ */
+enum ChannelBufferOwner {
+    CHANNEL_BUFFERS_CONFIG = 0,
+    CHANNEL_BUFFERS_MQTT,
+    CHANNEL_BUFFERS_COMMAND,
+    CHANNEL_BUFFERS_OWNERS
+};
+
+struct ChannelBuffers {
+    uint8_t *send_buffer;
+    uint32_t send_buffer_len;
+    uint8_t *receive_buffer;
+    uint32_t receive_buffer_len;
+};
+
+struct ChannelBufferStats {
+    uint32_t opens;                 // leases granted
+    uint32_t pool_failures;         // not enough contiguous blocks free
+    uint32_t open_failures;         // mvOpenChannel() refused the lease
+    enum MvStatus last_open_status;
+    uint32_t blocks_held;
+};
+
+/*
+ * PROTOTYPES
+ */
+bool channel_buffers_acquire(enum ChannelBufferOwner owner, uint32_t send_len, uint32_t receive_len,
+                             struct ChannelBuffers *buffers);
+void channel_buffers_open_failed(enum ChannelBufferOwner owner, enum MvStatus status);
+void channel_buffers_release(enum ChannelBufferOwner owner);
+void channel_buffers_get_stats(enum ChannelBufferOwner owner, struct ChannelBufferStats *out);
+uint32_t channel_buffers_blocks_free();
+uint32_t channel_buffers_blocks_high_water();
+const char *channel_buffers_owner_name(enum ChannelBufferOwner owner);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CHANNEL_BUFFER_HELPER_H */
@@ -0,0 +1,191 @@
+/**
+ *
+ * Microvisor Command Handler
+ * Version 1.0.0
+ * Copyright © 2023, Twilio
+ * Licence: Apache 2.0
+ *
+ */
+
+#include "command_handler.h"
+#include <string.h>
+#include <stdio.h>
+
+// Microvisor includes
+#include "mv_syscalls.h"
+
+#include "work.h"
+#include "log_helper.h"
+#include "mqtt_handler.h"
+#include "broker_selector.h"
+
+#define LOG_MODULE LOG_MODULE_MQTT
+
+
+static MvChannelHandle  command_channel = 0;
+static bool             connected = false;
+static volatile bool    connecting = false;
+static bool             session_present = false;
+
+static uint8_t command_client[BUF_CLIENT_SIZE + sizeof(COMMAND_CLIENT_SUFFIX)];
+
+
+/*
+ * @brief Open the command channel to the broker the main connection is using.
+ */
+void command_connect() {
+    // A second client id, as the broker would otherwise drop one connection for the other
+    size_t client_id_len = client_len;
+    memcpy(command_client, client, client_len);
+    memcpy(&command_client[client_id_len], COMMAND_CLIENT_SUFFIX, strlen(COMMAND_CLIENT_SUFFIX));
+    client_id_len += strlen(COMMAND_CLIENT_SUFFIX);
+
+    const struct BrokerEndpoint *endpoint = broker_selector_current();
+    const struct ConfigValues *config = config_snapshot();
+    size_t host_len;
+    const uint8_t *host = config_broker_host(config, &host_len);
+    connecting = true;
+    if (!mqtt_open_connection(&command_channel, TAG_CHANNEL_MQTT_COMMAND,
+                              CHANNEL_BUFFERS_COMMAND, BUF_COMMAND_SEND, BUF_COMMAND_RECEIVE,
+                              config, command_client, client_id_len,
+                              endpoint ? endpoint->host : host,
+                              endpoint ? endpoint->host_len : host_len,
+                              endpoint ? endpoint->port : config_broker_port(config),
+                              false)) {
+        command_abandon_connect("connect could not be requested");
+    }
+}
+
+/*
+ * @brief Is a connect waiting on its CONNACK?  Read from the notification ISR.
+ */
+bool command_is_connecting() {
+    return connecting;
+}
+
+/*
+ * @brief Give up on the connect in progress; does nothing if there is none.
+ *
+ * Called when the connect cannot be requested, the channel closes before
+ * CONNACK, no CONNACK arrives within MQTT_CONNECT_TIMEOUT_MS, or the broker
+ * refuses the connection.  OnCommandChannelConnectFailed closes the channel.
+ *
+ * @param reason Why, for the log
+ */
+void command_abandon_connect(const char *reason) {
+    if (!connecting) {
+        return;
+    }
+    connecting = false;
+
+    server_error("command channel connect failed: %s", reason);
+    pushWorkMessage(OnCommandChannelConnectFailed);
+}
+
+void command_subscribe() {
+    if (!mqtt_request_subscriptions(command_channel)) {
+        pushWorkMessage(OnCommandChannelFailed);
+    }
+}
+
+bool command_is_connected() {
+    return connected;
+}
+
+/*
+ * @brief Did the broker resume the command connection's session, and its subscriptions?
+ */
+bool command_is_session_present() {
+    return session_present;
+}
+
+void command_handle_readable_event() {
+    enum MvMqttReadableDataType readableDataType;
+    if (mvMqttGetNextReadableDataType(command_channel, &readableDataType) != MV_STATUS_OKAY) {
+        pushWorkMessage(OnCommandChannelFailed);
+        return;
+    }
+
+    switch (readableDataType) {
+        case MV_MQTTREADABLEDATATYPE_CONNECTRESPONSE:
+            if (mqtt_read_connect_response(command_channel, &session_present)) {
+                server_log("command channel connected (%s session)", session_present ? "resumed" : "new");
+                connecting = false;
+                connected = true;
+                pushWorkMessage(OnCommandChannelConnected);
+            } else {
+                command_abandon_connect("connect refused");
+            }
+            break;
+        case MV_MQTTREADABLEDATATYPE_MESSAGERECEIVED:
+            // Only one connection carries subscriptions, so this is dispatched as usual
+            pushWorkMessage(OnMQTTEventMessageReceived);
+            break;
+        case MV_MQTTREADABLEDATATYPE_MESSAGELOST:
+            if (!mqtt_read_lost_message(command_channel)) {
+                pushWorkMessage(OnCommandChannelFailed);
+            }
+            break;
+        case MV_MQTTREADABLEDATATYPE_SUBSCRIBERESPONSE:
+            pushWorkMessage(mqtt_read_subscribe_response(command_channel) ? OnCommandChannelSubscribed
+                                                                          : OnCommandChannelFailed);
+            break;
+        case MV_MQTTREADABLEDATATYPE_PUBLISHRESPONSE:
+            if (!mqtt_read_publish_response(command_channel, NULL)) {
+                pushWorkMessage(OnCommandChannelFailed);
+            }
+            break;
+        case MV_MQTTREADABLEDATATYPE_DISCONNECTRESPONSE:
+            pushWorkMessage(OnCommandChannelDropped);
+            break;
+        case MV_MQTTREADABLEDATATYPE_UNSUBSCRIBERESPONSE:
+        case MV_MQTTREADABLEDATATYPE_NONE:
+        default:
+            break;
+    }
+}
+
+bool command_get_received_message_data(uint32_t *correlation_id,
+                                       uint8_t **topic, uint32_t *topic_len,
+                                       uint8_t **payload, uint32_t *payload_len,
+                                       uint32_t *qos, uint8_t *retain) {
+    return mqtt_receive_message(command_channel, correlation_id, topic, topic_len, payload, payload_len, qos, retain);
+}
+
+void command_acknowledge_message(uint32_t correlation_id) {
+    if (!mqtt_ack_message(command_channel, correlation_id)) {
+        pushWorkMessage(OnCommandChannelFailed);
+    }
+}
+
+/*
+ * @brief Publish on the command connection, eg. an rpc reply.
+ *
+ * @retval true if the publish request was accepted.
+ */
+bool command_publish(const uint8_t *topic, size_t topic_len, const uint8_t *payload, size_t payload_len) {
+    enum MvStatus status = mqtt_request_publish(command_channel, topic, topic_len, payload, payload_len);
+    if (status != MV_STATUS_OKAY && status != MV_STATUS_RATELIMITED) {
+        pushWorkMessage(OnCommandChannelFailed);
+    }
+    return status == MV_STATUS_OKAY;
+}
+
+void command_disconnect() {
+    enum MvStatus status = mvMqttRequestDisconnect(command_channel);
+    if (status != MV_STATUS_OKAY) {
+        server_error("mvMqttRequestDisconnect returned 0x%02x\n", (int) status);
+        pushWorkMessage(OnCommandChannelDropped);
+    }
+}
+
+/*
+ * @brief Close the command channel after a disconnect, failed connect or drop.
+ */
+void command_teardown() {
+    connected = false;
+    connecting = false;
+    mqtt_close_connection(&command_channel, CHANNEL_BUFFERS_COMMAND);
+
+    pushWorkMessage(OnCommandChannelDisconnected);
+}
@@ -0,0 +1,72 @@
+/**
+ *
+ * Microvisor Command Handler
+ * Version 1.0.0
+ * Copyright © 2023, Twilio
+ * Licence: Apache 2.0
+ *
+ */
+
+
+#ifndef COMMAND_HANDLER_H
+#define COMMAND_HANDLER_H
+
+
+/*
+ * With COMMAND_CHANNEL defined (see mqtt_handler.h), the command and rpc
+ * subscriptions live on this second mqtt connection rather than the main one.
+ * It has its own small channel buffers and notification tag, so a burst of
+ * telemetry filling the main connection's send buffer cannot hold up commands
+ * arriving or rpc replies leaving.
+ *
+ * The work task brings each connection up and down independently; messages
+ * received here are dispatched exactly as they would be from the main
+ * connection.
+ */
+
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "channel_buffer_helper.h"
+#include "rpc_handler.h"
+
+
+/*
+ * DEFINES
+ */
+// Room for the largest rpc reply, in whole channel buffer blocks
+#define BUF_COMMAND_SEND (((BUF_RPC_PUBLISH + CHANNEL_BUFFER_BLOCK - 1) / CHANNEL_BUFFER_BLOCK) * CHANNEL_BUFFER_BLOCK)
+#define BUF_COMMAND_RECEIVE 2048
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * PROTOTYPES
+ */
+void command_connect();
+bool command_is_connecting();
+void command_abandon_connect(const char *reason);
+void command_subscribe();
+bool command_is_connected();
+bool command_is_session_present();
+void command_handle_readable_event();
+bool command_get_received_message_data(uint32_t *correlation_id,
+                                       uint8_t **topic, uint32_t *topic_len,
+                                       uint8_t **payload, uint32_t *payload_len,
+                                       uint32_t *qos, uint8_t *retain);
+void command_acknowledge_message(uint32_t correlation_id);
+bool command_publish(const uint8_t *topic, size_t topic_len, const uint8_t *payload, size_t payload_len);
+void command_disconnect();
+void command_teardown();
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif /* COMMAND_HANDLER_H */
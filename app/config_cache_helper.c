@@ -0,0 +1,293 @@
+/**
+ *
+ * Microvisor Config Cache Helper
+ * Version 1.0.0
+ * Copyright © 2023, Twilio
+ * Licence: Apache 2.0
+ *
+ */
+
+#include "config_cache_helper.h"
+#include <string.h>
+
+#include "stm32u5xx_hal.h"
+
+#include "log_helper.h"
+
+#define LOG_MODULE LOG_MODULE_CONFIG
+
+
+#define CONFIG_CACHE_HEADER_SIZE 16
+#define CONFIG_CACHE_QUADWORD 16
+
+// The page config_cache.ld keeps clear of the application image
+extern const uint8_t config_cache_page[];
+
+struct ConfigCacheHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t length;
+    uint32_t crc;
+};
+
+// Items are written a quadword at a time, the smallest unit the flash programs
+struct ConfigCacheWriter {
+    uint32_t address;
+    uint32_t length;
+    uint32_t crc;
+    uint8_t quadword[CONFIG_CACHE_QUADWORD] __attribute__ ((aligned(4)));
+    uint32_t fill;
+    bool failed;
+};
+
+
+static uint32_t crc32_update(uint32_t crc, const uint8_t *data, size_t len) {
+    crc = ~crc;
+    for (size_t ndx = 0; ndx < len; ndx++) {
+        crc ^= data[ndx];
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+        }
+    }
+    return ~crc;
+}
+
+static const uint8_t *cache_page() {
+    return (const uint8_t *)(uintptr_t)CONFIG_CACHE_FLASH_ADDRESS;
+}
+
+/**
+ * @brief Is the page the cache uses the one the link checked?
+ */
+static bool cache_page_reserved() {
+    if ((uintptr_t)config_cache_page == CONFIG_CACHE_FLASH_ADDRESS) {
+        return true;
+    }
+    server_error("config cache page 0x%08lx is not the page config_cache.ld reserves (0x%08lx)",
+                 (uint32_t)CONFIG_CACHE_FLASH_ADDRESS, (uint32_t)(uintptr_t)config_cache_page);
+    return false;
+}
+
+/**
+ * @brief An item's value in values as bytes, and the most it can hold.
+ */
+static uint8_t *item_value(const struct ConfigHelperItem *item, const void *values, uint32_t *len, uint32_t *capacity) {
+    switch (item->config_type) {
+        case CONFIG_ITEM_TYPE_UINT8:
+        case CONFIG_ITEM_TYPE_HEX:
+        case CONFIG_ITEM_TYPE_BASE64:
+            *len = *config_item_len(item, values);
+            *capacity = item->u8_item.buf_size;
+            return config_item_buf(item, values);
+        case CONFIG_ITEM_TYPE_ULONG:
+        case CONFIG_ITEM_TYPE_LONG:
+            *len = *capacity = item->number_item.size;
+            return (uint8_t *)config_item_number(item, values);
+    }
+
+    *len = *capacity = 0;
+    return NULL;
+}
+
+
+static bool item_value_is_buffer(const struct ConfigHelperItem *item) {
+    return item->config_type == CONFIG_ITEM_TYPE_UINT8
+        || item->config_type == CONFIG_ITEM_TYPE_HEX
+        || item->config_type == CONFIG_ITEM_TYPE_BASE64;
+}
+
+
+/*
+ * LOAD
+ */
+
+/**
+ * @brief Walk the cached items, checking each against the item it should hold and
+ *        copying it into values if apply is set.
+ */
+static bool walk_items(const uint8_t *data, uint32_t length, const struct ConfigHelperItem *items, uint8_t count,
+                       void *values, bool apply) {
+    uint32_t offset = 0;
+
+    for (int ndx = 0; ndx < count; ndx++) {
+        const struct MvSizedString *key = &items[ndx].item.key;
+        if (offset + 1 + key->length + 1 + 2 > length
+            || data[offset] != key->length
+            || memcmp(&data[offset + 1], key->data, key->length) != 0
+            || data[offset + 1 + key->length] != items[ndx].config_type) {
+            return false;
+        }
+        offset += 1 + key->length + 1;
+
+        uint32_t value_len = data[offset] | (data[offset + 1] << 8);
+        offset += 2;
+
+        uint32_t live_len, capacity;
+        uint8_t *value = item_value(&items[ndx], values, &live_len, &capacity);
+        if (value_len > capacity || offset + value_len > length) {
+            return false;
+        }
+
+        if (apply) {
+            memcpy(value, &data[offset], value_len);
+            if (item_value_is_buffer(&items[ndx])) {
+                *config_item_len(&items[ndx], values) = value_len;
+            }
+        }
+        offset += value_len;
+    }
+
+    return offset == length;
+}
+
+/**
+ * @brief Populate the items in values from the cache, if it is intact and holds exactly these items.
+ *
+ * @retval false, with values untouched, if there is no usable cache.
+ */
+bool config_cache_load(const struct ConfigHelperItem *items, uint8_t count, void *values) {
+    if (!cache_page_reserved()) {
+        return false;
+    }
+
+    struct ConfigCacheHeader header;
+    memcpy(&header, cache_page(), sizeof(header));
+
+    if (header.magic != CONFIG_CACHE_MAGIC || header.version != CONFIG_CACHE_VERSION
+        || header.length > FLASH_PAGE_SIZE - CONFIG_CACHE_HEADER_SIZE) {
+        server_log("no config cache");
+        return false;
+    }
+
+    const uint8_t *data = cache_page() + CONFIG_CACHE_HEADER_SIZE;
+    if (crc32_update(0, data, header.length) != header.crc) {
+        server_error("config cache failed its crc check");
+        return false;
+    }
+
+    if (!walk_items(data, header.length, items, count, values, false)) {
+        server_log("config cache holds different items, ignoring it");
+        return false;
+    }
+
+    walk_items(data, header.length, items, count, values, true);
+    server_log("loaded %d config items from cache", count);
+    return true;
+}
+
+
+/*
+ * SAVE
+ */
+
+static void write_quadword(struct ConfigCacheWriter *writer, uint32_t address, const uint8_t *quadword) {
+    if (!writer->failed && HAL_FLASH_Program(FLASH_TYPEPROGRAM_QUADWORD, address, (uint32_t)(uintptr_t)quadword) != HAL_OK) {
+        writer->failed = true;
+    }
+}
+
+static void write_bytes(struct ConfigCacheWriter *writer, const uint8_t *data, uint32_t len) {
+    writer->crc = crc32_update(writer->crc, data, len);
+    writer->length += len;
+
+    while (len != 0) {
+        uint32_t chunk = CONFIG_CACHE_QUADWORD - writer->fill;
+        if (chunk > len) {
+            chunk = len;
+        }
+        memcpy(&writer->quadword[writer->fill], data, chunk);
+        writer->fill += chunk;
+        data += chunk;
+        len -= chunk;
+
+        if (writer->fill == CONFIG_CACHE_QUADWORD) {
+            write_quadword(writer, writer->address, writer->quadword);
+            writer->address += CONFIG_CACHE_QUADWORD;
+            writer->fill = 0;
+        }
+    }
+}
+
+static void flush_bytes(struct ConfigCacheWriter *writer) {
+    if (writer->fill != 0) {
+        memset(&writer->quadword[writer->fill], 0xFF, CONFIG_CACHE_QUADWORD - writer->fill);
+        write_quadword(writer, writer->address, writer->quadword);
+        writer->address += CONFIG_CACHE_QUADWORD;
+        writer->fill = 0;
+    }
+}
+
+/**
+ * @brief Replace the cache with the items' values in values.
+ *
+ * @retval false if the flash could not be erased or programmed; the cache is then invalid.
+ */
+bool config_cache_save(const struct ConfigHelperItem *items, uint8_t count, const void *values) {
+    if (!cache_page_reserved()) {
+        return false;
+    }
+
+    uint32_t total = 0;
+    for (int ndx = 0; ndx < count; ndx++) {
+        uint32_t len, capacity;
+        item_value(&items[ndx], values, &len, &capacity);
+        total += 1 + items[ndx].item.key.length + 1 + 2 + len;
+    }
+    if (total > FLASH_PAGE_SIZE - CONFIG_CACHE_HEADER_SIZE) {
+        server_error("config too large to cache: %lu bytes", total);
+        return false;
+    }
+
+    HAL_FLASH_Unlock();
+
+    FLASH_EraseInitTypeDef erase = {
+        .TypeErase = FLASH_TYPEERASE_PAGES,
+        .Banks = CONFIG_CACHE_FLASH_BANK,
+        .Page = CONFIG_CACHE_FLASH_PAGE,
+        .NbPages = 1
+    };
+    uint32_t page_error = 0;
+    if (HAL_FLASHEx_Erase(&erase, &page_error) != HAL_OK) {
+        HAL_FLASH_Lock();
+        server_error("could not erase config cache page");
+        return false;
+    }
+
+    struct ConfigCacheWriter writer = {
+        .address = CONFIG_CACHE_FLASH_ADDRESS + CONFIG_CACHE_HEADER_SIZE
+    };
+
+    for (int ndx = 0; ndx < count; ndx++) {
+        uint32_t len, capacity;
+        const uint8_t *value = item_value(&items[ndx], values, &len, &capacity);
+        uint8_t key_len = (uint8_t)items[ndx].item.key.length;
+        uint8_t type = (uint8_t)items[ndx].config_type;
+        uint8_t value_len[2] = { len & 0xFF, (len >> 8) & 0xFF };
+
+        write_bytes(&writer, &key_len, 1);
+        write_bytes(&writer, items[ndx].item.key.data, key_len);
+        write_bytes(&writer, &type, 1);
+        write_bytes(&writer, value_len, 2);
+        write_bytes(&writer, value, len);
+    }
+    flush_bytes(&writer);
+
+    // Header last: until it is written the page reads as having no cache
+    struct ConfigCacheHeader header __attribute__ ((aligned(4))) = {
+        .magic = CONFIG_CACHE_MAGIC,
+        .version = CONFIG_CACHE_VERSION,
+        .length = writer.length,
+        .crc = writer.crc
+    };
+    write_quadword(&writer, CONFIG_CACHE_FLASH_ADDRESS, (const uint8_t *)&header);
+
+    HAL_FLASH_Lock();
+
+    if (writer.failed) {
+        server_error("could not program config cache");
+        return false;
+    }
+
+    server_trace("cached %d config items (%lu bytes)", count, writer.length);
+    return true;
+}
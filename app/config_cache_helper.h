@@ -0,0 +1,70 @@
+/**
+ *
+ * Microvisor Config Cache Helper
+ * Version 1.0.0
+ * Copyright © 2023, Twilio
+ * Licence: Apache 2.0
+ *
+ */
+
+/* A copy of the last validated configuration in a page of flash.
+ *
+ * With CONFIG_CACHE defined (see work.h), the work task loads this at boot,
+ * so it can connect to the broker as soon as the network is up. The config
+ * channel then revalidates the values in the background. The cache is
+ * rewritten only when a fetch changes something.
+ *
+ * The page holds a 16-byte header followed by the items. The header has a
+ * magic number, CONFIG_CACHE_VERSION, the length of the items and their
+ * CRC-32. The header is written last, so an interrupted write leaves it
+ * erased and the cache is ignored. Each item is stored with its key, so a
+ * build that fetches a different set of items also ignores the cache.  Like a
+ * fetch, a load fills the uncommitted generation of values, which the work
+ * task then commits (see config_schema.h).
+ *
+ * The page is the last 8 KB page of the STM32U585's 2 MB of flash, in bank 2
+ * at 0x081FE000.  The linker script comes with the HAL, so app/config_cache.ld
+ * is added to the link to define config_cache_page there and fail the build
+ * if the application image reaches it; the cache refuses to run if that page
+ * and CONFIG_CACHE_FLASH_ADDRESS ever disagree.  The cache holds the
+ * device's private key unencrypted, so only enable it where that is
+ * acceptable.
+ */
+#ifndef CONFIG_CACHE_HELPER_H
+#define CONFIG_CACHE_HELPER_H
+
+/*
+ * INCLUDES
+ */
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "config_handler.h"
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * DEFINES
+ */
+#define CONFIG_CACHE_MAGIC 0x4343564D   // "MVCC"
+#define CONFIG_CACHE_VERSION 1
+
+// Last page of the second bank; keep config_cache.ld in step
+#define CONFIG_CACHE_FLASH_BANK FLASH_BANK_2
+#define CONFIG_CACHE_FLASH_PAGE (FLASH_PAGE_NB - 1)
+#define CONFIG_CACHE_FLASH_ADDRESS (FLASH_BASE_NS + FLASH_BANK_SIZE + CONFIG_CACHE_FLASH_PAGE * FLASH_PAGE_SIZE)
+
+/*
+ * PROTOTYPES
+ */
+bool config_cache_load(const struct ConfigHelperItem *items, uint8_t count, void *values);
+bool config_cache_save(const struct ConfigHelperItem *items, uint8_t count, const void *values);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CONFIG_CACHE_HELPER_H */
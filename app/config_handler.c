@@ -11,12 +11,51 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <assert.h>
 
 #include "work.h"
 #include "network_helper.h"
 #include "log_helper.h"
+#include "timing_helper.h"
+#include "channel_buffer_helper.h"
+#include "decode_helper.h"
+
+#define LOG_MODULE LOG_MODULE_CONFIG
 
 static MvChannelHandle configuration_channel = 0;
+static uint32_t changed_items = 0;
+
+// The keys requested by the fetch in flight, as indexes into the items
+static enum ConfigFetchPhase fetch_phase = CONFIG_FETCH_FULL;
+static uint8_t fetch_map[CONFIG_MAX_ITEMS];
+static uint8_t fetch_count = 0;
+
+static uint64_t fetch_started_microsec = 0;
+static uint32_t fetch_bytes = 0;
+static struct ConfigFetchStats fetch_stats = {0};
+
+// HEX and BASE64 items arrive here, one at a time, and are decoded into their
+// storage, which only has to hold the decoded value
+static uint8_t receive_scratch[sizeof(union ConfigReceiveScratch)];
+
+#if defined(CONFIG_DELTA)
+// FNV-1a of each item's value as last received, before decoding
+static uint32_t item_hashes[CONFIG_MAX_ITEMS];
+static uint32_t hashed_items = 0;
+
+static uint8_t manifest[BUF_CONFIG_MANIFEST];
+static uint32_t manifest_len = 0;
+static bool manifest_available = false;
+
+static const struct MvConfigKeyToFetch manifest_key = {
+    .scope = MV_CONFIGKEYFETCHSCOPE_DEVICE,
+    .store = MV_CONFIGKEYFETCHSTORE_CONFIG,
+    STRING_ITEM(key, CONFIG_MANIFEST_KEY)
+};
+#endif
+
+static bool send_fetch_request(const struct ConfigHelperItem *items);
+
 
 /**
  * CONFIGURATION OPERATIONS
@@ -26,6 +65,12 @@ static MvChannelHandle configuration_channel = 0;
  * @brief Open channel for configuration tasks
  */
 void start_configuration_fetch(const struct ConfigHelperItem *items, uint8_t count) {
+    struct ChannelBuffers buffers;
+    if (!channel_buffers_acquire(CHANNEL_BUFFERS_CONFIG, BUF_CONFIG_SEND_SIZE, BUF_CONFIG_RECEIVE_SIZE, &buffers)) {
+        pushWorkMessage(OnConfigFailed);
+        return;
+    }
+
     MvNetworkHandle network_handle = get_network_handle();
     struct MvOpenChannelParams ch_params = {
         .version = 1,
@@ -33,10 +78,10 @@ void start_configuration_fetch(const struct ConfigHelperItem *items, uint8_t cou
             .notification_handle = work_notification_center_handle,
             .notification_tag = TAG_CHANNEL_CONFIG,
             .network_handle = network_handle,
-            .receive_buffer = (uint8_t*)work_receive_buffer,
-            .receive_buffer_len = sizeof(work_receive_buffer),
-            .send_buffer = (uint8_t*)work_send_buffer,
-            .send_buffer_len = sizeof(work_send_buffer),
+            .receive_buffer = buffers.receive_buffer,
+            .receive_buffer_len = buffers.receive_buffer_len,
+            .send_buffer = buffers.send_buffer,
+            .send_buffer_len = buffers.send_buffer_len,
             .channel_type = MV_CHANNELTYPE_CONFIGFETCH,
             STRING_ITEM(endpoint, "")
         }
@@ -45,41 +90,316 @@ void start_configuration_fetch(const struct ConfigHelperItem *items, uint8_t cou
     enum MvStatus status;
     if ((status = mvOpenChannel(&ch_params, &configuration_channel)) != MV_STATUS_OKAY) {
         server_error("encountered error opening config channel: %x", status);
+        channel_buffers_open_failed(CHANNEL_BUFFERS_CONFIG, status);
         pushWorkMessage(OnConfigFailed);
         return;
     }
 
-    struct MvConfigKeyToFetch config_items[count];
-    memset(config_items, 0, sizeof(config_items));
-    for (int ndx=0; ndx<count; ndx++) {
-        memcpy(&config_items[ndx], &items[ndx].item, sizeof(struct MvConfigKeyToFetch));
+    fetch_bytes = 0;
+    mvGetMicroseconds(&fetch_started_microsec);
+
+#if defined(CONFIG_DELTA)
+    if (manifest_available && hashed_items == ALL_ITEMS(count)) {
+        // Every value's hash is known, so the manifest alone says what changed
+        fetch_phase = CONFIG_FETCH_MANIFEST;
+        fetch_count = 0;
+    } else
+#endif
+    {
+        fetch_phase = CONFIG_FETCH_FULL;
+        fetch_count = count;
+        for (int ndx=0; ndx<count; ndx++) {
+            fetch_map[ndx] = ndx;
+        }
+    }
+
+    if (!send_fetch_request(items)) {
+        pushWorkMessage(OnConfigFailed);
+        return;
+    }
+
+    timing_mark(CONNECT_PHASE_CONFIG_REQUESTED);
+}
+
+/*
+ * @brief Request the items in fetch_map, and the manifest unless this is a delta fetch.
+ */
+static bool send_fetch_request(const struct ConfigHelperItem *items) {
+    struct MvConfigKeyToFetch config_items[CONFIG_MAX_ITEMS + 1];
+    uint32_t num_keys = 0;
+    for (int ndx=0; ndx<fetch_count; ndx++) {
+        memcpy(&config_items[num_keys++], &items[fetch_map[ndx]].item, sizeof(struct MvConfigKeyToFetch));
     }
+#if defined(CONFIG_DELTA)
+    if (fetch_phase != CONFIG_FETCH_DELTA) {
+        memcpy(&config_items[num_keys++], &manifest_key, sizeof(struct MvConfigKeyToFetch));
+    }
+#endif
 
     struct MvConfigKeyFetchParams request = {
-        .num_items = count,
+        .num_items = num_keys,
         .keys_to_fetch = config_items,
     };
 
-#if defined(CONFIG_DEBUGGING)
-    server_log("requesting %d configuration items", count);
-#endif
+    server_trace("requesting %lu configuration items", num_keys);
 
+    enum MvStatus status;
     if ((status = mvSendConfigFetchRequest(configuration_channel, &request)) != MV_STATUS_OKAY) {
         server_error("encountered an error requesting config: %x", status);
-        pushWorkMessage(OnConfigFailed);
+        return false;
+    }
+    return true;
+}
+
+#if defined(CONFIG_DELTA)
+/*
+ * @brief FNV-1a over a value as received, to compare with the manifest's.
+ */
+static uint32_t value_hash(const uint8_t *data, size_t len) {
+    uint32_t hash = 0x811C9DC5;
+    for (size_t ndx = 0; ndx < len; ndx++) {
+        hash = (hash ^ data[ndx]) * 0x01000193;
     }
+    return hash;
 }
+#endif
 
-void receive_configuration_items(struct ConfigHelperItem *items, uint8_t count) {
+/*
+ * @brief Read one item of the config fetch response into data, which holds size bytes.
+ */
+static bool read_value(int ndx, uint8_t *data, size_t size, uint32_t *len) {
+    enum MvConfigKeyFetchResult result;
+    struct MvConfigResponseReadItemParams params = {
+        .item_index = ndx,
+        .result = &result,
+        .buf = {
+            .data = data,
+            .size = size,
+            .length = len
+        }
+    };
+
+    server_trace("fetching item %d", params.item_index);
+
+    enum MvStatus status;
+    if ((status = mvReadConfigResponseItem(configuration_channel, &params)) != MV_STATUS_OKAY) {
+        server_error("error reading config item index %d - %d (MvConfigFetchResult)", params.item_index, status);
+        return false;
+    }
+    if (result != MV_CONFIGKEYFETCHRESULT_OK) {
+        server_error("unexpected result reading config item index %d - %d (MvConfigKeyFetchResult)", params.item_index, result);
+        return false;
+    }
+
+    fetch_bytes += *len;
+    return true;
+}
+
+/*
+ * @brief Read a buffer item into its buffer in values, decoding it on the way.
+ *
+ * UINT8 items are read straight into the buffer.  Encoded items are read into
+ * receive_scratch and must decode to fit the buffer.  The buffer is
+ * overwritten even if this fails.  raw_hash is set to the hash of the value
+ * as received, with CONFIG_DELTA.
+ */
+static bool receive_buffer_item(const struct ConfigHelperItem *item, void *values, int response_ndx, int ndx, uint32_t *raw_hash) {
+    uint8_t *buf = config_item_buf(item, values);
+    bool encoded = item->config_type != CONFIG_ITEM_TYPE_UINT8;
+    uint8_t *in = encoded ? receive_scratch : buf;
+    uint32_t len = 0;
+    if (!read_value(response_ndx, in, encoded ? sizeof(receive_scratch) : item->u8_item.buf_size, &len)) {
+        return false;
+    }
+#if defined(CONFIG_DELTA)
+    *raw_hash = value_hash(in, len);
+#endif
+
+    if (encoded) {
+        bool hex = item->config_type == CONFIG_ITEM_TYPE_HEX;
+        size_t decoded_len = 0;
+        if (!(hex ? decode_hex(in, len, buf, item->u8_item.buf_size, &decoded_len)
+                  : decode_base64(in, len, buf, item->u8_item.buf_size, &decoded_len))) {
+            server_error("received config item # %d is not valid %s", ndx, hex ? "hex" : "base64");
+            return false;
+        }
+        len = decoded_len;
+    }
+
+    *config_item_len(item, values) = len;
 #if defined(CONFIG_DEBUGGING)
-    server_log("receiving %d configuration results", count);
+    // Values include secrets, so only ever compiled in on request
+    if (item->config_type == CONFIG_ITEM_TYPE_UINT8) {
+        server_trace("item[%d]: %.*s", ndx, LOG_STRING(buf, len));
+    } else if (len != 0) {
+        server_trace("item[%d][%d] = 0x%02x", ndx, len - 1, buf[len - 1]);
+    }
 #endif
+    return true;
+}
 
-    uint8_t read_buffer[BUF_READ_BUFFER] __attribute__ ((aligned(512))); // needs to support largest config item, likely string encoded hex for private key (~2400 bytes)
-    uint32_t read_buffer_used = 0;
+static void set_number_value(const struct ConfigHelperItem *item, void *values, int64_t val) {
+    void *number = config_item_number(item, values);
+    switch (item->number_item.size) {
+        case 1:
+            *(uint8_t *)number = (uint8_t)val;
+            break;
+        case 2:
+            *(uint16_t *)number = (uint16_t)val;
+            break;
+        default:
+            *(uint32_t *)number = (uint32_t)val;
+            break;
+    }
+}
+
+/*
+ * @brief Read a numeric item into values, if it lies within the item's range.
+ *
+ * raw_hash is set to the hash of the digits as received, with CONFIG_DELTA.
+ */
+static bool receive_number_item(const struct ConfigHelperItem *item, void *values, int response_ndx, int ndx, uint32_t *raw_hash) {
+    uint8_t digits[CONFIG_NUMBER_DIGITS + 1];
+    uint32_t len = 0;
+    if (!read_value(response_ndx, digits, CONFIG_NUMBER_DIGITS, &len)) {
+        return false;
+    }
+#if defined(CONFIG_DELTA)
+    *raw_hash = value_hash(digits, len);
+#endif
+    digits[len] = '\0';
+
+    char *end = NULL;
+    int64_t val = strtoll((const char *)digits, &end, 10);
+    if (len == 0 || *end != '\0' || val < item->number_item.min || val > item->number_item.max) {
+        server_error("received config item # %d is not a number in range: %s", ndx, digits);
+        return false;
+    }
+
+    set_number_value(item, values, val);
+    server_trace("item[%d] = %ld", ndx, (long)val);
+    return true;
+}
+
+static bool item_is_number(const struct ConfigHelperItem *item) {
+    return item->config_type == CONFIG_ITEM_TYPE_ULONG || item->config_type == CONFIG_ITEM_TYPE_LONG;
+}
+
+/*
+ * @brief Does an item's value in one generation differ from another's?
+ */
+static bool item_differs(const struct ConfigHelperItem *item, const void *values, const void *other) {
+    if (item_is_number(item)) {
+        return memcmp(config_item_number(item, values), config_item_number(item, other), item->number_item.size) != 0;
+    }
+
+    size_t len = *config_item_len(item, values);
+    return len != *config_item_len(item, other)
+        || memcmp(config_item_buf(item, values), config_item_buf(item, other), len) != 0;
+}
+
+#if defined(CONFIG_DELTA)
+/*
+ * @brief Read the manifest from the response; false if the store has none.
+ */
+static bool read_manifest(int response_ndx) {
+    manifest_len = 0;
+    manifest_available = read_value(response_ndx, manifest, sizeof(manifest), &manifest_len);
+    return manifest_available;
+}
+
+/*
+ * @brief The manifest's hash for a key, from its "key:hash" entries.
+ */
+static bool manifest_hash(const struct MvSizedString *key, uint32_t *hash) {
+    uint32_t pos = 0;
+    while (pos < manifest_len) {
+        uint32_t end = pos;
+        while (end < manifest_len && manifest[end] != ',') {
+            end++;
+        }
+
+        if (end - pos == key->length + 1 + 8 && manifest[pos + key->length] == ':'
+            && memcmp(&manifest[pos], key->data, key->length) == 0) {
+            uint8_t bytes[4];
+            size_t bytes_len = 0;
+            if (!decode_hex(&manifest[pos + key->length + 1], 8, bytes, sizeof(bytes), &bytes_len)) {
+                return false;
+            }
+            *hash = ((uint32_t)bytes[0] << 24) | ((uint32_t)bytes[1] << 16) | ((uint32_t)bytes[2] << 8) | bytes[3];
+            return true;
+        }
+        pos = end + 1;
+    }
+    return false;
+}
+
+/*
+ * @brief Point fetch_map at the items whose manifest hash differs from the value we hold.
+ */
+static void select_changed_items(const struct ConfigHelperItem *items, uint8_t count) {
+    fetch_count = 0;
+    for (int ndx=0; ndx<count; ndx++) {
+        uint32_t hash;
+        if (!manifest_hash(&items[ndx].item.key, &hash) || hash != item_hashes[ndx]) {
+            fetch_map[fetch_count++] = ndx;
+        }
+    }
+}
+
+/*
+ * @brief Count fetched values that do not match the manifest; they are fetched again every time.
+ */
+static void check_manifest(const struct ConfigHelperItem *items) {
+    for (int fetch_ndx=0; fetch_ndx<fetch_count; fetch_ndx++) {
+        int ndx = fetch_map[fetch_ndx];
+        uint32_t hash;
+        if (manifest_hash(&items[ndx].item.key, &hash) && hash != item_hashes[ndx]) {
+            fetch_stats.stale_manifest++;
+            server_log("config manifest is out of date for %.*s (%08lx)",
+                       LOG_STRING(items[ndx].item.key.data, items[ndx].item.key.length), item_hashes[ndx]);
+        }
+    }
+}
+#endif
+
+static void record_fetch() {
+    uint64_t now = 0;
+    mvGetMicroseconds(&now);
+    uint32_t elapsed_ms = (uint32_t)((now - fetch_started_microsec) / 1000);
+
+    fetch_stats.last_bytes = fetch_bytes;
+    fetch_stats.total_bytes += fetch_bytes;
+    fetch_stats.last_ms = elapsed_ms;
+    if (elapsed_ms > fetch_stats.max_ms) {
+        fetch_stats.max_ms = elapsed_ms;
+    }
+    server_trace("config fetch took %lu ms for %lu bytes", elapsed_ms, fetch_bytes);
+}
+
+/*
+ * @brief Read the config fetch response into the staging generation of values.
+ *
+ * Each item is read into its storage in staging, by way of receive_scratch if
+ * it has to be decoded.  staging must start as a copy of live, as a delta
+ * fetch writes only the items that changed.  Whether an item changed is
+ * judged against live, which is never written: if any item fails to read or
+ * decode, staging is abandoned and live stays as it was.  On OnConfigObtained
+ * the caller commits staging if anything changed.
+ *
+ * With CONFIG_DELTA, a response to the manifest alone instead requests the
+ * items it shows have changed, on the same channel, and this is called
+ * again with their values.
+ */
+void receive_configuration_items(const struct ConfigHelperItem *items, uint8_t count,
+                                 const void *live, void *staging) {
+    server_trace("receiving %d configuration results", count);
 
     struct MvConfigResponseData response;
 
+    changed_items = 0;
+    assert(count <= CONFIG_MAX_ITEMS);
+
     enum MvStatus status;
     if ((status = mvReadConfigFetchResponseData(configuration_channel, &response)) != MV_STATUS_OKAY) {
         server_error("encountered an error fetching configuration response");
@@ -93,115 +413,100 @@ void receive_configuration_items(struct ConfigHelperItem *items, uint8_t count)
         return;
     }
 
-    if (response.num_items != count) {
-        server_error("received different number of items than expected %d != %d", count, response.num_items);
+    uint32_t expected = fetch_count;
+#if defined(CONFIG_DELTA)
+    if (fetch_phase != CONFIG_FETCH_DELTA) {
+        expected++;
+    }
+#endif
+    if (response.num_items != expected) {
+        server_error("received different number of items than expected %d != %d", expected, response.num_items);
         pushWorkMessage(OnConfigFailed);
         return;
     }
 
-    enum MvConfigKeyFetchResult result;
-    struct MvConfigResponseReadItemParams item = {
-        .item_index = 0,
-        .result = &result,
-        .buf = {
-            .data = read_buffer,
-            .size = sizeof(read_buffer) - 1,
-            .length = &read_buffer_used
+#if defined(CONFIG_DELTA)
+    if (fetch_phase == CONFIG_FETCH_MANIFEST) {
+        if (read_manifest(0)) {
+            select_changed_items(items, count);
+            if (fetch_count == 0) {
+                fetch_stats.unchanged++;
+                record_fetch();
+                pushWorkMessage(OnConfigObtained);
+                return;
+            }
+            fetch_phase = CONFIG_FETCH_DELTA;
+        } else {
+            fetch_phase = CONFIG_FETCH_FULL;
+            fetch_count = count;
+            for (int ndx=0; ndx<count; ndx++) {
+                fetch_map[ndx] = ndx;
+            }
         }
-    };
 
-    for (int ndx=0; ndx<count; ndx++) {
-        item.item_index = ndx;
-#if defined(CONFIG_DEBUGGING)
-        server_log("fetching item %d", item.item_index);
+        if (!send_fetch_request(items)) {
+            pushWorkMessage(OnConfigFailed);
+        }
+        return;
+    }
 #endif
 
-        if ((status = mvReadConfigResponseItem(configuration_channel, &item)) != MV_STATUS_OKAY) {
-            server_error("error reading config item index %d - %d (MvConfigFetchResult)", item.item_index, status);
+    uint32_t changed = 0;
+    for (int fetch_ndx=0; fetch_ndx<fetch_count; fetch_ndx++) {
+        int ndx = fetch_map[fetch_ndx];
+        const struct ConfigHelperItem *item = &items[ndx];
+        uint32_t raw_hash = 0;
+        bool received = item_is_number(item) ? receive_number_item(item, staging, fetch_ndx, ndx, &raw_hash)
+                                             : receive_buffer_item(item, staging, fetch_ndx, ndx, &raw_hash);
+
+        if (!received) {
+#if defined(CONFIG_DELTA)
+            // Some hashes are of values now being discarded, so refetch everything next time
+            hashed_items = 0;
+#endif
             pushWorkMessage(OnConfigFailed);
             return;
         }
-        if (result != MV_CONFIGKEYFETCHRESULT_OK) {
-            server_error("unexpected result reading config item index %d - %d (MvConfigKeyFetchResult)", item.item_index, result);
-            pushWorkMessage(OnConfigFailed);
-            return;
+        if (item_differs(item, staging, live)) {
+            changed |= 1UL << ndx;
         }
-
-        switch (items[ndx].config_type) {
-            case CONFIG_ITEM_TYPE_UINT8:
-                {
-                    if (read_buffer_used > items[ndx].u8_item.buf_size) {
-                        server_error("received config item # %d is too large to populate into buffer - %d > %d", ndx, read_buffer_used, items[ndx].u8_item.buf_size);
-                        pushWorkMessage(OnConfigFailed);
-                        return;
-                    }
-                    memcpy(items[ndx].u8_item.buf, read_buffer, read_buffer_used);
-                    *items[ndx].u8_item.buf_len = read_buffer_used;
-#if defined(CONFIG_DEBUGGING)
-                    server_log("item[%d]: %.*s", ndx, *items[ndx].u8_item.buf_len, items[ndx].u8_item.buf);
-#endif
-
-                    break;
-                }
-            case CONFIG_ITEM_TYPE_B64:
-                {
-                    if (read_buffer_used / 2 > items[ndx].u8_item.buf_size) {
-                        server_error("received config item # %d is too large to b64 decode into buffer - %d > %d", ndx, read_buffer_used, items[ndx].u8_item.buf_size);
-                        pushWorkMessage(OnConfigFailed);
-                        return;
-                    }
-
-                    *items[ndx].u8_item.buf_len = 0;
-
-                    for (int read_ndx=0; read_ndx < read_buffer_used; read_ndx+=2) {
-                        uint8_t val = 0;
-
-                        for (int n=0; n<2; n++) {
-                            char byte = read_buffer[read_ndx+n];
-                            if (byte >= '0' && byte <= '9') byte = byte - '0';
-                            else if (byte >= 'a' && byte <= 'f') byte = byte - 'a' + 10;
-                            else if (byte >= 'A' && byte <= 'F') byte = byte - 'A' + 10;
-                            val = (val << 4) | (byte & 0xf);
-                        }
-
-                        items[ndx].u8_item.buf[*(items[ndx].u8_item.buf_len)] = val;
-                        *(items[ndx].u8_item.buf_len) = *(items[ndx].u8_item.buf_len) + 1;
-                    }
-#if defined(CONFIG_DEBUGGING)
-                    server_log("item[%d][%d] = 0x%02x", ndx, (*items[ndx].u8_item.buf_len)-1, items[ndx].u8_item.buf[(*items[ndx].u8_item.buf_len)-1]);
-#endif
-
-                    break;
-                }
-            case CONFIG_ITEM_TYPE_ULONG:
-                {
-                    read_buffer[read_buffer_used] = '\0';
-                    *(items[ndx].ulong_item.val) = strtoul((const char *)read_buffer, NULL, 10);
-#if defined(CONFIG_DEBUGGING)
-                    server_log("item[%d] = %d (uint16_t)", ndx, *(items[ndx].ulong_item.val));
+#if defined(CONFIG_DELTA)
+        item_hashes[ndx] = raw_hash;
+        hashed_items |= 1UL << ndx;
 #endif
+    }
 
-                    break;
-                }
-            case CONFIG_ITEM_TYPE_LONG:
-                {
-                    read_buffer[read_buffer_used] = '\0';
-                    *(items[ndx].long_item.val) = strtol((const char *)read_buffer, NULL, 10);
-#if defined(CONFIG_DEBUGGING)
-                    server_log("item[%d] = %d (int16_t)", ndx, *(items[ndx].long_item.val));
+#if defined(CONFIG_DELTA)
+    if (fetch_phase == CONFIG_FETCH_FULL) {
+        read_manifest(fetch_count);
+    }
+    check_manifest(items);
 #endif
 
-                    break;
-                }
-        };
+    if (fetch_phase == CONFIG_FETCH_FULL) {
+        fetch_stats.full++;
+    } else {
+        fetch_stats.delta++;
     }
+    record_fetch();
 
+    changed_items = changed;
     pushWorkMessage(OnConfigObtained);
 }
 
+/*
+ * @brief Which items the last successful fetch changed, one bit per item index.
+ */
+uint32_t configuration_changed_items() {
+    return changed_items;
+}
+
+void configuration_fetch_stats(struct ConfigFetchStats *out) {
+    *out = fetch_stats;
+}
+
 void finish_configuration_fetch() {
-#if defined(CONFIG_DEBUGGING)
-    server_log("closing configuration channel");
-#endif
+    server_trace("closing configuration channel");
     mvCloseChannel(&configuration_channel);
+    channel_buffers_release(CHANNEL_BUFFERS_CONFIG);
 }
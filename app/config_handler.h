@@ -15,6 +15,7 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
 
 // Microvisor includes
 #include "stm32u5xx_hal.h"
@@ -33,7 +34,27 @@
  */
 #define TAG_CHANNEL_CONFIG 100
 
-#define BUF_READ_BUFFER 3*1024
+// Config channel buffers, leased from the channel buffer pool.  The response
+// carries every item, including the encoded certificate and key.
+#define BUF_CONFIG_SEND_SIZE 1024
+#define BUF_CONFIG_RECEIVE_SIZE 7*1024
+
+// Size of a HEX or BASE64 item as encoded in the config store.  Such items
+// are read into a shared scratch buffer and decoded into their own storage.
+#define CONFIG_HEX_SIZE(decoded) (2*(decoded))
+#define CONFIG_BASE64_SIZE(decoded) ((((decoded)+2)/3)*4)
+
+// Longest text a ULONG or LONG item may arrive as
+#define CONFIG_NUMBER_DIGITS 15
+
+// Items per fetch, as configuration_changed_items() reports them as a bitmask
+#define CONFIG_MAX_ITEMS 32
+#define ALL_ITEMS(count) ((count) >= 32 ? 0xFFFFFFFFUL : (1UL << (count)) - 1)
+
+// With CONFIG_DELTA, an item of "key:hash" entries separated by commas, one
+// per item, hash being the FNV-1a 32 of the value as stored, in 8 hex digits
+#define CONFIG_MANIFEST_KEY "config-manifest"
+#define BUF_CONFIG_MANIFEST 512
 
 
 #ifdef __cplusplus
@@ -46,36 +67,77 @@ extern "C" {
  */
 enum ConfigItemType {
     CONFIG_ITEM_TYPE_UINT8           = 0x0, //< uint8_t buffer reception; populates into .u8_item
-    CONFIG_ITEM_TYPE_B64             = 0x1, //< uint8_t buffer reception, but b64 decode received bytes; populates into .u8_item
-    CONFIG_ITEM_TYPE_ULONG           = 0x2, //< uint16_t value reception; populates into .ulong_item
-    CONFIG_ITEM_TYPE_LONG            = 0x3, //< int16_t value reception; populates into .long_item
+    CONFIG_ITEM_TYPE_HEX             = 0x1, //< uint8_t buffer reception, but hex decode received bytes; populates into .u8_item
+    CONFIG_ITEM_TYPE_ULONG           = 0x2, //< unsigned integer reception; populates into .number_item
+    CONFIG_ITEM_TYPE_LONG            = 0x3, //< signed integer reception; populates into .number_item
+    CONFIG_ITEM_TYPE_BASE64          = 0x4, //< uint8_t buffer reception, but base64 decode received bytes; populates into .u8_item
+};
+
+// Older name for CONFIG_ITEM_TYPE_HEX: the values it decoded were always hex
+#define CONFIG_ITEM_TYPE_B64 CONFIG_ITEM_TYPE_HEX
+
+enum ConfigFetchPhase {
+    CONFIG_FETCH_FULL = 0,          // every item, and the manifest with CONFIG_DELTA
+    CONFIG_FETCH_MANIFEST,          // the manifest alone
+    CONFIG_FETCH_DELTA              // the items the manifest shows have changed
 };
 
+struct ConfigFetchStats {
+    uint32_t full;                  // fetches of every item
+    uint32_t delta;                 // fetches of only the changed items
+    uint32_t unchanged;             // manifest checks that found nothing to fetch
+    uint32_t stale_manifest;        // values whose hash did not match the manifest
+    uint32_t last_bytes;            // item bytes the last fetch received
+    uint32_t total_bytes;
+    uint32_t last_ms;               // first request to last response
+    uint32_t max_ms;
+};
+
+// Values are held in generations (see config_schema.h), so an item records
+// where its value lies within one rather than the value's address
 struct ConfigHelperItem {
     enum ConfigItemType config_type;
+    bool needs_reconnect; // a change only takes effect on a new broker connection
     struct MvConfigKeyToFetch item;
     union {
         struct {
-            uint8_t *buf; // pointer to the buffer
+            size_t buf_offset; // offset of the buffer
             size_t buf_size; // size of allocated buffer
-            size_t *buf_len; // pointer to populate length of data read into
+            size_t len_offset; // offset of the length of data read into it
         } u8_item;
 
         struct {
-            uint16_t *val;
-        } ulong_item;
-
-        struct {
-            int16_t *val;
-        } long_item;
+            size_t val_offset; // offset of an integer of size bytes
+            uint8_t size; // 1, 2 or 4
+            int64_t min; // values outside min..max fail the fetch
+            int64_t max;
+        } number_item;
     };
 };
 
+/*
+ * ITEM VALUES
+ */
+static inline uint8_t *config_item_buf(const struct ConfigHelperItem *item, const void *values) {
+    return (uint8_t *)values + item->u8_item.buf_offset;
+}
+
+static inline size_t *config_item_len(const struct ConfigHelperItem *item, const void *values) {
+    return (size_t *)((uint8_t *)values + item->u8_item.len_offset);
+}
+
+static inline void *config_item_number(const struct ConfigHelperItem *item, const void *values) {
+    return (uint8_t *)values + item->number_item.val_offset;
+}
+
 /*
  * PROTOTYPES
  */
 void start_configuration_fetch(const struct ConfigHelperItem *items, uint8_t count);
-void receive_configuration_items(struct ConfigHelperItem *items, uint8_t count);
+void receive_configuration_items(const struct ConfigHelperItem *items, uint8_t count,
+                                 const void *live, void *staging);
+uint32_t configuration_changed_items();
+void configuration_fetch_stats(struct ConfigFetchStats *out);
 void finish_configuration_fetch();
 
 
@@ -0,0 +1,171 @@
+/**
+ *
+ * Microvisor Config Schema
+ * Version 1.0.0
+ * Copyright © 2023, Twilio
+ * Licence: Apache 2.0
+ *
+ */
+
+/* Every configuration item the device fetches, declared once.
+ *
+ * Each line of CONFIG_SCHEMA describes one item.  From it, this file declares
+ * struct ConfigValues, which holds one value of every item, and a typed
+ * accessor per item.  work.c defines the config_items fetch table and
+ * compile-time checks.  The fetch table is const, so a new tuning parameter is
+ * one NUMBER line and costs only its own storage in RAM, twice over.
+ *
+ * The values are kept in two generations.  Readers take config_snapshot(),
+ * the committed generation, and read every item they need from it, so they
+ * never see a mix of old and new values.  A fetch, or a load from the config
+ * cache, writes the other generation.  Only once every item has arrived and
+ * passed validation does the work task publish it, by swapping the one
+ * config_live pointer; a fetch that fails part way is simply discarded.  The
+ * generation a snapshot points to is next overwritten when the fetch after
+ * the swap begins, so a snapshot must not be held across work task messages.
+ *
+ * BUFFER(name, store_key, store, type, size, reconnect)
+ *     A byte string held in uint8_t name[] with its length in name_len, read
+ *     with config_name(config, &len).  type is UINT8 (kept as received), HEX,
+ *     BASE64 or DER (hex, or base64 with CONFIG_BASE64).  size is the longest
+ *     value once decoded, and the storage holds just that; encoded items are
+ *     received into one scratch buffer sized for the largest of them.
+ *
+ * NUMBER(name, store_key, store, ctype, min, max, reconnect)
+ *     An integer of type ctype, at most 32 bits, read with config_name(config).
+ *     A fetched value that is not a number within min..max fails the fetch
+ *     rather than being truncated to fit.
+ *
+ * store is CONFIG or SECRET, both device scoped.  reconnect marks items that
+ * only take effect on a new broker connection, see apply_config_refresh().
+ * Optional items are grouped under their feature's define, and the group
+ * expands to nothing when the define is not set.
+ */
+#ifndef CONFIG_SCHEMA_H
+#define CONFIG_SCHEMA_H
+
+
+/*
+ * SCHEMA
+ */
+#define CONFIG_SCHEMA(BUFFER, NUMBER) \
+    BUFFER(broker_host, "broker-host", CONFIG, UINT8, 128, true) \
+    NUMBER(broker_port, "broker-port", CONFIG, uint16_t, 1, 65535, true) \
+    CONFIG_SCHEMA_BROKER_FAILOVER(BUFFER, NUMBER) \
+    CONFIG_SCHEMA_CUSTOM_CLIENT_ID(BUFFER, NUMBER) \
+    CONFIG_SCHEMA_CERTIFICATE_CA(BUFFER, NUMBER) \
+    CONFIG_SCHEMA_CERTIFICATE_AUTH(BUFFER, NUMBER) \
+    CONFIG_SCHEMA_USERNAMEPASSWORD_AUTH(BUFFER, NUMBER)
+
+// Further brokers, as host[:port] separated by commas, to fail over to.  They
+// must accept the same credentials as broker-host, and entries without a port
+// use broker-port.
+#if defined(BROKER_FAILOVER)
+#define CONFIG_SCHEMA_BROKER_FAILOVER(BUFFER, NUMBER) \
+    BUFFER(broker_list, "broker-list", CONFIG, UINT8, 512, false)
+#else
+#define CONFIG_SCHEMA_BROKER_FAILOVER(BUFFER, NUMBER)
+#endif // BROKER_FAILOVER
+
+// The MQTT client id, instead of the Microvisor device identifier; the work
+// task copies it to client as each generation is committed
+#if defined(CUSTOM_CLIENT_ID)
+#define CONFIG_SCHEMA_CUSTOM_CLIENT_ID(BUFFER, NUMBER) \
+    BUFFER(client, "client-id", CONFIG, UINT8, BUF_CLIENT_SIZE, true)
+#else
+#define CONFIG_SCHEMA_CUSTOM_CLIENT_ID(BUFFER, NUMBER)
+#endif // CUSTOM_CLIENT_ID
+
+// Certificate for validating the broker
+#if defined(CERTIFICATE_CA)
+#define CONFIG_SCHEMA_CERTIFICATE_CA(BUFFER, NUMBER) \
+    BUFFER(root_ca, "root-CA", CONFIG, DER, 1536, true)
+#else
+#define CONFIG_SCHEMA_CERTIFICATE_CA(BUFFER, NUMBER)
+#endif // CERTIFICATE_CA
+
+// Certificate and key the device authenticates with
+#if defined(CERTIFICATE_AUTH)
+#define CONFIG_SCHEMA_CERTIFICATE_AUTH(BUFFER, NUMBER) \
+    BUFFER(cert, "cert", CONFIG, DER, 1024, true) \
+    BUFFER(private_key, "private_key", SECRET, DER, 1536, true)
+#else
+#define CONFIG_SCHEMA_CERTIFICATE_AUTH(BUFFER, NUMBER)
+#endif // CERTIFICATE_AUTH
+
+// Username and password the device authenticates with
+#if defined(USERNAMEPASSWORD_AUTH)
+#define CONFIG_SCHEMA_USERNAMEPASSWORD_AUTH(BUFFER, NUMBER) \
+    BUFFER(username, "username", CONFIG, UINT8, 128, true) \
+    BUFFER(password, "password", SECRET, UINT8, 128, true)
+#else
+#define CONFIG_SCHEMA_USERNAMEPASSWORD_AUTH(BUFFER, NUMBER)
+#endif // USERNAMEPASSWORD_AUTH
+
+
+/*
+ * DEFINES
+ */
+// DER items are certificates and keys, encoded as CONFIG_BASE64 selects
+#if defined(CONFIG_BASE64)
+#define CONFIG_ITEM_TYPE_DER CONFIG_ITEM_TYPE_BASE64
+#define CONFIG_ENCODED_SIZE_DER(size) CONFIG_BASE64_SIZE(size)
+#else
+#define CONFIG_ITEM_TYPE_DER CONFIG_ITEM_TYPE_HEX
+#define CONFIG_ENCODED_SIZE_DER(size) CONFIG_HEX_SIZE(size)
+#endif
+
+// Size of an item as received.  UINT8 items are read straight into their
+// storage, so only the encoded types count towards the scratch buffer.
+#define CONFIG_ENCODED_SIZE_UINT8(size) 1
+#define CONFIG_ENCODED_SIZE_HEX(size) CONFIG_HEX_SIZE(size)
+#define CONFIG_ENCODED_SIZE_BASE64(size) CONFIG_BASE64_SIZE(size)
+
+#define CONFIG_COUNT_ITEM(...) + 1
+#define CONFIG_SCHEMA_ITEMS (0 CONFIG_SCHEMA(CONFIG_COUNT_ITEM, CONFIG_COUNT_ITEM))
+
+
+/*
+ * STORAGE AND ACCESSORS
+ */
+#define CONFIG_FIELD_BUFFER(name, store_key, store, type, size, reconnect) \
+    uint8_t name[size]; \
+    size_t name##_len;
+#define CONFIG_FIELD_NUMBER(name, store_key, store, ctype, min, max, reconnect) \
+    ctype name;
+
+struct ConfigValues {
+    CONFIG_SCHEMA(CONFIG_FIELD_BUFFER, CONFIG_FIELD_NUMBER)
+};
+
+// Its size is that of the largest item as received, see config_handler.c
+#define CONFIG_SCRATCH_BUFFER(name, store_key, store, type, size, reconnect) \
+    uint8_t name[CONFIG_ENCODED_SIZE_##type(size)];
+#define CONFIG_SCRATCH_NUMBER(name, store_key, store, ctype, min, max, reconnect)
+
+union ConfigReceiveScratch {
+    CONFIG_SCHEMA(CONFIG_SCRATCH_BUFFER, CONFIG_SCRATCH_NUMBER)
+};
+
+// The committed generation, only ever replaced as a whole by the work task
+extern const struct ConfigValues *volatile config_live;
+
+static inline const struct ConfigValues *config_snapshot() {
+    return config_live;
+}
+
+#define CONFIG_DECLARE_BUFFER(name, store_key, store, type, size, reconnect) \
+    static inline const uint8_t *config_##name(const struct ConfigValues *config, size_t *len) { \
+        *len = config->name##_len; \
+        return config->name; \
+    }
+
+#define CONFIG_DECLARE_NUMBER(name, store_key, store, ctype, min, max, reconnect) \
+    static inline ctype config_##name(const struct ConfigValues *config) { \
+        return config->name; \
+    }
+
+CONFIG_SCHEMA(CONFIG_DECLARE_BUFFER, CONFIG_DECLARE_NUMBER)
+
+
+#endif /* CONFIG_SCHEMA_H */
@@ -0,0 +1,188 @@
+/**
+ *
+ * Microvisor Decode Helper
+ * Version 1.0.0
+ * Copyright © 2023, Twilio
+ * Licence: Apache 2.0
+ *
+ */
+
+#include "decode_helper.h"
+#include <string.h>
+
+
+// Set in a table entry for characters outside the alphabet
+#define DECODE_INVALID 0x80
+
+// Nibble value of each character, or DECODE_INVALID
+static const uint8_t hex_values[256] = {
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80
+};
+
+// Sextet value of each character, or DECODE_INVALID; '=' is handled apart
+static const uint8_t base64_values[256] = {
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x3e, 0x80, 0x80, 0x80, 0x3f,
+    0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e,
+    0x0f, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28,
+    0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f, 0x30, 0x31, 0x32, 0x33, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80
+};
+
+
+/*
+ * Four characters are loaded as one little-endian word and split with shifts,
+ * which the compiler keeps in registers, instead of four separate loads.
+ */
+static inline uint32_t load_word(const uint8_t *in) {
+    uint32_t word;
+    memcpy(&word, in, sizeof(word));
+    return word;
+}
+
+
+/**
+ * @brief Bytes a hex string of in_len characters decodes to.
+ */
+size_t decode_hex_length(size_t in_len) {
+    return in_len / 2;
+}
+
+
+/**
+ * @brief Decode hex, rejecting odd lengths and anything but 0-9, a-f and A-F.
+ *
+ * out may be in.
+ *
+ * @retval false if the input is invalid or does not fit out_size.
+ */
+bool decode_hex(const uint8_t *in, size_t in_len, uint8_t *out, size_t out_size, size_t *out_len) {
+    if ((in_len & 1) != 0 || decode_hex_length(in_len) > out_size) {
+        return false;
+    }
+
+    size_t in_ndx = 0;
+    size_t out_ndx = 0;
+
+    for (; in_ndx + 4 <= in_len; in_ndx += 4, out_ndx += 2) {
+        uint32_t word = load_word(&in[in_ndx]);
+        uint32_t a = hex_values[word & 0xFF];
+        uint32_t b = hex_values[(word >> 8) & 0xFF];
+        uint32_t c = hex_values[(word >> 16) & 0xFF];
+        uint32_t d = hex_values[word >> 24];
+        if (((a | b | c | d) & DECODE_INVALID) != 0) {
+            return false;
+        }
+        out[out_ndx] = (uint8_t)((a << 4) | b);
+        out[out_ndx + 1] = (uint8_t)((c << 4) | d);
+    }
+
+    if (in_ndx < in_len) {
+        uint32_t a = hex_values[in[in_ndx]];
+        uint32_t b = hex_values[in[in_ndx + 1]];
+        if (((a | b) & DECODE_INVALID) != 0) {
+            return false;
+        }
+        out[out_ndx++] = (uint8_t)((a << 4) | b);
+    }
+
+    *out_len = out_ndx;
+    return true;
+}
+
+
+static size_t base64_padding(const uint8_t *in, size_t in_len) {
+    size_t pad = 0;
+    while (pad < 2 && pad < in_len && in[in_len - 1 - pad] == '=') {
+        pad++;
+    }
+    return pad;
+}
+
+
+/**
+ * @brief Bytes a base64 string decodes to, assuming it is valid.
+ */
+size_t decode_base64_length(const uint8_t *in, size_t in_len) {
+    size_t data_len = in_len - base64_padding(in, in_len);
+    size_t rem = data_len % 4;
+    return (data_len / 4) * 3 + (rem > 1 ? rem - 1 : 0);
+}
+
+
+/**
+ * @brief Decode base64 with the standard alphabet; padding is optional.
+ *
+ * out may be in.
+ *
+ * @retval false if the input is invalid or does not fit out_size.
+ */
+bool decode_base64(const uint8_t *in, size_t in_len, uint8_t *out, size_t out_size, size_t *out_len) {
+    size_t pad = base64_padding(in, in_len);
+    size_t data_len = in_len - pad;
+    size_t rem = data_len % 4;
+
+    if ((pad != 0 && in_len % 4 != 0) || rem == 1 || decode_base64_length(in, in_len) > out_size) {
+        return false;
+    }
+
+    size_t in_ndx = 0;
+    size_t out_ndx = 0;
+
+    for (; in_ndx + 4 <= data_len; in_ndx += 4, out_ndx += 3) {
+        uint32_t word = load_word(&in[in_ndx]);
+        uint32_t a = base64_values[word & 0xFF];
+        uint32_t b = base64_values[(word >> 8) & 0xFF];
+        uint32_t c = base64_values[(word >> 16) & 0xFF];
+        uint32_t d = base64_values[word >> 24];
+        if (((a | b | c | d) & DECODE_INVALID) != 0) {
+            return false;
+        }
+        uint32_t triple = (a << 18) | (b << 12) | (c << 6) | d;
+        out[out_ndx] = (uint8_t)(triple >> 16);
+        out[out_ndx + 1] = (uint8_t)(triple >> 8);
+        out[out_ndx + 2] = (uint8_t)triple;
+    }
+
+    if (rem != 0) {
+        uint32_t a = base64_values[in[in_ndx]];
+        uint32_t b = base64_values[in[in_ndx + 1]];
+        uint32_t c = rem == 3 ? base64_values[in[in_ndx + 2]] : 0;
+        if (((a | b | c) & DECODE_INVALID) != 0) {
+            return false;
+        }
+        uint32_t triple = (a << 18) | (b << 12) | (c << 6);
+        out[out_ndx++] = (uint8_t)(triple >> 16);
+        if (rem == 3) {
+            out[out_ndx++] = (uint8_t)(triple >> 8);
+        }
+    }
+
+    *out_len = out_ndx;
+    return true;
+}
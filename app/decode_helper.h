@@ -0,0 +1,48 @@
+/**
+ *
+ * Microvisor Decode Helper
+ * Version 1.0.0
+ * Copyright © 2023, Twilio
+ * Licence: Apache 2.0
+ *
+ */
+
+/* Strict hex and base64 (RFC 4648, standard alphabet) decoding.
+ *
+ * Both decoders look each character up in a 256-entry table and take four
+ * characters per step, folding the looked-up values into one word.
+ * An invalid character sets the top bit of its table entry, so one test per
+ * step rejects the whole group. Output never overtakes input, so in and out
+ * may be the same buffer.
+ *
+ * Hex must have an even length.  Base64 may omit its '=' padding, but may not
+ * contain whitespace or characters after the padding.
+ */
+#ifndef DECODE_HELPER_H
+#define DECODE_HELPER_H
+
+/*
+ * INCLUDES
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * PROTOTYPES
+ */
+size_t decode_hex_length(size_t in_len);
+size_t decode_base64_length(const uint8_t *in, size_t in_len);
+bool decode_hex(const uint8_t *in, size_t in_len, uint8_t *out, size_t out_size, size_t *out_len);
+bool decode_base64(const uint8_t *in, size_t in_len, uint8_t *out, size_t out_size, size_t *out_len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* DECODE_HELPER_H */
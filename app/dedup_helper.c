@@ -0,0 +1,138 @@
+/**
+ *
+ * Microvisor Dedup Helper
+ * Version 1.0.0
+ * Copyright © 2023, Twilio
+ * Licence: Apache 2.0
+ *
+ */
+
+#include "dedup_helper.h"
+#include <string.h>
+
+// Microvisor includes
+#include "mv_syscalls.h"
+
+#define FNV_OFFSET_BASIS 0x811c9dc5
+#define FNV_PRIME 0x01000193
+
+#define MSG_ID_FIELD "\"msg_id\""
+
+struct DedupEntry {
+    uint32_t key;
+    uint64_t seen_microsec; // 0 marks an unused slot
+};
+
+static struct DedupEntry entries[DEDUP_CACHE_SIZE];
+static uint32_t next_entry = 0;
+static struct DedupStats stats = {0};
+
+
+/**
+ * @brief FNV-1a over a byte range, continuing from a previous hash value.
+ */
+static uint32_t fnv1a(uint32_t hash, const uint8_t *data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        hash ^= data[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+
+/**
+ * @brief Locate the value of a top-level "msg_id" field, string or number.
+ *
+ * @retval true if found, with id/id_len pointing into the payload.
+ */
+static bool find_msg_id(const uint8_t *payload, size_t payload_len,
+                        const uint8_t **id, size_t *id_len) {
+    const char *field = strnstr((const char *)payload, MSG_ID_FIELD, payload_len);
+    if (field == NULL) {
+        return false;
+    }
+
+    size_t index = (size_t)(field - (const char *)payload) + strlen(MSG_ID_FIELD);
+    while (index < payload_len && (payload[index] == ' ' || payload[index] == ':' || payload[index] == '"')) {
+        index++;
+    }
+
+    size_t start = index;
+    while (index < payload_len && payload[index] != '"' && payload[index] != ','
+           && payload[index] != '}' && payload[index] != ' ') {
+        index++;
+    }
+
+    if (index == start) {
+        return false;
+    }
+
+    *id = &payload[start];
+    *id_len = index - start;
+    return true;
+}
+
+
+/**
+ * @brief Check an inbound message against the cache and remember it.
+ *
+ * @param qos         QoS the message was delivered at
+ * @param topic       Message topic
+ * @param topic_len   Topic length
+ * @param payload     Message payload
+ * @param payload_len Payload length
+ *
+ * @retval true if the same message was dispatched within DEDUP_WINDOW_MS.
+ */
+bool dedup_is_duplicate(uint32_t qos, const uint8_t *topic, size_t topic_len,
+                        const uint8_t *payload, size_t payload_len) {
+    // Only QoS > 0 messages are ever redelivered
+    if (qos == 0) {
+        return false;
+    }
+
+    const uint8_t *id;
+    size_t id_len;
+
+    uint32_t key = fnv1a(FNV_OFFSET_BASIS, topic, topic_len);
+    if (find_msg_id(payload, payload_len, &id, &id_len)) {
+        key = fnv1a(key, id, id_len);
+    } else {
+        key = fnv1a(key, payload, payload_len);
+    }
+
+    uint64_t now = 0;
+    mvGetMicroseconds(&now);
+    const uint64_t window = (uint64_t)DEDUP_WINDOW_MS * 1000;
+
+    stats.checks++;
+
+    for (uint32_t ndx = 0; ndx < DEDUP_CACHE_SIZE; ndx++) {
+        if (entries[ndx].seen_microsec != 0 && entries[ndx].key == key
+            && now - entries[ndx].seen_microsec < window) {
+            stats.hits++;
+            return true;
+        }
+    }
+
+    // Slots are reused oldest first, so the one under next_entry is the oldest
+    struct DedupEntry *slot = &entries[next_entry];
+    if (slot->seen_microsec != 0 && now - slot->seen_microsec < window) {
+        stats.evictions++;
+    }
+
+    slot->key = key;
+    slot->seen_microsec = now != 0 ? now : 1;
+    next_entry = (next_entry + 1) % DEDUP_CACHE_SIZE;
+
+    return false;
+}
+
+
+/**
+ * @brief Copy out the cache counters.
+ */
+void dedup_get_stats(struct DedupStats *out) {
+    *out = stats;
+}
+
@@ -0,0 +1,62 @@
+/**
+ *
+ * Microvisor Dedup Helper
+ * Version 1.0.0
+ * Copyright © 2023, Twilio
+ * Licence: Apache 2.0
+ *
+ */
+
+/* A fixed-size, allocation-free cache of recently dispatched inbound messages.
+ *
+ * With QoS > 0 subscriptions and clean_start = 0 the broker may redeliver
+ * messages after a reconnect.  Messages delivered at QoS 0 are never
+ * redelivered, so they are not checked at all: a command repeated on purpose
+ * (eg. stop, restart, stop) is always actioned.  Other messages are reduced to a
+ * 32-bit key: the topic plus the value of a "msg_id" field if the payload
+ * carries one, or the topic plus the whole payload otherwise.  Keys are
+ * remembered for DEDUP_WINDOW_MS, so at QoS > 0 a sender that repeats a command
+ * within the window must give each a fresh msg_id.
+ */
+#ifndef DEDUP_HELPER_H
+#define DEDUP_HELPER_H
+
+/*
+ * INCLUDES
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * DEFINES
+ */
+#define DEDUP_CACHE_SIZE 16
+#define DEDUP_WINDOW_MS (5*60*1000)
+
+/*
+ * TYPES
+ */
+struct DedupStats {
+    uint32_t checks;    // messages looked up, QoS > 0 only
+    uint32_t hits;      // messages suppressed as duplicates
+    uint32_t evictions; // live entries overwritten before their window expired
+};
+
+/*
+ * PROTOTYPES
+ */
+bool dedup_is_duplicate(uint32_t qos, const uint8_t *topic, size_t topic_len,
+                        const uint8_t *payload, size_t payload_len);
+void dedup_get_stats(struct DedupStats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* DEDUP_HELPER_H */
@@ -0,0 +1,188 @@
+/**
+ *
+ * Microvisor Duty Cycle Helper
+ * Version 1.0.0
+ * Copyright © 2023, Twilio
+ * Licence: Apache 2.0
+ *
+ */
+
+#include "duty_cycle_helper.h"
+#include <string.h>
+#include <assert.h>
+
+// Microvisor includes
+#include "mv_syscalls.h"
+#include "cmsis_os.h"
+
+#include "work.h"
+#include "tunables_helper.h"
+
+
+static char samples[DUTY_CYCLE_MAX_SAMPLES][BUF_DUTY_CYCLE_SAMPLE];
+static uint32_t first_sample = 0;
+static uint32_t num_samples = 0;
+static uint32_t num_urgent = 0;
+static bool urgent[DUTY_CYCLE_MAX_SAMPLES];
+
+static osTimerId_t wake_timer = NULL;
+static osTimerId_t linger_timer = NULL;
+static osTimerId_t max_awake_timer = NULL;
+
+static uint64_t woke_microsec = 0;
+static uint32_t woke_bytes = 0;
+static bool woke_early = false;
+
+static struct DutyCycleStats stats = {0};
+
+
+static void wake_timer_callback(void *argument) {
+    pushWorkMessage(OnDutyCycleWake);
+}
+
+static void linger_timer_callback(void *argument) {
+    pushWorkMessage(OnDutyCycleLinger);
+}
+
+static void max_awake_timer_callback(void *argument) {
+    pushWorkMessage(OnDutyCycleMaxAwake);
+}
+
+
+/**
+ * @brief Create the wake, linger and max awake timers.
+ */
+void duty_cycle_init() {
+    wake_timer = osTimerNew(wake_timer_callback, osTimerOnce, NULL, NULL);
+    assert(wake_timer != NULL);
+    linger_timer = osTimerNew(linger_timer_callback, osTimerOnce, NULL, NULL);
+    assert(linger_timer != NULL);
+    max_awake_timer = osTimerNew(max_awake_timer_callback, osTimerOnce, NULL, NULL);
+    assert(max_awake_timer != NULL);
+}
+
+
+/**
+ * @brief Hold a sample until the next upload, dropping the oldest if the batch is full.
+ *
+ * @retval true if enough is waiting, or the sample is urgent enough, to wake early.
+ */
+bool duty_cycle_add_sample(const char *payload, bool is_urgent) {
+    if (num_samples == DUTY_CYCLE_MAX_SAMPLES) {
+        if (urgent[first_sample]) {
+            num_urgent--;
+        }
+        first_sample = (first_sample + 1) % DUTY_CYCLE_MAX_SAMPLES;
+        num_samples--;
+        stats.samples_dropped++;
+    }
+
+    uint32_t index = (first_sample + num_samples) % DUTY_CYCLE_MAX_SAMPLES;
+    strncpy(samples[index], payload, BUF_DUTY_CYCLE_SAMPLE - 1);
+    samples[index][BUF_DUTY_CYCLE_SAMPLE - 1] = '\0';
+    urgent[index] = is_urgent;
+    num_samples++;
+    if (is_urgent) {
+        num_urgent++;
+    }
+    stats.samples_queued++;
+
+    return num_urgent != 0 || num_samples >= tunable_flush_threshold();
+}
+
+
+/**
+ * @brief The oldest sample waiting to be published, or NULL if there are none.
+ */
+const char *duty_cycle_next_sample() {
+    return num_samples != 0 ? samples[first_sample] : NULL;
+}
+
+
+/**
+ * @brief The oldest sample has been published; discard it.
+ */
+void duty_cycle_sample_sent() {
+    if (num_samples == 0) {
+        return;
+    }
+
+    if (urgent[first_sample]) {
+        num_urgent--;
+    }
+    first_sample = (first_sample + 1) % DUTY_CYCLE_MAX_SAMPLES;
+    num_samples--;
+    stats.samples_published++;
+}
+
+
+uint32_t duty_cycle_pending() {
+    return num_samples;
+}
+
+
+/**
+ * @brief The network is being requested: start timing this wake.
+ *
+ * @param early           Woken ahead of the wake timer
+ * @param bytes_published Running total of bytes published, see mqtt_bytes_published()
+ */
+void duty_cycle_woke(bool early, uint32_t bytes_published) {
+    osTimerStop(wake_timer);
+    osTimerStop(linger_timer);
+    osTimerStart(max_awake_timer, DUTY_CYCLE_MAX_AWAKE_MS);
+
+    mvGetMicroseconds(&woke_microsec);
+    woke_bytes = bytes_published;
+    woke_early = early;
+}
+
+
+/**
+ * @brief Something happened while awake; restart the linger before going back to sleep.
+ */
+void duty_cycle_activity() {
+    osTimerStart(linger_timer, DUTY_CYCLE_LINGER_MS);
+}
+
+
+/**
+ * @brief The network has been released: close the wake's accounts and schedule the next.
+ */
+void duty_cycle_released(uint32_t bytes_published) {
+    osTimerStop(linger_timer);
+    osTimerStop(max_awake_timer);
+
+    uint64_t now = 0;
+    mvGetMicroseconds(&now);
+
+    stats.wakes++;
+    if (woke_early) {
+        stats.early_wakes++;
+    }
+
+    uint32_t radio_on_ms = (uint32_t)((now - woke_microsec) / 1000);
+    stats.last_radio_on_ms = radio_on_ms;
+    stats.total_radio_on_ms += radio_on_ms;
+    if (radio_on_ms > stats.max_radio_on_ms) {
+        stats.max_radio_on_ms = radio_on_ms;
+    }
+
+    stats.last_bytes = bytes_published - woke_bytes;
+    stats.total_bytes += stats.last_bytes;
+
+    osTimerStart(wake_timer, tunable_wake_interval_s() * 1000);
+}
+
+
+/**
+ * @brief The wake is being cut short at DUTY_CYCLE_MAX_AWAKE_MS; duty_cycle_released() follows.
+ */
+void duty_cycle_forced_sleep() {
+    stats.forced_sleeps++;
+}
+
+
+void duty_cycle_get_stats(struct DutyCycleStats *out) {
+    *out = stats;
+}
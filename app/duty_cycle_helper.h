@@ -0,0 +1,90 @@
+/**
+ *
+ * Microvisor Duty Cycle Helper
+ * Version 1.0.0
+ * Copyright © 2023, Twilio
+ * Licence: Apache 2.0
+ *
+ */
+
+/* Sample batching and radio accounting for duty-cycled operation.
+ *
+ * While the radio is off, samples produced by the application are held here.
+ * A wake is due when the wake timer fires, when flush_threshold samples are
+ * waiting or when an urgent sample arrives.  Both the wake interval and the
+ * threshold are tunables, see tunables_helper.h.  Once awake and
+ * connected the work task publishes the batch one sample at a time, then
+ * lingers for DUTY_CYCLE_LINGER_MS in case commands arrive before it
+ * disconnects and releases the network again.
+ *
+ * Each wake is timed from the network being requested to it being released,
+ * and the bytes published in between are counted.  No wake lasts longer than
+ * DUTY_CYCLE_MAX_AWAKE_MS: if the network or the broker never comes up, or the
+ * upload never finishes, the network is released anyway and the samples are
+ * kept for the next wake.
+ *
+ * The wake, linger and max awake timers push OnDutyCycleWake,
+ * OnDutyCycleLinger and OnDutyCycleMaxAwake onto the work queue; the state
+ * machine itself lives in work.c.
+ */
+#ifndef DUTY_CYCLE_HELPER_H
+#define DUTY_CYCLE_HELPER_H
+
+/*
+ * INCLUDES
+ */
+#include <stdint.h>
+#include <stdbool.h>
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * DEFINES
+ */
+// Defaults for the wake_interval_s and flush_threshold tunables
+#define DUTY_CYCLE_WAKE_INTERVAL_MS (15*60*1000)
+#define DUTY_CYCLE_LINGER_MS 5000
+#define DUTY_CYCLE_MAX_AWAKE_MS (3*60*1000)
+#define DUTY_CYCLE_FLUSH_THRESHOLD 12
+#define DUTY_CYCLE_MAX_SAMPLES 16
+#define BUF_DUTY_CYCLE_SAMPLE 128
+
+/*
+ * TYPES
+ */
+struct DutyCycleStats {
+    uint32_t wakes;                 // completed, ie. the network has been released again
+    uint32_t early_wakes;           // woken by the batch threshold or an urgent sample
+    uint32_t forced_sleeps;         // released after DUTY_CYCLE_MAX_AWAKE_MS rather than the linger
+    uint32_t last_radio_on_ms;      // network requested to network released
+    uint32_t max_radio_on_ms;
+    uint64_t total_radio_on_ms;
+    uint32_t last_bytes;            // bytes published during the last wake
+    uint64_t total_bytes;
+    uint32_t samples_queued;
+    uint32_t samples_published;
+    uint32_t samples_dropped;       // oldest samples overwritten while the batch was full
+};
+
+/*
+ * PROTOTYPES
+ */
+void duty_cycle_init();
+bool duty_cycle_add_sample(const char *payload, bool is_urgent);
+const char *duty_cycle_next_sample();
+void duty_cycle_sample_sent();
+uint32_t duty_cycle_pending();
+void duty_cycle_woke(bool early, uint32_t bytes_published);
+void duty_cycle_activity();
+void duty_cycle_released(uint32_t bytes_published);
+void duty_cycle_forced_sleep();
+void duty_cycle_get_stats(struct DutyCycleStats *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* DUTY_CYCLE_HELPER_H */
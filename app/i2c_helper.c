@@ -12,6 +12,8 @@
 
 #include "stm32u5xx_hal.h"
 
+#define LOG_MODULE LOG_MODULE_APP
+
 #define I2C_TIMEOUT 1000
 
 static bool initialised = false;
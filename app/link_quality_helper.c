@@ -0,0 +1,188 @@
+/**
+ *
+ * Microvisor Link Quality Helper
+ * Version 1.0.0
+ * Copyright © 2023, Twilio
+ * Licence: Apache 2.0
+ *
+ */
+
+#include "link_quality_helper.h"
+
+// Microvisor includes
+#include "mv_syscalls.h"
+
+
+static struct LinkQualityStats stats = {0};
+
+static uint64_t network_lost_microsec = 0;
+static uint64_t broker_up_microsec = 0;
+static bool broker_up = false;
+
+// When the most recent broker drops happened, oldest overwritten first
+static uint64_t drop_microsec[LINK_QUALITY_MAX_DROP_TIMES];
+static uint32_t next_drop = 0;
+
+static uint16_t keepalive = LINK_QUALITY_KEEPALIVE_DEFAULT_S;
+static enum KeepaliveReason keepalive_reason = KEEPALIVE_REASON_DEFAULT;
+
+static const char *reason_names[] = {
+    "default",
+    "flaky",
+    "stable",
+    "held"
+};
+
+
+static uint64_t now_microsec() {
+    uint64_t now = 0;
+    mvGetMicroseconds(&now);
+    return now;
+}
+
+static void count_code(uint32_t code) {
+    for (uint32_t ndx = 0; ndx < LINK_QUALITY_MAX_CODES; ndx++) {
+        if (stats.codes[ndx].count != 0 && stats.codes[ndx].code == code) {
+            stats.codes[ndx].count++;
+            return;
+        }
+        if (stats.codes[ndx].count == 0) {
+            stats.codes[ndx].code = code;
+            stats.codes[ndx].count = 1;
+            return;
+        }
+    }
+    stats.other_codes++;
+}
+
+
+/**
+ * @brief Pick the keepalive for the next broker connection, as the last one closes.
+ *
+ * Whether the connection ended on our request does not matter: one we closed
+ * soon after it came up says nothing about the link, so it holds the
+ * keepalive like any other short connection.
+ *
+ * @param lifetime_ms How long the last connection lasted
+ */
+static void choose_keepalive(uint32_t lifetime_ms) {
+    uint32_t drops = link_quality_recent_drops();
+
+    if (drops >= LINK_QUALITY_FLAKY_DROPS) {
+        keepalive = keepalive / 2 > LINK_QUALITY_KEEPALIVE_MIN_S ? keepalive / 2 : LINK_QUALITY_KEEPALIVE_MIN_S;
+        keepalive_reason = KEEPALIVE_REASON_FLAKY;
+    } else if (drops == 0 && lifetime_ms >= LINK_QUALITY_STABLE_MS) {
+        keepalive = keepalive * 2 < LINK_QUALITY_KEEPALIVE_MAX_S ? keepalive * 2 : LINK_QUALITY_KEEPALIVE_MAX_S;
+        keepalive_reason = KEEPALIVE_REASON_STABLE;
+    } else {
+        keepalive_reason = KEEPALIVE_REASON_HELD;
+    }
+}
+
+
+void link_quality_network_up() {
+    stats.network_ups++;
+    if (network_lost_microsec != 0) {
+        uint32_t outage_ms = (uint32_t)((now_microsec() - network_lost_microsec) / 1000);
+        stats.last_outage_ms = outage_ms;
+        if (outage_ms > stats.max_outage_ms) {
+            stats.max_outage_ms = outage_ms;
+        }
+        network_lost_microsec = 0;
+    }
+}
+
+
+/**
+ * @param requested The network was released on purpose rather than lost
+ */
+void link_quality_network_down(bool requested) {
+    if (requested) {
+        stats.network_releases++;
+        return;
+    }
+
+    stats.network_drops++;
+    network_lost_microsec = now_microsec();
+}
+
+
+void link_quality_broker_up() {
+    stats.broker_connects++;
+    broker_up_microsec = now_microsec();
+    broker_up = true;
+}
+
+
+/**
+ * @brief The broker connection closed; ignored if it never came up.
+ *
+ * Picks the keepalive for the next connection.  Connects that fail leave it
+ * alone, so retrying a broker that is down does not lengthen it.
+ *
+ * @param disconnect_code The broker's MQTT v5 reason, or LINK_QUALITY_CODE_UNAVAILABLE
+ * @param requested       We asked for the disconnect
+ */
+void link_quality_broker_down(uint32_t disconnect_code, bool requested) {
+    if (!broker_up) {
+        return;
+    }
+    broker_up = false;
+
+    uint64_t now = now_microsec();
+    uint32_t lifetime_ms = (uint32_t)((now - broker_up_microsec) / 1000);
+    stats.last_lifetime_ms = lifetime_ms;
+    stats.total_lifetime_ms += lifetime_ms;
+    if (lifetime_ms > stats.max_lifetime_ms) {
+        stats.max_lifetime_ms = lifetime_ms;
+    }
+
+    if (requested) {
+        stats.broker_disconnects++;
+    } else {
+        stats.broker_drops++;
+        count_code(disconnect_code);
+        drop_microsec[next_drop] = now;
+        next_drop = (next_drop + 1) % LINK_QUALITY_MAX_DROP_TIMES;
+    }
+
+    choose_keepalive(lifetime_ms);
+}
+
+
+/**
+ * @brief Broker drops within the last LINK_QUALITY_WINDOW_MS.
+ */
+uint32_t link_quality_recent_drops() {
+    uint64_t now = now_microsec();
+    uint32_t drops = 0;
+    for (uint32_t ndx = 0; ndx < LINK_QUALITY_MAX_DROP_TIMES; ndx++) {
+        if (drop_microsec[ndx] != 0 && now - drop_microsec[ndx] < (uint64_t)LINK_QUALITY_WINDOW_MS * 1000) {
+            drops++;
+        }
+    }
+    return drops;
+}
+
+
+/**
+ * @brief The keepalive for the next broker connection, in seconds.
+ */
+uint16_t link_quality_keepalive() {
+    return keepalive;
+}
+
+
+enum KeepaliveReason link_quality_keepalive_reason() {
+    return keepalive_reason;
+}
+
+
+const char *link_quality_reason_name(enum KeepaliveReason reason) {
+    return reason <= KEEPALIVE_REASON_HELD ? reason_names[reason] : "?";
+}
+
+
+void link_quality_get_stats(struct LinkQualityStats *out) {
+    *out = stats;
+}
@@ -0,0 +1,103 @@
+/**
+ *
+ * Microvisor Link Quality Helper
+ * Version 1.0.0
+ * Copyright © 2023, Twilio
+ * Licence: Apache 2.0
+ *
+ */
+
+/* Network and broker connection history, and the mqtt keepalive it suggests.
+ *
+ * The work task reports the network coming and going, and the mqtt handler
+ * reports the main broker connection coming up and going down, with the
+ * broker's disconnect_code.  Downs we asked for (a disconnect request, or the
+ * network released between duty-cycled wakes) are counted apart from drops.
+ *
+ * As each connection that came up closes, the keepalive for the next one is
+ * chosen from that history; failed connects leave it alone.  It is halved,
+ * down to LINK_QUALITY_KEEPALIVE_MIN_S, when LINK_QUALITY_FLAKY_DROPS or more
+ * drops fell within the last LINK_QUALITY_WINDOW_MS, so a dead link is noticed
+ * sooner.  It is doubled, up to LINK_QUALITY_KEEPALIVE_MAX_S, to save traffic
+ * when nothing dropped in the window and the last connection lasted
+ * LINK_QUALITY_STABLE_MS, whether or not it ended on request.  Otherwise it
+ * is held, as it is after a short connection we closed ourselves.
+ */
+#ifndef LINK_QUALITY_HELPER_H
+#define LINK_QUALITY_HELPER_H
+
+/*
+ * INCLUDES
+ */
+#include <stdint.h>
+#include <stdbool.h>
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * DEFINES
+ */
+#define LINK_QUALITY_KEEPALIVE_DEFAULT_S 60
+#define LINK_QUALITY_KEEPALIVE_MIN_S 15
+#define LINK_QUALITY_KEEPALIVE_MAX_S 600
+#define LINK_QUALITY_WINDOW_MS (60*60*1000)
+#define LINK_QUALITY_FLAKY_DROPS 3
+#define LINK_QUALITY_STABLE_MS (30*60*1000)
+#define LINK_QUALITY_MAX_DROP_TIMES 8
+#define LINK_QUALITY_MAX_CODES 6
+
+// disconnect_code could not be read, eg. the network went
+#define LINK_QUALITY_CODE_UNAVAILABLE 0xFFFFFFFF
+
+/*
+ * TYPES
+ */
+enum KeepaliveReason {
+    KEEPALIVE_REASON_DEFAULT = 0,   // no connection history yet
+    KEEPALIVE_REASON_FLAKY,         // shortened after repeated drops
+    KEEPALIVE_REASON_STABLE,        // lengthened after a long-lived connection
+    KEEPALIVE_REASON_HELD           // a short connection, or drops but not enough to call the link flaky
+};
+
+struct DisconnectCodeCount {
+    uint32_t code;
+    uint32_t count;
+};
+
+struct LinkQualityStats {
+    uint32_t network_ups;
+    uint32_t network_drops;         // lost while wanted
+    uint32_t network_releases;      // released on purpose
+    uint32_t last_outage_ms;        // network lost to network back
+    uint32_t max_outage_ms;
+    uint32_t broker_connects;
+    uint32_t broker_drops;          // closed without our asking
+    uint32_t broker_disconnects;    // closed after our disconnect request
+    uint32_t last_lifetime_ms;      // connected to closed
+    uint32_t max_lifetime_ms;
+    uint64_t total_lifetime_ms;
+    uint32_t other_codes;           // drops whose code did not fit in codes[]
+    struct DisconnectCodeCount codes[LINK_QUALITY_MAX_CODES];
+};
+
+/*
+ * PROTOTYPES
+ */
+void link_quality_network_up();
+void link_quality_network_down(bool requested);
+void link_quality_broker_up();
+void link_quality_broker_down(uint32_t disconnect_code, bool requested);
+uint16_t link_quality_keepalive();
+enum KeepaliveReason link_quality_keepalive_reason();
+const char *link_quality_reason_name(enum KeepaliveReason reason);
+uint32_t link_quality_recent_drops();
+void link_quality_get_stats(struct LinkQualityStats *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LINK_QUALITY_HELPER_H */
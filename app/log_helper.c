@@ -11,38 +11,198 @@
 #include "log_helper.h"
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
 #include "uart_logging.h"
+#include "log_token_helper.h"
 
 // Microvisor includes
+#include "cmsis_os.h"
 #include "mv_syscalls.h"
 
+#define LOG_MODULE LOG_MODULE_LOG
+
+
+/*
+ * DEFINES
+ */
+#define LOG_FLAG_PENDING 0x01
+
+#define LOG_PREFIX_SIZE 8
+#define LOG_RECORD_ALIGN 8
+#define LOG_RECORD_SIZE(length) ((sizeof(struct LogRecordHeader) + (length) + LOG_RECORD_ALIGN - 1) & ~(LOG_RECORD_ALIGN - 1))
+
+// Records are aligned, so the low bit of a position is free to tell a complete
+// record from a zeroed or not yet written header
+#define LOG_RECORD_COMPLETE(position) ((position) | 1)
+
+
+/*
+ * TYPES
+ */
+enum LogRecordType {
+    LOG_RECORD_MESSAGE = 0,
+    LOG_RECORD_PAD = 1,             // fills the end of the ring when a record would straddle it
+    LOG_RECORD_TOKEN = 2            // a tokenized record, made into a line as it is output
+};
+
+// Each record is a header and then the message text, with its newline, or the
+// token record from log_token_helper.c
+struct LogRecordHeader {
+    uint16_t length;                // data bytes, or bytes skipped after the header for a pad
+    uint16_t type;
+    _Atomic uint32_t complete;      // LOG_RECORD_COMPLETE(position) once the record is written
+};
+
+
+/*
+ * GLOBALS
+ */
+static volatile enum LogLevel log_level = LOG_LEVEL_DEBUG;
+
+// The *_DEBUGGING switches start their modules at trace level
+volatile uint8_t log_module_levels[LOG_MODULE_COUNT] = {
+    [0 ... LOG_MODULE_COUNT - 1] = LOG_LEVEL_DEBUG,
+#if defined(WORK_DEBUGGING)
+    [LOG_MODULE_WORK] = LOG_LEVEL_TRACE,
+    [LOG_MODULE_MQTT] = LOG_LEVEL_TRACE,
+#endif
+#if defined(CONFIG_DEBUGGING)
+    [LOG_MODULE_CONFIG] = LOG_LEVEL_TRACE,
+#endif
+#if defined(APPLICATION_DEBUGGING)
+    [LOG_MODULE_APP] = LOG_LEVEL_TRACE,
+#endif
+};
+
+#define LOG_MODULE_NAME(name, label) [LOG_MODULE_##name] = label,
+
+static const char *const module_names[LOG_MODULE_COUNT] = {
+    LOG_MODULES(LOG_MODULE_NAME)
+};
+
+static const char *const level_names[] = {
+    [LOG_LEVEL_ERROR] = "error",
+    [LOG_LEVEL_DEBUG] = "debug",
+    [LOG_LEVEL_TRACE] = "trace"
+};
+
+static const char *const level_prefixes[] = {
+    [LOG_LEVEL_ERROR] = "[ERROR] ",
+    [LOG_LEVEL_DEBUG] = "[DEBUG] ",
+    [LOG_LEVEL_TRACE] = "[TRACE] "
+};
+
+// Positions count bytes ever reserved and wrap at 2^32; a record's offset in the
+// ring is its position modulo LOG_RING_SIZE
+static uint8_t ring[LOG_RING_SIZE] __attribute__((aligned(LOG_RECORD_ALIGN))) = {0};
+static _Atomic uint32_t ring_head = 0;          // next position to reserve
+static _Atomic uint32_t ring_tail = 0;          // oldest record not yet output
+
+static osThreadId_t log_task_id = NULL;
+
+static _Atomic uint32_t stat_messages = 0;
+static _Atomic uint32_t stat_dropped = 0;
+static _Atomic uint32_t stat_bytes = 0;
+static _Atomic uint32_t stat_high_water = 0;
+static uint32_t stat_flushes = 0;
+
+
+/*
+ * FORWARD DECLARATIONS
+ */
+static bool enqueue(const void *data, uint32_t length, enum LogRecordType type);
+static uint32_t render(const struct LogRecordHeader *header, char *message, uint32_t size);
+static struct LogRecordHeader *next_record(uint32_t *position);
+static bool release_record(uint32_t position, uint32_t length);
+static void output(const char *text, uint32_t length);
+
 
 /**
- * @brief Issue a debug message.
+ * @brief Set every module's level; see the log_level tunable and the "log" RPC.
+ */
+void log_set_level(enum LogLevel level) {
+    log_level = level;
+    for (uint32_t module = 0; module < LOG_MODULE_COUNT; module++) {
+        log_module_levels[module] = level;
+    }
+}
+
+
+/**
+ * @brief The level last set for every module, not any one module's level.
+ */
+enum LogLevel log_get_level() {
+    return log_level;
+}
+
+
+void log_set_module_level(enum LogModule module, enum LogLevel level) {
+    if (module < LOG_MODULE_COUNT) {
+        log_module_levels[module] = level;
+    }
+}
+
+
+enum LogLevel log_get_module_level(enum LogModule module) {
+    return module < LOG_MODULE_COUNT ? (enum LogLevel)log_module_levels[module] : LOG_LEVEL_ERROR;
+}
+
+
+const char *log_level_name(enum LogLevel level) {
+    return level <= LOG_LEVEL_TRACE ? level_names[level] : "?";
+}
+
+
+const char *log_module_name(enum LogModule module) {
+    return module < LOG_MODULE_COUNT ? module_names[module] : "?";
+}
+
+
+/**
+ * @brief Look up a level by its name, eg. "trace".
  *
- * @param format_string Message string with optional formatting
- * @param ...           Optional injectable values
+ * @retval false if there is no such level.
+ */
+bool log_find_level(const uint8_t *name, size_t name_len, enum LogLevel *level) {
+    for (uint32_t ndx = 0; ndx <= LOG_LEVEL_TRACE; ndx++) {
+        if (strlen(level_names[ndx]) == name_len && memcmp(level_names[ndx], name, name_len) == 0) {
+            *level = (enum LogLevel)ndx;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/**
+ * @brief Look up a module by its name, eg. "mqtt".
+ *
+ * @retval false if there is no such module.
  */
-void server_log(char* format_string, ...) {
-    if (LOG_DEBUG_MESSAGES) {
-        va_list args;
-        va_start(args, format_string);
-        do_log(false, format_string, args);
-        va_end(args);
+bool log_find_module(const uint8_t *name, size_t name_len, enum LogModule *module) {
+    for (uint32_t ndx = 0; ndx < LOG_MODULE_COUNT; ndx++) {
+        if (strlen(module_names[ndx]) == name_len && memcmp(module_names[ndx], name, name_len) == 0) {
+            *module = (enum LogModule)ndx;
+            return true;
+        }
     }
+    return false;
 }
 
 
 /**
- * @brief Issue an error message.
+ * @brief Issue a message as text; server_error(), server_log() and server_trace()
+ *        call this once the level check has passed.
  *
+ * @param level         The message's level
  * @param format_string Message string with optional formatting
  * @param ...           Optional injectable values
  */
-void server_error(char* format_string, ...) {
+void log_text(enum LogLevel level, const char* format_string, ...) {
     va_list args;
     va_start(args, format_string);
-    do_log(false, format_string, args);
+    do_log(level, format_string, args);
     va_end(args);
 }
 
@@ -50,26 +210,275 @@ void server_error(char* format_string, ...) {
 /**
  * @brief Issue any log message.
  *
- * @param is_err        Is the message an error?
+ * The message is formatted here but queued for the log task to output.
+ *
+ * @param level         The message's level
  * @param format_string Message string with optional formatting
  * @param args          va_list of args from previous call
  */
-void do_log(bool is_err, char* format_string, va_list args) {
-    char buffer[512] = {0}; // If you increase the buffer here, you may need to increase the stack size for the calling FreeRTOS task.
+void do_log(enum LogLevel level, const char* format_string, va_list args) {
+    char buffer[LOG_MESSAGE_MAX]; // If you increase the buffer here, you may need to increase the stack size for the calling FreeRTOS task.
 
     // Write the message type to the message
-    sprintf(buffer, is_err ? "[ERROR] " : "[DEBUG] ");
+    memcpy(buffer, level_prefixes[level <= LOG_LEVEL_TRACE ? level : LOG_LEVEL_TRACE], LOG_PREFIX_SIZE);
+
+    // Write the formatted text to the message, leaving room for the NEWLINE
+    size_t space = sizeof(buffer) - LOG_PREFIX_SIZE - 1;
+    int length = vsnprintf(&buffer[LOG_PREFIX_SIZE], space, format_string, args);
+    if (length < 0) {
+        length = 0;
+    } else if ((size_t)length >= space) {
+        length = space - 1;
+    }
+    length += LOG_PREFIX_SIZE;
+    buffer[length++] = '\n';
+
+    log_queue_message(buffer, length);
+}
+
+
+/**
+ * @brief Queue a finished message for the log task.
+ *
+ * @param message Message text, ending in NEWLINE
+ * @param length  Message length, at most LOG_MESSAGE_MAX
+ */
+void log_queue_message(const char *message, uint32_t length) {
+    if (enqueue(message, length, LOG_RECORD_MESSAGE) && log_task_id != NULL) {
+        osThreadFlagsSet(log_task_id, LOG_FLAG_PENDING);
+    }
+}
 
-    // Write the formatted text to the message
-    vsnprintf(&buffer[8], sizeof(buffer) - 9, format_string, args);
 
-    // Output the message using the system call
-    mvServerLog((const uint8_t*)buffer, (uint16_t)strlen(buffer));
+/**
+ * @brief Queue a tokenized record for the log task, which encodes it; see log_token().
+ *
+ * @param record Level, token and arguments, at most LOG_TOKEN_RECORD_MAX bytes
+ * @param length Record length
+ */
+void log_queue_token(const uint8_t *record, uint32_t length) {
+    if (enqueue(record, length, LOG_RECORD_TOKEN) && log_task_id != NULL) {
+        osThreadFlagsSet(log_task_id, LOG_FLAG_PENDING);
+    }
+}
+
+
+/**
+ * @brief Function implementing the log task thread.
+ *
+ * Outputs queued messages until the ring is empty, then sleeps until
+ * do_log() queues more.  Runs below every other task, so logging only
+ * takes time the rest of the application is not using.
+ *
+ * @param  argument: Not used.
+ */
+void start_log_task(void *argument) {
+    static char message[LOG_MESSAGE_MAX];
+    uint32_t reported_dropped = 0;
+
+    // Set before the first drain, so nothing queued from here on goes unsignalled
+    log_task_id = osThreadGetId();
+
+    // The task's main loop
+    while (1) {
+        uint32_t position;
+        struct LogRecordHeader *header;
+        while ((header = next_record(&position)) != NULL) {
+            uint32_t length = header->length;
+
+            // Copy the text out, as log_flush() may release the record while it is
+            // being output; the message is then output twice but never garbled
+            uint32_t rendered = render(header, message, sizeof(message));
+            if (rendered != 0) {
+                output(message, rendered);
+            }
+            release_record(position, length);
+        }
+
+        uint32_t dropped = atomic_load(&stat_dropped);
+        if (dropped != reported_dropped) {
+            int length = snprintf(message, sizeof(message), "[ERROR] %lu log messages dropped\n",
+                                  dropped - reported_dropped);
+            output(message, length);
+            reported_dropped = dropped;
+        }
+
+        osThreadFlagsWait(LOG_FLAG_PENDING, osFlagsWaitAny, osWaitForever);
+    }
+}
+
+
+/**
+ * @brief Output every queued message now, from the calling task.
+ *
+ * For use before the device stops or resets.  Other tasks are held off while
+ * the ring drains, and each message is sent from the UART before the next is
+ * output.  Must not be called from an interrupt.
+ */
+void log_flush() {
+    bool running = osKernelGetState() == osKernelRunning;
+    int32_t lock = running ? osKernelLock() : 0;
+
+    uint32_t position;
+    struct LogRecordHeader *header;
+    while ((header = next_record(&position)) != NULL) {
+        if (header->type == LOG_RECORD_TOKEN) {
+            char line[LOG_TOKEN_LINE_MAX];
+            uint32_t rendered = render(header, line, sizeof(line));
+            if (rendered != 0) {
+                output(line, rendered);
+            }
+        } else {
+            output((const char *)(header + 1), header->length);
+        }
+        release_record(position, header->length);
+
+        // Let the UART catch up, so nothing is dropped from its ring
+        UART_flush(UART_FLUSH_TIMEOUT_MS);
+    }
+    stat_flushes++;
+
+    if (running) {
+        osKernelRestoreLock(lock);
+    }
+}
+
+
+void log_get_stats(struct LogStats *out) {
+    out->messages = atomic_load(&stat_messages);
+    out->dropped = atomic_load(&stat_dropped);
+    out->bytes = atomic_load(&stat_bytes);
+    out->high_water = atomic_load(&stat_high_water);
+    out->flushes = stat_flushes;
+}
+
+
+/**
+ * @brief Report a failed assert() and stop.
+ *
+ * Replaces newlib's version, which writes to a stderr nothing reads.
+ */
+void __assert_func(const char *file, int line, const char *func, const char *expression) {
+    server_error("assert (%s) failed in %s at %s:%d", expression, func != NULL ? func : "?", file, line);
+    log_flush();
+    abort();
+}
+
+
+/*
+ * RING
+ */
+
+/**
+ * @brief Copy a message, or a token record, into the ring.
+ *
+ * Writers claim space by moving ring_head on with a compare-and-swap, so any
+ * number can write at once without a lock; each then marks its record complete
+ * when it has filled it.  Records are output in the order their space was
+ * claimed, so a writer that is slow to finish holds up those after it.
+ *
+ * @retval false if the ring is too full; the message is dropped and counted.
+ */
+static bool enqueue(const void *data, uint32_t length, enum LogRecordType type) {
+    uint32_t size = LOG_RECORD_SIZE(length);
+    uint32_t head = atomic_load(&ring_head);
+    uint32_t pad, used;
+
+    do {
+        // Records never wrap: one that would is placed at the start of the
+        // ring instead, after a pad record covering the rest of the end
+        uint32_t offset = head & (LOG_RING_SIZE - 1);
+        pad = offset + size > LOG_RING_SIZE ? LOG_RING_SIZE - offset : 0;
+        used = head + pad + size - atomic_load(&ring_tail);
+        if (used > LOG_RING_SIZE) {
+            atomic_fetch_add(&stat_dropped, 1);
+            return false;
+        }
+    } while (!atomic_compare_exchange_weak(&ring_head, &head, head + pad + size));
+
+    if (pad != 0) {
+        struct LogRecordHeader *filler = (struct LogRecordHeader *)&ring[head & (LOG_RING_SIZE - 1)];
+        filler->length = pad - sizeof(struct LogRecordHeader);
+        filler->type = LOG_RECORD_PAD;
+        atomic_store_explicit(&filler->complete, LOG_RECORD_COMPLETE(head), memory_order_release);
+        head += pad;
+    }
+
+    struct LogRecordHeader *header = (struct LogRecordHeader *)&ring[head & (LOG_RING_SIZE - 1)];
+    header->length = length;
+    header->type = type;
+    memcpy(header + 1, data, length);
+    atomic_store_explicit(&header->complete, LOG_RECORD_COMPLETE(head), memory_order_release);
+
+    atomic_fetch_add(&stat_messages, 1);
+    atomic_fetch_add(&stat_bytes, pad + size);
+    uint32_t high_water = atomic_load(&stat_high_water);
+    while (used > high_water && !atomic_compare_exchange_weak(&stat_high_water, &high_water, used)) { }
+    return true;
+}
+
+
+/**
+ * @brief Copy a record's line into message, encoding it first if it is a token record.
+ *
+ * @retval The line's length, or 0 if there is nothing to output.
+ */
+static uint32_t render(const struct LogRecordHeader *header, char *message, uint32_t size) {
+    if (header->type == LOG_RECORD_TOKEN) {
+        return log_token_line(message, size, (const uint8_t *)(header + 1), header->length);
+    }
+
+    uint32_t copied = header->length < size ? header->length : size;
+    memcpy(message, header + 1, copied);
+    return copied;
+}
+
+
+/**
+ * @brief The oldest message in the ring, skipping pad records.
+ *
+ * @retval NULL if the ring is empty or the oldest message is still being written.
+ */
+static struct LogRecordHeader *next_record(uint32_t *position) {
+    while (1) {
+        *position = atomic_load(&ring_tail);
+        if (*position == atomic_load(&ring_head)) {
+            return NULL;
+        }
+
+        struct LogRecordHeader *header = (struct LogRecordHeader *)&ring[*position & (LOG_RING_SIZE - 1)];
+        if (atomic_load_explicit(&header->complete, memory_order_acquire) != LOG_RECORD_COMPLETE(*position)) {
+            return NULL;
+        }
+
+        if (header->type != LOG_RECORD_PAD) {
+            return header;
+        }
+
+        release_record(*position, header->length);
+    }
+}
+
+
+/**
+ * @brief Hand a record's space back to the writers.
+ *
+ * @retval false if another reader got there first.
+ */
+static bool release_record(uint32_t position, uint32_t length) {
+    return atomic_compare_exchange_strong(&ring_tail, &position, position + LOG_RECORD_SIZE(length));
+}
+
+
+/**
+ * @brief Pass a message, ending in NEWLINE, to Microvisor and the UART.
+ */
+static void output(const char *text, uint32_t length) {
+    // Microvisor adds its own line breaks
+    mvServerLog((const uint8_t *)text, (uint16_t)(length - 1));
 
     // Do we output via UART too?
     if (uart_available) {
-        // Add NEWLINE to the message and output to UART
-        buffer[sizeof(buffer) < strlen(buffer) ? sizeof(buffer)-1 : strlen(buffer)] = '\n';
-        UART_output((uint8_t*)buffer, strlen(buffer));
+        UART_output((uint8_t *)text, length);
     }
 }
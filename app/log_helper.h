@@ -25,14 +25,36 @@
  *
  * Logging also depends on an active network connection to process and flush
  * the logging buffer.  This will vary based on your application.
+ *
+ * server_log() and server_error() format the message in the caller, copy it
+ * into a ring of LOG_RING_SIZE bytes and return; the low-priority log task,
+ * start_log_task(), passes it on to Microvisor and the UART.  The ring takes
+ * any number of writers without a lock.  A message that does not fit is
+ * dropped and counted, and the log task reports how many it lost once there
+ * is room again.  Call log_flush() before anything that stops the device, so
+ * the messages explaining it are not left in the ring.
+ *
+ * Each message has a level, set by the macro that issues it:
+ *
+ *   server_error()   LOG_LEVEL_ERROR, always issued
+ *   server_log()     LOG_LEVEL_DEBUG
+ *   server_trace()   LOG_LEVEL_TRACE, step by step detail
+ *
+ * and a module, the LOG_MODULE of the file it is issued from.  A message is
+ * issued if its level is no more verbose than its module's level, which the
+ * "log" RPC and the log_level tunable change at run time.  That check comes
+ * before the arguments are evaluated.  Levels more verbose than
+ * LOG_COMPILE_LEVEL are compiled out altogether, arguments included.
  */
 
 
 /*
  * INCLUDES
  */
+#include <stdint.h>
 #include <stdbool.h>
 #include <stdarg.h>
+#include <stddef.h>
 
 
 #ifdef __cplusplus
@@ -40,12 +62,93 @@ extern "C" {
 #endif
 
 
+/*
+ * DEFINES
+ */
+// Uncomment to log format string tokens and raw arguments in place of text;
+// see log_token_helper.h.  Decode the log with log_decoder.py
+//#define LOG_TOKENIZED
+
+// Uncomment to time text against tokenized logging at start-up
+//#define LOG_BENCHMARK
+
+#define LOG_RING_SIZE 4096              // Must be a power of two
+#define LOG_MESSAGE_MAX 512             // Including the type prefix
+
+// The most verbose level compiled in; LOG_DEBUG_MESSAGES false leaves errors only
+#if !defined(LOG_COMPILE_LEVEL)
+#define LOG_COMPILE_LEVEL (LOG_DEBUG_MESSAGES ? LOG_LEVEL_TRACE : LOG_LEVEL_ERROR)
+#endif
+
+// Every source file that logs defines LOG_MODULE as one of these, eg.
+// #define LOG_MODULE LOG_MODULE_WORK, and the "log" RPC knows it by name
+#define LOG_MODULES(MODULE) \
+    MODULE(MAIN, "main") \
+    MODULE(WORK, "work") \
+    MODULE(CONFIG, "config") \
+    MODULE(MQTT, "mqtt") \
+    MODULE(NETWORK, "network") \
+    MODULE(APP, "app") \
+    MODULE(LOG, "log")
+
+// Pass the argument of a %.*s as LOG_STRING(data, length)
+#if defined(LOG_TOKENIZED)
+#define LOG_STRING(data, len) ((struct LogTokenString){ (const char *)(data), (int)(len) })
+#else
+#define LOG_STRING(data, len) (int)(len), (const char *)(data)
+#endif
+
+
+/*
+ * TYPES
+ */
+enum LogLevel {
+    LOG_LEVEL_ERROR = 0,            // server_error() only
+    LOG_LEVEL_DEBUG = 1,            // server_log() too
+    LOG_LEVEL_TRACE = 2             // server_trace() too
+};
+
+#define LOG_DECLARE_MODULE(name, label) LOG_MODULE_##name,
+
+enum LogModule {
+    LOG_MODULES(LOG_DECLARE_MODULE)
+    LOG_MODULE_COUNT
+};
+
+struct LogStats {
+    uint32_t messages;              // queued
+    uint32_t dropped;               // no room in the ring
+    uint32_t bytes;                 // queued, including record headers
+    uint32_t high_water;            // most bytes the ring has held
+    uint32_t flushes;
+};
+
+
 /*
  * PROTOTYPES
  */
-void server_log(char* format_string, ...);
-void server_error(char* format_string, ...);
-void do_log(bool is_err, char* format_string, va_list args);
+void log_set_level(enum LogLevel level);
+enum LogLevel log_get_level();
+void log_set_module_level(enum LogModule module, enum LogLevel level);
+enum LogLevel log_get_module_level(enum LogModule module);
+const char *log_level_name(enum LogLevel level);
+const char *log_module_name(enum LogModule module);
+bool log_find_level(const uint8_t *name, size_t name_len, enum LogLevel *level);
+bool log_find_module(const uint8_t *name, size_t name_len, enum LogModule *module);
+void log_text(enum LogLevel level, const char* format_string, ...);
+void do_log(enum LogLevel level, const char* format_string, va_list args);
+void log_queue_message(const char *message, uint32_t length);
+void log_queue_token(const uint8_t *record, uint32_t length);
+void start_log_task(void *argument);
+void log_flush();
+void log_get_stats(struct LogStats *out);
+
+
+/*
+ * GLOBALS
+ */
+// Indexed by enum LogModule; written by log_set_module_level() only
+extern volatile uint8_t log_module_levels[LOG_MODULE_COUNT];
 
 
 #ifdef __cplusplus
@@ -53,4 +156,31 @@ void do_log(bool is_err, char* format_string, va_list args);
 #endif
 
 
+/*
+ * MACROS
+ */
+// A constant false for levels compiled out, so the code it guards is too
+#define LOG_ENABLED(level) ((level) <= LOG_COMPILE_LEVEL && (level) <= log_module_levels[LOG_MODULE])
+
+#if defined(LOG_TOKENIZED)
+#include "log_token_helper.h"
+
+#define LOG_AT(level, format_string, ...) do { \
+    if (LOG_ENABLED(level)) { \
+        LOG_TOKEN_CALL(level, format_string, ##__VA_ARGS__); \
+    } \
+} while (0)
+#else
+#define LOG_AT(level, format_string, ...) do { \
+    if (LOG_ENABLED(level)) { \
+        log_text(level, format_string, ##__VA_ARGS__); \
+    } \
+} while (0)
+#endif
+
+#define server_error(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define server_log(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define server_trace(...) LOG_AT(LOG_LEVEL_TRACE, __VA_ARGS__)
+
+
 #endif /* LOG_HELPER_H */
@@ -0,0 +1,222 @@
+/**
+ *
+ * Microvisor Log Token Helper
+ * Version 1.0.0
+ * Copyright © 2023, Twilio
+ * Licence: Apache 2.0
+ *
+ */
+
+#include "log_token_helper.h"
+#include <string.h>
+#include <stdio.h>
+#include <stdarg.h>
+
+// Microvisor includes
+#include "mv_syscalls.h"
+
+#include "log_helper.h"
+
+#define LOG_MODULE LOG_MODULE_LOG
+
+
+#define LOG_BENCHMARK_RUNS 1000
+
+struct LogTokenRecord {
+    uint8_t data[LOG_TOKEN_RECORD_MAX];
+    size_t length;
+    bool truncated;
+};
+
+
+// Puts .log_strings in every image, tokenized or not, for log_strings.ld to check
+static const char log_strings_anchor[] __attribute__((section(LOG_TOKEN_SECTION), used)) = "";
+
+static const char base64_chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// Indexed by enum LogLevel
+static const char level_markers[] = "EDT";
+
+
+static void put_bytes(struct LogTokenRecord *record, const void *data, size_t length) {
+    if (record->truncated || record->length + length > sizeof(record->data)) {
+        record->truncated = true;
+        return;
+    }
+    memcpy(&record->data[record->length], data, length);
+    record->length += length;
+}
+
+static void put_string(struct LogTokenRecord *record, const char *text, size_t max) {
+    uint8_t length = 0;
+    if (text != NULL) {
+        while (length < max && text[length] != 0) {
+            length++;
+        }
+    }
+    put_bytes(record, &length, 1);
+    put_bytes(record, text, length);
+}
+
+/**
+ * @brief Append each argument's bytes to the record, as types describes them.
+ */
+static void put_args(struct LogTokenRecord *record, uint32_t types, va_list args) {
+    for (; types != LOG_TOKEN_END; types >>= LOG_TOKEN_TYPE_BITS) {
+        switch (types & LOG_TOKEN_TYPE_MASK) {
+            case LOG_TOKEN_INT32: {
+                uint32_t value = va_arg(args, uint32_t);
+                put_bytes(record, &value, 4);
+                break;
+            }
+            case LOG_TOKEN_INT64: {
+                uint64_t value = va_arg(args, uint64_t);
+                put_bytes(record, &value, 8);
+                break;
+            }
+            case LOG_TOKEN_DOUBLE: {
+                double value = va_arg(args, double);
+                put_bytes(record, &value, 8);
+                break;
+            }
+            case LOG_TOKEN_STR:
+                put_string(record, va_arg(args, const char *), LOG_TOKEN_STRING_MAX);
+                break;
+            case LOG_TOKEN_SIZED_STR: {
+                // Sent as the %.*s pair, but never read past the given length
+                struct LogTokenString value = va_arg(args, struct LogTokenString);
+                int32_t length = value.length < 0 ? 0 : value.length;
+                put_bytes(record, &length, 4);
+                put_string(record, value.data, length < LOG_TOKEN_STRING_MAX ? (size_t)length : LOG_TOKEN_STRING_MAX);
+                break;
+            }
+            default:
+                return;
+        }
+    }
+}
+
+/**
+ * @brief Start a record with its level and token, then append the arguments.
+ */
+static void build(struct LogTokenRecord *record, uint8_t level, uint16_t token, uint32_t types, va_list args) {
+    record->length = 0;
+    record->truncated = false;
+    put_bytes(record, &level, 1);
+    put_bytes(record, &token, 2);
+    put_args(record, types, args);
+}
+
+
+/**
+ * @brief Queue a tokenized message; see LOG_TOKEN_CALL().
+ *
+ * Only the raw record is queued: the log task turns it into a line as it
+ * outputs it, see log_token_line().  Arguments that do not fit in
+ * LOG_TOKEN_RECORD_MAX are left off, and the decoder shows where.  The caller
+ * has already checked the level.
+ */
+void log_token(uint8_t level, uint16_t token, uint32_t types, ...) {
+    struct LogTokenRecord record;
+    va_list args;
+    va_start(args, types);
+    build(&record, level, token, types, args);
+    va_end(args);
+
+    log_queue_token(record.data, record.length);
+}
+
+
+/**
+ * @brief Write a queued record as a log line: marker, level, base64 and NEWLINE.
+ *
+ * @param record The level byte, then the token and arguments that are encoded
+ * @param length The record's length, level byte included
+ *
+ * @retval The line's length, or 0 if it does not fit.
+ */
+size_t log_token_line(char *line, size_t size, const uint8_t *record, size_t length) {
+    if (length < 1) {
+        return 0;
+    }
+    uint8_t level = record[0];
+    const uint8_t *data = &record[1];
+    length--;
+
+    size_t needed = 2 + ((length + 2) / 3) * 4 + 1;
+    if (needed > size) {
+        return 0;
+    }
+
+    size_t used = 0;
+    line[used++] = '#';
+    line[used++] = level_markers[level <= LOG_LEVEL_TRACE ? level : LOG_LEVEL_TRACE];
+
+    for (size_t ndx = 0; ndx < length; ndx += 3) {
+        uint32_t group = data[ndx] << 16;
+        if (ndx + 1 < length) group |= data[ndx + 1] << 8;
+        if (ndx + 2 < length) group |= data[ndx + 2];
+
+        line[used++] = base64_chars[(group >> 18) & 0x3F];
+        line[used++] = base64_chars[(group >> 12) & 0x3F];
+        line[used++] = ndx + 1 < length ? base64_chars[(group >> 6) & 0x3F] : '=';
+        line[used++] = ndx + 2 < length ? base64_chars[group & 0x3F] : '=';
+    }
+
+    line[used++] = '\n';
+    return used;
+}
+
+
+#if defined(LOG_BENCHMARK)
+static void benchmark_record(struct LogTokenRecord *record, uint8_t level, uint16_t token, uint32_t types, ...) {
+    va_list args;
+    va_start(args, types);
+    build(record, level, token, types, args);
+    va_end(args);
+}
+
+
+/**
+ * @brief Time a typical message formatted as text and as a token, and log the results.
+ *
+ * Only the work done in the caller is timed, as queueing costs the same for
+ * both apart from the length.  The base64 line a token record becomes is
+ * timed too, though the log task does that work, not the caller.
+ */
+void log_benchmark() {
+    char buffer[LOG_MESSAGE_MAX];
+    struct LogTokenRecord record;
+    uint64_t start = 0, end = 0;
+    size_t text_length = 0, line_length = 0;
+
+    mvGetMicroseconds(&start);
+    for (uint32_t run = 0; run < LOG_BENCHMARK_RUNS; run++) {
+        text_length = snprintf(buffer, sizeof(buffer), "[DEBUG] reconnect %lu took %lu ms, next backoff %lu ms\n",
+                               run, (uint32_t)1500 + run, (uint32_t)4000);
+    }
+    mvGetMicroseconds(&end);
+    uint32_t text_us = (uint32_t)(end - start);
+
+    mvGetMicroseconds(&start);
+    for (uint32_t run = 0; run < LOG_BENCHMARK_RUNS; run++) {
+        LOG_TOKEN_DEFINE("reconnect %lu took %lu ms, next backoff %lu ms");
+        benchmark_record(&record, LOG_LEVEL_DEBUG, LOG_TOKEN_OF_FORMAT,
+                         LOG_TOKEN_TYPES(run, (uint32_t)1500 + run, (uint32_t)4000),
+                         run, (uint32_t)1500 + run, (uint32_t)4000);
+    }
+    mvGetMicroseconds(&end);
+    uint32_t token_us = (uint32_t)(end - start);
+
+    mvGetMicroseconds(&start);
+    for (uint32_t run = 0; run < LOG_BENCHMARK_RUNS; run++) {
+        line_length = log_token_line(buffer, sizeof(buffer), record.data, record.length);
+    }
+    mvGetMicroseconds(&end);
+    uint32_t line_us = (uint32_t)(end - start);
+
+    server_log("log benchmark, %lu runs: text %lu bytes %lu us, token %lu bytes %lu us, then %lu us for %lu byte lines",
+               (uint32_t)LOG_BENCHMARK_RUNS, (uint32_t)text_length, text_us, (uint32_t)record.length, token_us,
+               line_us, (uint32_t)line_length);
+}
+#endif
@@ -0,0 +1,138 @@
+/**
+ *
+ * Microvisor Log Token Helper
+ * Version 1.0.0
+ * Copyright © 2023, Twilio
+ * Licence: Apache 2.0
+ *
+ */
+
+/* Tokenized logging, used by server_error(), server_log() and server_trace() when
+ * LOG_TOKENIZED is defined (see log_helper.h).
+ *
+ * Each call's format string is placed in LOG_TOKEN_SECTION, which the linker
+ * keeps in the ELF but leaves out of the loaded image, so the strings cost no
+ * flash.  The section starts at address 0, so a string's address is its
+ * offset in the section and serves as its 16-bit token.  At run time nothing
+ * is formatted: the caller queues the level, the token and the raw argument
+ * bytes as they are, and the log task base64 encodes them on a line of their
+ * own as it outputs them, eg.
+ *
+ *   #DkAEHAAAA
+ *
+ * where the letter after the # is the level: E, D or T.  log_decoder.py rebuilds the text from the line and the ELF.  Each
+ * argument's type is taken from its C type, so a %.*s argument must be passed
+ * with LOG_STRING() to keep its length with it.
+ *
+ * Record: level (1 byte, queued but not encoded), token (2 bytes, little
+ * endian) then, per argument,
+ *   int, long and pointers       4 bytes, little endian
+ *   long long                    8 bytes
+ *   float, double                8 bytes, as double
+ *   strings                      1 length byte, then at most LOG_TOKEN_STRING_MAX bytes
+ *   LOG_STRING()                 4 byte length, then as a string
+ */
+#ifndef LOG_TOKEN_HELPER_H
+#define LOG_TOKEN_HELPER_H
+
+/*
+ * INCLUDES
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * DEFINES
+ */
+#define LOG_TOKEN_RECORD_MAX 96
+#define LOG_TOKEN_STRING_MAX 48
+#define LOG_TOKEN_LINE_MAX (2 + ((LOG_TOKEN_RECORD_MAX + 2) / 3) * 4 + 1)
+
+// No "a" flag, so the section is not allocated; the trailing comment char
+// hides the flags GCC appends
+#if defined(__arm__)
+#define LOG_TOKEN_SECTION ".log_strings,\"\",%progbits @"
+#else
+#define LOG_TOKEN_SECTION ".log_strings,\"\",@progbits #"
+#endif
+
+// Argument types, LOG_TOKEN_TYPE_BITS each in a call's type word
+#define LOG_TOKEN_END 0
+#define LOG_TOKEN_INT32 1
+#define LOG_TOKEN_INT64 2
+#define LOG_TOKEN_DOUBLE 3
+#define LOG_TOKEN_STR 4
+#define LOG_TOKEN_SIZED_STR 5
+#define LOG_TOKEN_TYPE_BITS 4
+#define LOG_TOKEN_TYPE_MASK 0x0F
+
+#define LOG_TOKEN_ARG_TYPE(arg) _Generic((arg), \
+    char *: LOG_TOKEN_STR, \
+    const char *: LOG_TOKEN_STR, \
+    unsigned char *: LOG_TOKEN_STR, \
+    const unsigned char *: LOG_TOKEN_STR, \
+    float: LOG_TOKEN_DOUBLE, \
+    double: LOG_TOKEN_DOUBLE, \
+    struct LogTokenString: LOG_TOKEN_SIZED_STR, \
+    default: (sizeof(arg) > 4 ? LOG_TOKEN_INT64 : LOG_TOKEN_INT32))
+
+// Up to eight arguments per call
+#define LOG_TOKEN_COUNT(...) LOG_TOKEN_COUNT_(0, ##__VA_ARGS__, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+#define LOG_TOKEN_COUNT_(_0, _1, _2, _3, _4, _5, _6, _7, _8, count, ...) count
+#define LOG_TOKEN_JOIN(a, b) LOG_TOKEN_JOIN_(a, b)
+#define LOG_TOKEN_JOIN_(a, b) a##b
+
+#define LOG_TOKEN_TYPES(...) LOG_TOKEN_JOIN(LOG_TOKEN_TYPES_, LOG_TOKEN_COUNT(__VA_ARGS__))(__VA_ARGS__)
+#define LOG_TOKEN_TYPES_0() LOG_TOKEN_END
+#define LOG_TOKEN_TYPES_1(a) ((uint32_t)LOG_TOKEN_ARG_TYPE(a))
+#define LOG_TOKEN_TYPES_2(a, ...) (LOG_TOKEN_TYPES_1(a) | (LOG_TOKEN_TYPES_1(__VA_ARGS__) << LOG_TOKEN_TYPE_BITS))
+#define LOG_TOKEN_TYPES_3(a, ...) (LOG_TOKEN_TYPES_1(a) | (LOG_TOKEN_TYPES_2(__VA_ARGS__) << LOG_TOKEN_TYPE_BITS))
+#define LOG_TOKEN_TYPES_4(a, ...) (LOG_TOKEN_TYPES_1(a) | (LOG_TOKEN_TYPES_3(__VA_ARGS__) << LOG_TOKEN_TYPE_BITS))
+#define LOG_TOKEN_TYPES_5(a, ...) (LOG_TOKEN_TYPES_1(a) | (LOG_TOKEN_TYPES_4(__VA_ARGS__) << LOG_TOKEN_TYPE_BITS))
+#define LOG_TOKEN_TYPES_6(a, ...) (LOG_TOKEN_TYPES_1(a) | (LOG_TOKEN_TYPES_5(__VA_ARGS__) << LOG_TOKEN_TYPE_BITS))
+#define LOG_TOKEN_TYPES_7(a, ...) (LOG_TOKEN_TYPES_1(a) | (LOG_TOKEN_TYPES_6(__VA_ARGS__) << LOG_TOKEN_TYPE_BITS))
+#define LOG_TOKEN_TYPES_8(a, ...) (LOG_TOKEN_TYPES_1(a) | (LOG_TOKEN_TYPES_7(__VA_ARGS__) << LOG_TOKEN_TYPE_BITS))
+
+// The format string, out of the image, and its token
+#define LOG_TOKEN_DEFINE(format) \
+    static const char log_token_format[] __attribute__((section(LOG_TOKEN_SECTION), used)) = format
+
+// Tokens are 16 bits, so the section must stay under 64 KB; the link checks
+// this, see app/log_strings.ld
+#define LOG_TOKEN_OF_FORMAT ((uint16_t)(uintptr_t)log_token_format)
+
+#define LOG_TOKEN_CALL(level, format, ...) do { \
+    LOG_TOKEN_DEFINE(format); \
+    log_token(level, LOG_TOKEN_OF_FORMAT, LOG_TOKEN_TYPES(__VA_ARGS__), ##__VA_ARGS__); \
+} while (0)
+
+
+/*
+ * TYPES
+ */
+// A string with its length, for %.*s; see LOG_STRING()
+struct LogTokenString {
+    const char *data;
+    int length;
+};
+
+
+/*
+ * PROTOTYPES
+ */
+void log_token(uint8_t level, uint16_t token, uint32_t types, ...);
+size_t log_token_line(char *line, size_t size, const uint8_t *record, size_t length);
+void log_benchmark();
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LOG_TOKEN_HELPER_H */
@@ -8,11 +8,14 @@
  */
 #include "main.h"
 #include "log_helper.h"
+#include "log_token_helper.h"
 #include "uart_logging.h"
 #include "network_helper.h"
 #include "work.h"
 #include "application.h"
 
+#define LOG_MODULE LOG_MODULE_MAIN
+
 
 /*
  * GLOBALS
@@ -38,6 +41,7 @@ const osThreadAttr_t network_task_attributes = {
 osThreadId_t WorkTask;
 const osThreadAttr_t work_task_attributes = {
     .name = "WorkTask",
+    // Left at its old size until work_stack_free (see the "channels" rpc) has been measured on hardware
     .stack_size = configMINIMAL_STACK_SIZE + 3072, // specified in words, size 4 for Microvisor - we do a lot of work in this thread, allocate accordingly
     .priority = (osPriority_t) osPriorityNormal
 };
@@ -50,6 +54,14 @@ const osThreadAttr_t application_task_attributes = {
     .priority = (osPriority_t) osPriorityNormal
 };
 
+// This is the CMSIS/FreeRTOS thread task that outputs queued log messages
+osThreadId_t LogTask;
+const osThreadAttr_t log_task_attributes = {
+    .name = "LogTask",
+    .stack_size = configMINIMAL_STACK_SIZE, // specified in words, size 4 for Microvisor
+    .priority = (osPriority_t) osPriorityLow
+};
+
 // Buffer for Microvisor application logging
 static uint8_t log_buffer[LOGGING_BUFFER_SIZE] __attribute__((aligned(512))) = {0} ;
 
@@ -85,10 +97,16 @@ int main(void) {
     // Get the Device ID and build number and log them
     log_device_info();
 
+#if defined(LOG_BENCHMARK)
+    log_benchmark();
+#endif
+
     // Init scheduler
     osKernelInitialize();
 
     // Create the FreeRTOS thread(s)
+    LogTask      = osThreadNew(start_log_task,      NULL, &log_task_attributes);
+    assert(LogTask != NULL);
     LEDTask      = osThreadNew(start_led_task,      NULL, &led_task_attributes);
     assert(LEDTask != NULL);
     WorkTask     = osThreadNew(start_work_task,     NULL, &work_task_attributes);
@@ -20,12 +20,29 @@
 #include "network_helper.h"
 #include "log_helper.h"
 #include "config_handler.h"
+#include "rpc_handler.h"
+#include "timing_helper.h"
+#include "broker_selector.h"
+#include "link_quality_helper.h"
+#include "tunables_helper.h"
+
+#define LOG_MODULE LOG_MODULE_MQTT
+
+// Without COMMAND_CHANNEL, rpc replies leave through this connection
+_Static_assert(BUF_SEND_SIZE >= BUF_RPC_PUBLISH, "BUF_SEND_SIZE cannot hold the largest rpc reply");
 
                         
 static MvChannelHandle  mqtt_channel = 0;
 static bool             broker_connected = false;
+static bool             disconnect_requested = false;
+static bool             session_present = false;
+static volatile bool    connecting = false;
 static uint32_t         correlation_id = 0;
 static uint32_t         temp_num_items;
+static uint64_t         connect_started_microsec = 0;
+static uint32_t         bytes_published = 0;
+static uint32_t         application_publish_id = 0;
+static bool             application_publish_pending = false;
 
 // Arrays to give to the work thread
 static uint8_t in_topic[1024];
@@ -35,40 +52,129 @@ static uint8_t in_payload[1024];
  * @brief Open channel for mqtt tasks
  */
 void start_mqtt_connect() {
-    MvNetworkHandle network_handle = get_network_handle();
+    // Falls back to broker-host/broker-port if the selector has no endpoints yet
+    mvGetMicroseconds(&connect_started_microsec);
+    const struct BrokerEndpoint *endpoint = broker_selector_choose(connect_started_microsec);
+    disconnect_requested = false;
+
+    uint16_t keepalive = link_quality_keepalive();
+    server_log("mqtt keepalive %us (%s, %lu recent drops)", keepalive,
+               link_quality_reason_name(link_quality_keepalive_reason()), link_quality_recent_drops());
+
+    const struct ConfigValues *config = config_snapshot();
+    size_t host_len;
+    const uint8_t *host = config_broker_host(config, &host_len);
+    connecting = true;
+    if (!mqtt_open_connection(&mqtt_channel, TAG_CHANNEL_MQTT,
+                              CHANNEL_BUFFERS_MQTT, BUF_SEND_SIZE, BUF_RECEIVE_SIZE,
+                              config, client, client_len,
+                              endpoint ? endpoint->host : host,
+                              endpoint ? endpoint->host_len : host_len,
+                              endpoint ? endpoint->port : config_broker_port(config),
+                              MAIN_CLEAN_START)) {
+        mqtt_abandon_connect("connect could not be requested", false);
+        return;
+    }
+
+    timing_mark(CONNECT_PHASE_CHANNEL_OPENED);
+}
+
+/*
+ * @brief Has a connect been started that the broker has not yet answered?
+ */
+bool mqtt_is_connecting() {
+    return connecting;
+}
+
+/**
+ * @brief Give up on the connect in progress.
+ *
+ * Called when the connect cannot be requested, the channel closes before
+ * CONNACK, no CONNACK arrives within MQTT_CONNECT_TIMEOUT_MS, the network
+ * goes, or the broker refuses the connection.  Only the endpoint's own
+ * failures count against it: a refusal, or a timeout with the network up.
+ * Does nothing if no connect is in progress.
+ *
+ * @param reason         Why, for the log
+ * @param endpoint_fault Report the failure to the broker selector
+ */
+void mqtt_abandon_connect(const char *reason, bool endpoint_fault) {
+    if (!connecting) {
+        return;
+    }
+    connecting = false;
+
+    const struct BrokerEndpoint *endpoint = broker_selector_current();
+    if (endpoint != NULL) {
+        server_error("connect to %.*s:%u failed: %s", LOG_STRING(endpoint->host, endpoint->host_len), endpoint->port, reason);
+    } else {
+        server_error("broker connect failed: %s", reason);
+    }
+
+    if (endpoint_fault) {
+        uint64_t now = 0;
+        mvGetMicroseconds(&now);
+        broker_selector_report_failure(now);
+    }
+    pushWorkMessage(OnBrokerConnectFailed);
+}
+
+/*
+ * @brief Open an mqtt channel and ask it to connect to the broker.
+ *
+ * The channel's buffers are leased from the pool for owner until
+ * mqtt_close_connection().  Credentials are taken from config, the snapshot
+ * the caller chose host and port from.  The connect response arrives as a
+ * readable event on the channel's notification tag.
+ *
+ * @retval false if the channel could not be opened or the connect could not be requested.
+ */
+bool mqtt_open_connection(MvChannelHandle *channel, uint32_t tag,
+                          enum ChannelBufferOwner owner, uint32_t send_buffer_len, uint32_t receive_buffer_len,
+                          const struct ConfigValues *config, const uint8_t *client_id, size_t client_id_len,
+                          const uint8_t *host, size_t host_len, uint16_t port,
+                          bool clean_start) {
+    struct ChannelBuffers buffers;
+    if (!channel_buffers_acquire(owner, send_buffer_len, receive_buffer_len, &buffers)) {
+        return false;
+    }
 
     struct MvOpenChannelParams ch_params = {
         .version = 1,
         .v1 = {
             .notification_handle = work_notification_center_handle,
-            .notification_tag = TAG_CHANNEL_MQTT,
-            .network_handle = network_handle,
-            .receive_buffer = (uint8_t*)work_receive_buffer,
-            .receive_buffer_len = sizeof(work_receive_buffer),
-            .send_buffer = (uint8_t*)work_send_buffer,
-            .send_buffer_len = sizeof(work_send_buffer),
+            .notification_tag = tag,
+            .network_handle = get_network_handle(),
+            .receive_buffer = buffers.receive_buffer,
+            .receive_buffer_len = buffers.receive_buffer_len,
+            .send_buffer = buffers.send_buffer,
+            .send_buffer_len = buffers.send_buffer_len,
             .channel_type = MV_CHANNELTYPE_MQTT,
             STRING_ITEM(endpoint, "")
         }
     };
 
     enum MvStatus status;
-    if ((status = mvOpenChannel(&ch_params, &mqtt_channel)) != MV_STATUS_OKAY) {
+    if ((status = mvOpenChannel(&ch_params, channel)) != MV_STATUS_OKAY) {
         // report error
-        server_error("encountered error opening config channel: %x", status);
-        pushWorkMessage(OnBrokerConnectFailed);
-        return;
+        server_error("encountered error opening mqtt channel %lu: %x", tag, status);
+        channel_buffers_open_failed(owner, status);
+        return false;
     }
 
 #if defined(USERNAMEPASSWORD_AUTH)
+    size_t user_len, pass_len;
+    const uint8_t *user = config_username(config, &user_len);
+    const uint8_t *pass = config_password(config, &pass_len);
+
     struct MvSizedString auth_username = {
-        .data = (uint8_t *)username,
-        .length = username_len
+        .data = user,
+        .length = user_len
     };
 
     struct MvSizedString auth_password = {
-        .data = (uint8_t *)password,
-        .length = password_len
+        .data = pass,
+        .length = pass_len
     };
 
     struct MvMqttAuthentication authentication = {
@@ -89,10 +195,14 @@ void start_mqtt_connect() {
 #endif
 
 #if defined(CERTIFICATE_AUTH)
+    size_t device_cert_len, device_key_len;
+    const uint8_t *device_cert = config_cert(config, &device_cert_len);
+    const uint8_t *device_key = config_private_key(config, &device_key_len);
+
     struct MvSizedString device_certs[] = {
         {
-            .data = (uint8_t *)cert,
-            .length = cert_len
+            .data = device_cert,
+            .length = device_cert_len
         },
     };
 
@@ -102,8 +212,8 @@ void start_mqtt_connect() {
     };
 
     struct MvSizedString key = {
-        .data = (uint8_t *)private_key,
-        .length = private_key_len
+        .data = device_key,
+        .length = device_key_len
     };
 
     struct MvOwnTlsCertificateChain device_credentials = {
@@ -113,10 +223,13 @@ void start_mqtt_connect() {
 #endif
 
 #if defined(CERTIFICATE_CA)
+    size_t ca_cert_len;
+    const uint8_t *ca_cert = config_root_ca(config, &ca_cert_len);
+
     struct MvSizedString ca_certs[] = {
         {
-            .data = (uint8_t *)root_ca,
-            .length = root_ca_len
+            .data = ca_cert,
+            .length = ca_cert_len
         },
     };
 
@@ -144,13 +257,13 @@ void start_mqtt_connect() {
     struct MvMqttConnectRequest request = {
         .protocol_version = MV_MQTTPROTOCOLVERSION_V5,
         .host = {
-            .data = broker_host,
-            .length = broker_host_len
+            .data = host,
+            .length = host_len
         },
-        .port = broker_port,
+        .port = port,
         .clientid = {
-            .data = client,
-            .length = client_len 
+            .data = client_id,
+            .length = client_id_len
         },
         .authentication = authentication,
 #if defined(CERTIFICATE_CA) || defined(CERTIFICATE_AUTH)
@@ -158,27 +271,55 @@ void start_mqtt_connect() {
 #else
         .tls_credentials = NULL,
 #endif
-        .keepalive = 60,
-        .clean_start = 0,
+        .keepalive = link_quality_keepalive(),
+        .clean_start = clean_start ? 1 : 0,
         .will = NULL,
     };
 
-    status = mvMqttRequestConnect(mqtt_channel, &request);
+    server_trace("connecting to %.*s:%u", LOG_STRING(request.host.data, request.host.length), request.port);
+
+    status = mvMqttRequestConnect(*channel, &request);
     if (status != MV_STATUS_OKAY) {
         server_error("mvMqttRequestConnect returned 0x%02x\n", (int) status);
-        pushWorkMessage(OnBrokerConnectFailed);
-        return;
+        return false;
     }
+
+    return true;
 }
 
 bool is_broker_connected() {
     return broker_connected;
 }
 
-void start_subscriptions() {
+/*
+ * @brief Did the broker resume an existing session (and its subscriptions) on the last connect?
+ */
+bool is_session_present() {
+    return session_present;
+}
+
+/*
+ * @brief Subscribe a channel to the command topic, and the rpc and tunables topics if enabled.
+ *
+ * @retval false if the subscribe could not be requested.
+ */
+bool mqtt_request_subscriptions(MvChannelHandle channel) {
     char topic_str[128];
     sprintf(topic_str, "command/device/%.*s", client_len, client);
 
+#if defined(SUBSCRIBE_RPC)
+    char rpc_topic_str[128];
+    sprintf(rpc_topic_str, RPC_TOPIC_PREFIX, client_len, client);
+    rpc_set_topic_prefix(rpc_topic_str);
+    strcat(rpc_topic_str, "+");
+#endif
+
+#if defined(SUBSCRIBE_TUNABLES)
+    char tunables_topic_str[BUF_TUNABLES_TOPIC];
+    snprintf(tunables_topic_str, sizeof(tunables_topic_str), TUNABLES_TOPIC, client_len, client);
+    tunables_set_topic(tunables_topic_str);
+#endif
+
     enum MvStatus status;
 
     const struct MvMqttSubscription subscriptions[] = {
@@ -187,11 +328,36 @@ void start_subscriptions() {
                 .data = (uint8_t *)topic_str,
                 .length = strlen(topic_str)
             },
-            .desired_qos = 0,
+            .desired_qos = COMMAND_SUBSCRIPTION_QOS,
             .nl = 0,
             .rap = 0,
             .rh = 0,
         },
+#if defined(SUBSCRIBE_RPC)
+        {
+            .topic = {
+                .data = (uint8_t *)rpc_topic_str,
+                .length = strlen(rpc_topic_str)
+            },
+            .desired_qos = COMMAND_SUBSCRIPTION_QOS,
+            .nl = 0,
+            .rap = 0,
+            .rh = 0,
+        },
+#endif
+#if defined(SUBSCRIBE_TUNABLES)
+        {
+            // rh 0: the broker sends the retained settings as soon as this is made
+            .topic = {
+                .data = (uint8_t *)tunables_topic_str,
+                .length = strlen(tunables_topic_str)
+            },
+            .desired_qos = COMMAND_SUBSCRIPTION_QOS,
+            .nl = 0,
+            .rap = 0,
+            .rh = 0,
+        },
+#endif
     };
     temp_num_items = sizeof(subscriptions)/sizeof(struct MvMqttSubscription);
 
@@ -201,11 +367,18 @@ void start_subscriptions() {
         .num_subscriptions = temp_num_items,
     };
 
-    status = mvMqttRequestSubscribe(mqtt_channel, &request);
+    status = mvMqttRequestSubscribe(channel, &request);
     if (status != MV_STATUS_OKAY) {
         server_error("mvMqttRequestSubscribe returned 0x%02x\n", (int) status);
+        return false;
+    }
+
+    return true;
+}
+
+void start_subscriptions() {
+    if (!mqtt_request_subscriptions(mqtt_channel)) {
         pushWorkMessage(OnBrokerSubscriptionRequestFailed);
-        return;
     }
 }
 
@@ -213,13 +386,35 @@ void end_subscriptions() {
     char topic_str[128];
     sprintf(topic_str, "command/device/%.*s", client_len, client);
 
+#if defined(SUBSCRIBE_RPC)
+    char rpc_topic_str[128];
+    sprintf(rpc_topic_str, RPC_TOPIC_PREFIX "+", client_len, client);
+#endif
+
+#if defined(SUBSCRIBE_TUNABLES)
+    char tunables_topic_str[BUF_TUNABLES_TOPIC];
+    snprintf(tunables_topic_str, sizeof(tunables_topic_str), TUNABLES_TOPIC, client_len, client);
+#endif
+
     enum MvStatus status;
 
     const struct MvSizedString topics[] = {
         {
             .data = (const uint8_t *)topic_str,
             .length = (uint16_t)strlen(topic_str),
-        }
+        },
+#if defined(SUBSCRIBE_RPC)
+        {
+            .data = (const uint8_t *)rpc_topic_str,
+            .length = (uint16_t)strlen(rpc_topic_str),
+        },
+#endif
+#if defined(SUBSCRIBE_TUNABLES)
+        {
+            .data = (const uint8_t *)tunables_topic_str,
+            .length = (uint16_t)strlen(tunables_topic_str),
+        },
+#endif
     };
     temp_num_items = sizeof(topics)/sizeof(struct MvSizedString);
 
@@ -241,34 +436,82 @@ void publish_message(const char* payload) {
     char topic_str[128];
     sprintf(topic_str, "sensor/device/%.*s", client_len, client); // For AWS, requires policy to allow publish access to "arn:aws:iot:<<region>>:<<account>>:topic/sensor/device/<<DEVICE_SID>>"
 
+    // mqtt_request_publish() takes the next correlation id
+    uint32_t publish_id = correlation_id;
+    if (mqtt_publish((const uint8_t *)topic_str, strlen(topic_str), (const uint8_t *)payload, strlen(payload))) {
+        application_publish_id = publish_id;
+        application_publish_pending = true;
+        server_log("published to %s", topic_str);
+    }
+}
+
+/*
+ * @brief Publish a device metrics report to METRICS_TOPIC/<name>.
+ */
+void publish_metrics(const char *name, const char *payload) {
+#if defined(PUBLISH_METRICS)
+    char topic_str[128];
+    int length = snprintf(topic_str, sizeof(topic_str), METRICS_TOPIC "/%s", client_len, client, name);
+
+    mqtt_publish((const uint8_t *)topic_str, length, (const uint8_t *)payload, strlen(payload));
+#endif
+}
+
+/*
+ * @brief Publish a payload to an arbitrary topic.
+ *
+ * @retval true if the publish request was accepted.
+ */
+bool mqtt_publish(const uint8_t *topic, size_t topic_len, const uint8_t *payload, size_t payload_len) {
+    enum MvStatus status = mqtt_request_publish(mqtt_channel, topic, topic_len, payload, payload_len);
+    if (status != MV_STATUS_OKAY) {
+        if (status == MV_STATUS_RATELIMITED) {
+            pushWorkMessage(OnBrokerPublishRateLimited);
+        } else {
+            pushWorkMessage(OnBrokerPublishFailed);
+        }
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * @brief Request a QoS 0 publish on a channel.
+ */
+enum MvStatus mqtt_request_publish(MvChannelHandle channel, const uint8_t *topic, size_t topic_len,
+                                   const uint8_t *payload, size_t payload_len) {
     enum MvStatus status;
 
     const struct MvMqttPublishRequest request = {
         .correlation_id = correlation_id++,
         .topic = {
-            .data = (uint8_t *)topic_str,
-            .length = strlen(topic_str)
+            .data = topic,
+            .length = topic_len
         },
         .payload = {
-            .data = (uint8_t *)payload,
-            .length = strlen(payload)
+            .data = payload,
+            .length = payload_len
         },
         .desired_qos = 0,
         .retain = 0
     };
 
-    status = mvMqttRequestPublish(mqtt_channel, &request);
+    status = mvMqttRequestPublish(channel, &request);
     if (status != MV_STATUS_OKAY) {
         server_error("mvMqttRequestPublish returned 0x%02x\n", (int) status);
-        if (status == MV_STATUS_RATELIMITED) {
-            pushWorkMessage(OnBrokerPublishRateLimited);
-        } else {
-            pushWorkMessage(OnBrokerPublishFailed);
-        }
-        return;
+        return status;
     }
 
-    server_log("published to %s", topic_str);
+    bytes_published += topic_len + payload_len;
+    return status;
+}
+
+/*
+ * @brief Running total of topic and payload bytes handed to the broker.
+ */
+uint32_t mqtt_bytes_published() {
+    return bytes_published;
 }
 
 void mqtt_handle_readable_event() {
@@ -307,35 +550,65 @@ void mqtt_handle_readable_event() {
 }
 
 void mqtt_handle_connect_response_event() {
+    if (!mqtt_read_connect_response(mqtt_channel, &session_present)) {
+        mqtt_abandon_connect("connect refused", true);
+        return;
+    }
+
+    connecting = false;
+    server_log("mqtt broker connection successful (%s session)", session_present ? "resumed" : "new");
+    broker_connected = true;
+
+    uint64_t now = 0;
+    mvGetMicroseconds(&now);
+    broker_selector_report_success((uint32_t)(now - connect_started_microsec));
+    link_quality_broker_up();
+    timing_mark(CONNECT_PHASE_BROKER_CONNECTED);
+    pushWorkMessage(OnBrokerConnected);
+}
+
+/*
+ * @brief Read a channel's connect response.
+ *
+ * @param session_present Set if the broker resumed an existing session
+ *
+ * @retval true if the broker accepted the connection.
+ */
+bool mqtt_read_connect_response(MvChannelHandle channel, bool *session_present) {
     struct MvMqttConnectResponse response = {};
 
-    enum MvStatus status = mvMqttReadConnectResponse(mqtt_channel, &response);
+    enum MvStatus status = mvMqttReadConnectResponse(channel, &response);
     if (status != MV_STATUS_OKAY) {
         server_error("mvMqttReadConnectResponse returned 0x%02x\n", (int) status);
-        pushWorkMessage(OnBrokerConnectFailed);
-        return;
+        return false;
     }
 
     if (response.request_state != MV_MQTTREQUESTSTATE_REQUESTCOMPLETED) {
         server_error("connect error: response.request_state = %d, reason_code: 0x%02x", response.request_state, (int) response.reason_code);
         // not the status we expect
-        pushWorkMessage(OnBrokerConnectFailed);
-        return;
+        return false;
     }
 
     if (response.reason_code != 0x00) {
         server_error("connect error: response.reason_code = 0x%02x", (int) response.reason_code);
         // not the status we expect
-        pushWorkMessage(OnBrokerConnectFailed);
-        return;
+        return false;
     }
 
-    server_log("mqtt broker connection successful");
-    broker_connected = true;
-    pushWorkMessage(OnBrokerConnected);
+    *session_present = (response.session_present != 0);
+    return true;
 }
 
 void mqtt_handle_subscribe_response_event() {
+    pushWorkMessage(mqtt_read_subscribe_response(mqtt_channel) ? OnBrokerSubscribeSucceeded : OnBrokerSubscribeFailed);
+}
+
+/*
+ * @brief Read the response to mqtt_request_subscriptions().
+ *
+ * @retval true if every subscription was granted.
+ */
+bool mqtt_read_subscribe_response(MvChannelHandle channel) {
     enum MvMqttRequestState request_state;
     uint32_t correlation_id;
     uint32_t reason_codes[temp_num_items];
@@ -348,36 +621,32 @@ void mqtt_handle_subscribe_response_event() {
         .reason_codes_len = &reason_codes_len
     };
 
-    enum MvStatus status = mvMqttReadSubscribeResponse(mqtt_channel, &response);
+    enum MvStatus status = mvMqttReadSubscribeResponse(channel, &response);
     if (status != MV_STATUS_OKAY) {
         server_error("mvMqttReadSubscribeResponse returned 0x%02x\n", (int) status);
-        pushWorkMessage(OnBrokerSubscribeFailed);
-        return;
+        return false;
     }
 
     if (request_state != MV_MQTTREQUESTSTATE_REQUESTCOMPLETED) {
         // not the request_state we expect
         server_error("subscribe response.request_state = %d", request_state);
-        pushWorkMessage(OnBrokerSubscribeFailed);
-        return;
+        return false;
     }
 
     if (reason_codes_len != temp_num_items) {
         server_error("expected %d subscribe reason_codes but received %d", temp_num_items, reason_codes_len);
-        pushWorkMessage(OnBrokerSubscribeFailed);
-        return;
+        return false;
     }
 
     for (uint32_t ndx=0; ndx<temp_num_items; ndx++) {
         if (reason_codes[ndx] != 0x00) {
             // not the status we expect
             server_error("subscribe reason_codes[%d] = 0x%02x", ndx, (int) reason_codes[ndx]);
-            pushWorkMessage(OnBrokerSubscribeFailed);
-            return;
+            return false;
         }
     }
 
-    pushWorkMessage(OnBrokerSubscribeSucceeded);
+    return true;
 }
 
 void mqtt_handle_unsubscribe_response_event() {
@@ -425,37 +694,74 @@ void mqtt_handle_unsubscribe_response_event() {
     pushWorkMessage(OnBrokerUnsubscribeSucceeded);
 }
 
+/*
+ * @brief Read the main channel's publish response, telling the application's
+ *        publishes apart from metrics reports and rpc replies.
+ */
 void mqtt_handle_publish_response_event() {
+    uint32_t publish_id = 0;
+    if (!mqtt_read_publish_response(mqtt_channel, &publish_id)) {
+        pushWorkMessage(OnBrokerPublishFailed);
+        return;
+    }
+
+    if (application_publish_pending && publish_id == application_publish_id) {
+        application_publish_pending = false;
+        pushWorkMessage(OnBrokerApplicationPublishSucceeded);
+    } else {
+        pushWorkMessage(OnBrokerPublishSucceeded);
+    }
+}
+
+/*
+ * @brief Read a channel's publish response.
+ *
+ * @param publish_id Set to the correlation id of the publish, if not NULL
+ *
+ * @retval true if the broker accepted the publish.
+ */
+bool mqtt_read_publish_response(MvChannelHandle channel, uint32_t *publish_id) {
     struct MvMqttPublishResponse response = { 0 };
 
-    enum MvStatus status = mvMqttReadPublishResponse(mqtt_channel, &response);
+    enum MvStatus status = mvMqttReadPublishResponse(channel, &response);
     if (status != MV_STATUS_OKAY) {
         server_error("mvMqttReadPublishResponse returned 0x%02x\n", (int) status);
-        pushWorkMessage(OnBrokerPublishFailed);
-        return;
+        return false;
+    }
+
+    if (publish_id != NULL) {
+        *publish_id = response.correlation_id;
     }
 
     if (response.request_state != MV_MQTTREQUESTSTATE_REQUESTCOMPLETED) {
         // not the request_state we expect
         server_error("publish response.request_state = %d", response.request_state);
-        pushWorkMessage(OnBrokerPublishFailed);
-        return;
+        return false;
     }
 
     if (response.reason_code != 0x00) {
         // not the status we expect
         server_error("publish reason_code = 0x%02x", (int) response.reason_code);
-        pushWorkMessage(OnBrokerPublishFailed);
-        return;
+        return false;
     }
 
-    pushWorkMessage(OnBrokerPublishSucceeded);
+    return true;
 }
 
 bool mqtt_get_received_message_data(uint32_t *correlation_id,
                                     uint8_t **topic, uint32_t *topic_len,
                                     uint8_t **payload, uint32_t *payload_len,
                                     uint32_t *qos, uint8_t *retain) {
+    return mqtt_receive_message(mqtt_channel, correlation_id, topic, topic_len, payload, payload_len, qos, retain);
+}
+
+/*
+ * @brief Read a received message from a channel into the shared inbound topic and payload buffers.
+ */
+bool mqtt_receive_message(MvChannelHandle channel, uint32_t *correlation_id,
+                          uint8_t **topic, uint32_t *topic_len,
+                          uint8_t **payload, uint32_t *payload_len,
+                          uint32_t *qos, uint8_t *retain) {
     struct MvMqttMessage message = {
         .correlation_id = correlation_id,
         .topic = {
@@ -472,7 +778,7 @@ bool mqtt_get_received_message_data(uint32_t *correlation_id,
         .retain = retain
     };
 
-    enum MvStatus status = mvMqttReceiveMessage(mqtt_channel, &message);
+    enum MvStatus status = mvMqttReceiveMessage(channel, &message);
     if (status != MV_STATUS_OKAY) {
         server_error("mvMqttReceiveMessage returned 0x%02x\n", (int) status);
         return false;
@@ -485,6 +791,13 @@ bool mqtt_get_received_message_data(uint32_t *correlation_id,
 }
 
 bool mqtt_handle_lost_message_data() {
+    return mqtt_read_lost_message(mqtt_channel);
+}
+
+/*
+ * @brief Read and report details of a message a channel could not deliver.
+ */
+bool mqtt_read_lost_message(MvChannelHandle channel) {
     enum MvMqttLostMessageReason reason;
     uint32_t topic_len;
     uint32_t message_len;
@@ -498,43 +811,68 @@ bool mqtt_handle_lost_message_data() {
         .message_len = &message_len
     };
 
-    enum MvStatus status = mvMqttReceiveLostMessageInfo(mqtt_channel, &lostMessage);
+    enum MvStatus status = mvMqttReceiveLostMessageInfo(channel, &lostMessage);
     if (status != MV_STATUS_OKAY) {
         server_error("mvMqttReceiveLostMessageInfo returned 0x%02x\n", (int) status);
         return false;
     }
 
-    server_error("Message with topic %.*s was dropped. MQTT buffer should be at least %d bytes long to receive it.\n", (int) topic_len, in_topic, (int) message_len);
+    server_error("Message with topic %.*s was dropped. MQTT buffer should be at least %d bytes long to receive it.\n", LOG_STRING(in_topic, topic_len), (int) message_len);
     return true;
 }
 
 void mqtt_acknowledge_message(uint32_t correlation_id) {
-    enum MvStatus status = mvMqttAcknowledgeMessage(mqtt_channel, correlation_id);
+    if (!mqtt_ack_message(mqtt_channel, correlation_id)) {
+        pushWorkMessage(OnBrokerMessageAcknowledgeFailed);
+    }
+}
+
+/*
+ * @brief Acknowledge a received message on a channel.
+ */
+bool mqtt_ack_message(MvChannelHandle channel, uint32_t correlation_id) {
+    enum MvStatus status = mvMqttAcknowledgeMessage(channel, correlation_id);
     if (status != MV_STATUS_OKAY) {
         server_error("mvMqttAcknowledgeMessage returned 0x%02x\n", (int) status);
-        pushWorkMessage(OnBrokerMessageAcknowledgeFailed);
-        return;
+        return false;
     }
+
+    return true;
 }
 
 void teardown_mqtt_connect() {
+    broker_connected = false;
+    connecting = false;
+    uint32_t disconnect_code = mqtt_close_connection(&mqtt_channel, CHANNEL_BUFFERS_MQTT);
+    link_quality_broker_down(disconnect_code, disconnect_requested);
+
+    pushWorkMessage(OnBrokerDisconnected);
+}
+
+/*
+ * @brief Read a channel's disconnect response, if any, and close it.
+ *
+ * @retval The disconnect_code, or LINK_QUALITY_CODE_UNAVAILABLE if there was no response to read.
+ */
+uint32_t mqtt_close_connection(MvChannelHandle *channel, enum ChannelBufferOwner owner) {
     struct MvMqttDisconnectResponse response = { 0 };
 
-    enum MvStatus status = mvMqttReadDisconnectResponse(mqtt_channel, &response);
+    enum MvStatus status = mvMqttReadDisconnectResponse(*channel, &response);
     if (status != MV_STATUS_OKAY) {
+        response.disconnect_code = LINK_QUALITY_CODE_UNAVAILABLE;
         server_error("mvMqttReadDisconnectResponse returned 0x%02x", (int) status);
         server_log("lost mqtt connection (disconnect_code not available), closing mqtt channel", response.disconnect_code);
     } else {
         server_log("lost mqtt connection (disconnect_code %04x), closing mqtt channel", response.disconnect_code); // Will contain the disconnect_code if using MQTT v5.  0x8E here will indicate another client with the same identity has taken over the session
     }
 
-    broker_connected = false;
-    mvCloseChannel(&mqtt_channel);
-
-    pushWorkMessage(OnBrokerDisconnected);
+    mvCloseChannel(channel);
+    channel_buffers_release(owner);
+    return response.disconnect_code;
 }
 
-void mqtt_disconnect() {
+static void request_disconnect(bool requested) {
+    disconnect_requested = requested;
     enum MvStatus status = mvMqttRequestDisconnect(mqtt_channel);
     if (status != MV_STATUS_OKAY) {
         server_error("mvMqttRequestDisconnect returned 0x%02x\n", (int) status);
@@ -542,3 +880,26 @@ void mqtt_disconnect() {
         return;
     }
 }
+
+/*
+ * @brief Disconnect on purpose, eg. to sleep or to pick up new config.
+ */
+void mqtt_disconnect() {
+    request_disconnect(true);
+}
+
+/*
+ * @brief Disconnect because the connection failed (a subscribe, publish or ack
+ *        went wrong); counted as a drop rather than a requested disconnect.
+ */
+void mqtt_disconnect_on_error() {
+    request_disconnect(false);
+}
+
+/*
+ * @brief Close the channel on purpose without waiting for the broker.
+ */
+void mqtt_disconnect_now() {
+    disconnect_requested = true;
+    teardown_mqtt_connect();
+}
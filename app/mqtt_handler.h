@@ -15,14 +15,62 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <stdbool.h>
 
+// Microvisor includes
+#include "mv_syscalls.h"
+
+#include "channel_buffer_helper.h"
+
+struct ConfigValues;
+
 
 /*
  * DEFINES
  */
 #define TAG_CHANNEL_MQTT 101
 
+// A connect the broker has not answered by then counts as a failed one
+#define MQTT_CONNECT_TIMEOUT_MS (30*1000)
+
+// Defining COMMAND_CHANNEL moves the command and rpc subscriptions onto a
+// second mqtt connection with its own buffers, so inbound commands are not
+// queued behind telemetry (see command_handler.h).  The broker must accept a
+// second client id, the device's with COMMAND_CLIENT_SUFFIX appended.
+//#define COMMAND_CHANNEL
+#define TAG_CHANNEL_MQTT_COMMAND 102
+#define COMMAND_CLIENT_SUFFIX "-cmd"
+
+// The main connection only keeps a broker session while it carries our subscriptions
+#if defined(COMMAND_CHANNEL)
+#define MAIN_CLEAN_START true
+#else
+#define MAIN_CLEAN_START false
+#endif
+
+// At QoS 1, inbound messages are deduplicated before dispatch (see
+// dedup_helper.h), so a redelivery does not repeat an actuation; senders must
+// then give repeated commands distinct msg_id values
+#define COMMAND_SUBSCRIPTION_QOS 0
+
+// Defining SUBSCRIBE_RPC subscribes to RPC_TOPIC_PREFIX+, where requests for
+// rpc_handler arrive as RPC_TOPIC_PREFIX<method>.  The broker's policy must
+// allow the subscription and each request's reply topic; see README-AWS.md
+//#define SUBSCRIBE_RPC
+#define RPC_TOPIC_PREFIX "rpc/device/%.*s/"
+
+// Defining PUBLISH_METRICS publishes device metrics to METRICS_TOPIC/<name>.
+// The broker's policy must allow the topic; see README-AWS.md
+//#define PUBLISH_METRICS
+#define METRICS_TOPIC "metrics/device/%.*s"
+
+// Defining SUBSCRIBE_TUNABLES takes sampling, batching and logging settings
+// from the message retained on TUNABLES_TOPIC, applied as they change (see
+// tunables_helper.h).  The broker must support retained messages.
+//#define SUBSCRIBE_TUNABLES
+#define TUNABLES_TOPIC "config/device/%.*s"
+
 
 #ifdef __cplusplus
 extern "C" {
@@ -32,10 +80,16 @@ extern "C" {
  * PROTOTYPES
  */
 void start_mqtt_connect();
+bool mqtt_is_connecting();
+void mqtt_abandon_connect(const char *reason, bool endpoint_fault);
 bool is_broker_connected();
+bool is_session_present();
 void start_subscriptions();
 void end_subscriptions();
 void publish_message(const char *payload);
+bool mqtt_publish(const uint8_t *topic, size_t topic_len, const uint8_t *payload, size_t payload_len);
+void publish_metrics(const char *name, const char *payload);
+uint32_t mqtt_bytes_published();
 void teardown_mqtt_connect();
 
 void mqtt_handle_readable_event();
@@ -44,6 +98,8 @@ void mqtt_handle_subscribe_response_event();
 void mqtt_handle_unsubscribe_response_event();
 void mqtt_handle_publish_response_event();
 void mqtt_disconnect();
+void mqtt_disconnect_on_error();
+void mqtt_disconnect_now();
 bool mqtt_get_received_message_data(uint32_t *correlation_id,
                                     uint8_t **topic, uint32_t *topic_len,
                                     uint8_t **payload, uint32_t *payload_len,
@@ -51,6 +107,26 @@ bool mqtt_get_received_message_data(uint32_t *correlation_id,
 bool mqtt_handle_lost_message_data();
 void mqtt_acknowledge_message(uint32_t correlation_id);
 
+// Shared by every mqtt connection
+bool mqtt_open_connection(MvChannelHandle *channel, uint32_t tag,
+                          enum ChannelBufferOwner owner, uint32_t send_buffer_len, uint32_t receive_buffer_len,
+                          const struct ConfigValues *config, const uint8_t *client_id, size_t client_id_len,
+                          const uint8_t *host, size_t host_len, uint16_t port,
+                          bool clean_start);
+bool mqtt_read_connect_response(MvChannelHandle channel, bool *session_present);
+bool mqtt_request_subscriptions(MvChannelHandle channel);
+bool mqtt_read_subscribe_response(MvChannelHandle channel);
+enum MvStatus mqtt_request_publish(MvChannelHandle channel, const uint8_t *topic, size_t topic_len,
+                                   const uint8_t *payload, size_t payload_len);
+bool mqtt_read_publish_response(MvChannelHandle channel, uint32_t *publish_id);
+bool mqtt_receive_message(MvChannelHandle channel, uint32_t *correlation_id,
+                          uint8_t **topic, uint32_t *topic_len,
+                          uint8_t **payload, uint32_t *payload_len,
+                          uint32_t *qos, uint8_t *retain);
+bool mqtt_read_lost_message(MvChannelHandle channel);
+bool mqtt_ack_message(MvChannelHandle channel, uint32_t correlation_id);
+uint32_t mqtt_close_connection(MvChannelHandle *channel, enum ChannelBufferOwner owner);
+
 #ifdef __cplusplus
 }
 #endif
@@ -15,10 +15,13 @@
 
 // Microvisor includes
 #include "stm32u5xx_hal.h"
+#include "cmsis_os.h"
 
 #include "log_helper.h"
 #include "work.h"
 
+#define LOG_MODULE LOG_MODULE_NETWORK
+
 
 /*
  * CONFIGURTATION
@@ -30,6 +33,10 @@
 
 #define USER_TAG_REQUEST_NETWORK 1
 
+// Thread flags used to wake the network task
+#define NETWORK_FLAG_STATUS_CHANGED 0x01
+#define NETWORK_FLAG_WANT_CHANGED   0x02
+
 
 /*
  * NETWORK HANDLES
@@ -45,6 +52,11 @@ static volatile bool                  solicited_change = false;
 volatile bool                         want_network = false;
 static volatile bool                  _have_network = false;
 
+static osThreadId_t                   network_task_id = NULL;
+// Low 32 bits of the Microvisor timestamp of the latest status change event
+static volatile uint32_t              status_event_microsec = 0;
+static struct NetworkStats            stats = {0};
+
 
 /*
  * FORWARD DECLARATIONS
@@ -59,61 +71,84 @@ static bool have_network();
 /**
  * @brief Function implementing the Network task thread.
  *
+ * The task sleeps until the network notification ISR or set_want_network()
+ * wakes it, with a slow poll as a fallback in case an event is missed.
+ *
  * @param  argument: Not used.
  */
 void start_network_task(void *argument) {
-    uint32_t last_tick = 0;
-
+    network_task_id = osThreadGetId();
     want_network = true;
 
+    // The network is usually already up by the time we start, which raises no
+    // event, so always check once before waiting
+    spin_network();
+
     // The task's main loop
     while (1) {
-        // Get the ms timer value
-        uint32_t tick = HAL_GetTick();
-        if (tick - last_tick > NETWORK_TASK_PAUSE_MS) {
-            last_tick = tick;
-
-            spin_network();
+        // Poll a little faster while waiting on a network we have asked for
+        uint32_t timeout = (want_network && !have_network()) ? NETWORK_CONNECTING_POLL_MS : NETWORK_FALLBACK_POLL_MS;
+        uint32_t flags = osThreadFlagsWait(NETWORK_FLAG_STATUS_CHANGED | NETWORK_FLAG_WANT_CHANGED,
+                                           osFlagsWaitAny, timeout);
+        if (flags & osFlagsError) {
+            // Timed out: nothing has woken us for a while
+            stats.poll_wakeups++;
+        } else {
+            stats.event_wakeups++;
         }
 
-        // End of cycle delay
-        osDelay(have_network() ? 1000 : 100);
+        spin_network();
     }
 }
 
 
 /**
- * @brief Call regularly from host application to allow for handling of network status.
+ * @brief Check the network status, report any change to the work task and
+ *        request or release the network as required.
  */
 static void spin_network() {
     enum MvNetworkStatus network_status;
 
+    // Act on want_network first so a fresh handle is checked straight away
+    if (want_network) {
+        if (network_handle == 0) {
+            configure_network();
+        }
+    } else if (network_handle != 0) {
+        release_network();
+    }
+
+    // Read the event flag first so a change that arrives while we check is
+    // seen on the next pass rather than lost
+    bool from_event = network_status_changed;
+    network_status_changed = false;
+
     if (mvGetNetworkStatus(network_handle, &network_status) == MV_STATUS_OKAY) {
         bool new_have_network = (network_status == MV_NETWORKSTATUS_CONNECTED);
         if (new_have_network != _have_network) {
-            server_log("network: received status changed: %s", (new_have_network ? "connected" : "connecting"));
+            if (from_event) {
+                uint64_t now = 0;
+                mvGetMicroseconds(&now);
+                uint32_t latency = (uint32_t)now - status_event_microsec;
+
+                stats.event_changes++;
+                stats.last_detect_us = latency;
+                if (latency > stats.max_detect_us) {
+                    stats.max_detect_us = latency;
+                }
+            } else {
+                stats.poll_changes++;
+            }
+
+            server_log("network: status changed: %s (%s, %s)", (new_have_network ? "connected" : "connecting"),
+                       (from_event ? "event" : "poll"), (solicited_change ? "app requested" : "system"));
 
             pushWorkMessage(new_have_network ? OnNetworkConnected : OnNetworkDisconnected);
         }
         _have_network = new_have_network;
     }
 
-    // The interrupt is only triggered when status changes after boot up, since network is likely
-    // connected by Microvisor by the time the application starts, this won't get fired until we
-    // lose connection in most cases.
-    if (network_status_changed) {
-        server_log("network: received status changed event: %s (%s)", (_have_network ? "connected" : "connecting"), (solicited_change ? "app requested" : "system"));
-        network_status_changed = false;
-        solicited_change = false;
-    }
-
-    if (want_network && !have_network()) {
-        if (network_handle == 0) {
-            configure_network();
-        }
-    } else if (!want_network && network_handle != 0) {
-        release_network();
-    }
+    solicited_change = false;
 }
 
 
@@ -125,6 +160,25 @@ static inline bool have_network() {
 }
 
 
+/**
+ * @brief Ask for the network to be brought up or released, waking the network task to act on it.
+ */
+void set_want_network(bool want) {
+    want_network = want;
+    if (network_task_id != NULL) {
+        osThreadFlagsSet(network_task_id, NETWORK_FLAG_WANT_CHANGED);
+    }
+}
+
+
+/**
+ * @brief Counters for how network status changes have been detected.
+ */
+void network_get_stats(struct NetworkStats *out) {
+    *out = stats;
+}
+
+
 /*
  * @brief Returns the current network handle if one is available.
  */
@@ -145,6 +199,13 @@ void release_network() {
 
     enum MvStatus status = mvReleaseNetwork(&network_handle);
     assert(status == MV_STATUS_OKAY);
+
+    // Without a handle we can no longer use the network, whether or not
+    // Microvisor keeps it up for itself
+    if (_have_network) {
+        _have_network = false;
+        pushWorkMessage(OnNetworkDisconnected);
+    }
 }
 
 
@@ -211,8 +272,13 @@ static void configure_notification_center() {
 void TIM1_BRK_IRQHandler(void) {
     volatile struct MvNotification *notification = &notification_buffer[current_notification_index];
     if (notification->event_type == MV_EVENTTYPE_NETWORKSTATUSCHANGED) {
+        status_event_microsec = (uint32_t)notification->microseconds;
         network_status_changed = true;
         solicited_change = (notification->tag == USER_TAG_REQUEST_NETWORK);
+
+        if (network_task_id != NULL) {
+            osThreadFlagsSet(network_task_id, NETWORK_FLAG_STATUS_CHANGED);
+        }
     }
 
     // Point to the next record to be written
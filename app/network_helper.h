@@ -24,6 +24,7 @@
 /*
  * INCLUDES
  */
+#include <stdint.h>
 #include <stdbool.h>
 #include "mv_syscalls.h"
 
@@ -33,11 +34,26 @@ extern "C" {
 #endif
 
 
+/*
+ * TYPES
+ */
+struct NetworkStats {
+    uint32_t event_wakeups;     // task woken by the notification ISR or set_want_network()
+    uint32_t poll_wakeups;      // task woken by the fallback poll
+    uint32_t event_changes;     // status changes picked up from an event
+    uint32_t poll_changes;      // status changes only the fallback poll noticed
+    uint32_t last_detect_us;    // Microvisor event to work task message, last change
+    uint32_t max_detect_us;
+};
+
+
 /*
  * PROTOTYPES
  */
 void start_network_task(void *argument);
 MvNetworkHandle get_network_handle();
+void set_want_network(bool want);
+void network_get_stats(struct NetworkStats *out);
 
 
 /*
@@ -49,7 +65,8 @@ extern volatile bool want_network;
 /*
  * DEFINES
  */
-#define     NETWORK_TASK_PAUSE_MS       500
+#define     NETWORK_FALLBACK_POLL_MS    30000
+#define     NETWORK_CONNECTING_POLL_MS  5000
 
 
 #ifdef __cplusplus
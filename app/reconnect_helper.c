@@ -0,0 +1,142 @@
+/**
+ *
+ * Microvisor Reconnect Helper
+ * Version 1.0.0
+ * Copyright © 2023, Twilio
+ * Licence: Apache 2.0
+ *
+ */
+
+#include "reconnect_helper.h"
+#include <string.h>
+
+// Microvisor includes
+#include "mv_syscalls.h"
+
+
+static uint32_t random_state = 0;
+
+
+/**
+ * @brief xorshift32, seeded per device so devices do not share a jitter sequence.
+ */
+static uint32_t next_random() {
+    if (random_state == 0) {
+        uint8_t device_id[35] = {0};
+        mvGetDeviceId(device_id, 34);
+
+        uint64_t now = 0;
+        mvGetMicroseconds(&now);
+
+        random_state = 0x811c9dc5 ^ (uint32_t)now;
+        for (uint32_t ndx = 0; ndx < sizeof(device_id); ndx++) {
+            random_state = (random_state ^ device_id[ndx]) * 0x01000193;
+        }
+        if (random_state == 0) {
+            random_state = 1;
+        }
+    }
+
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+    return random_state;
+}
+
+
+static void timer_callback(void *argument) {
+    struct ReconnectScheduler *scheduler = (struct ReconnectScheduler *)argument;
+    pushWorkMessage(scheduler->message);
+}
+
+
+/**
+ * @brief Set up a scheduler.
+ *
+ * @param scheduler Scheduler to initialise
+ * @param message   Work message pushed when a retry is due
+ * @param base_ms   Backoff ceiling for the first retry
+ * @param cap_ms    Maximum backoff ceiling
+ */
+void reconnect_init(struct ReconnectScheduler *scheduler, enum WorkMessageType message,
+                    uint32_t base_ms, uint32_t cap_ms) {
+    memset(scheduler, 0, sizeof(struct ReconnectScheduler));
+    scheduler->message = message;
+    scheduler->base_ms = base_ms;
+    scheduler->cap_ms = cap_ms;
+
+    scheduler->timer = osTimerNew(timer_callback, osTimerOnce, scheduler, NULL);
+    assert(scheduler->timer != NULL);
+}
+
+
+/**
+ * @brief Schedule the next retry after a failure or disconnection.
+ *
+ * @retval The chosen delay in milliseconds.
+ */
+uint32_t reconnect_schedule(struct ReconnectScheduler *scheduler) {
+    uint64_t now = 0;
+    mvGetMicroseconds(&now);
+
+    if (scheduler->outage_started_microsec == 0) {
+        // First failure since we were last connected; a connection that was
+        // stable for long enough starts the backoff from scratch
+        if (scheduler->connected_microsec != 0
+            && now - scheduler->connected_microsec >= (uint64_t)RECONNECT_STABLE_MS * 1000) {
+            scheduler->attempt = 0;
+        }
+        scheduler->outage_started_microsec = now;
+    }
+
+    uint32_t shift = scheduler->attempt < RECONNECT_MAX_SHIFT ? scheduler->attempt : RECONNECT_MAX_SHIFT;
+    uint64_t ceiling = (uint64_t)scheduler->base_ms << shift;
+    if (ceiling > scheduler->cap_ms) {
+        ceiling = scheduler->cap_ms;
+    }
+
+    // Full jitter: anywhere between now and the ceiling, but never zero so the
+    // timer always goes through the RTOS rather than firing inline
+    uint32_t delay = (uint32_t)(next_random() % (ceiling + 1));
+    if (delay == 0) {
+        delay = 1;
+    }
+
+    scheduler->attempt++;
+    scheduler->stats.attempts++;
+    scheduler->stats.last_backoff_ms = delay;
+
+    osTimerStart(scheduler->timer, delay);
+    return delay;
+}
+
+
+/**
+ * @brief Note a successful connection, ending any outage in progress.
+ */
+void reconnect_succeeded(struct ReconnectScheduler *scheduler) {
+    uint64_t now = 0;
+    mvGetMicroseconds(&now);
+
+    if (scheduler->outage_started_microsec != 0) {
+        uint32_t elapsed = (uint32_t)((now - scheduler->outage_started_microsec) / 1000);
+        scheduler->stats.reconnects++;
+        scheduler->stats.last_time_to_reconnect_ms = elapsed;
+        if (elapsed > scheduler->stats.max_time_to_reconnect_ms) {
+            scheduler->stats.max_time_to_reconnect_ms = elapsed;
+        }
+        scheduler->outage_started_microsec = 0;
+    }
+
+    scheduler->connected_microsec = now;
+}
+
+
+/**
+ * @brief Stop any pending retry, eg. because the network has gone away.
+ *
+ * The outage timer keeps running so time-to-reconnect includes the network outage.
+ */
+void reconnect_cancel(struct ReconnectScheduler *scheduler) {
+    osTimerStop(scheduler->timer);
+}
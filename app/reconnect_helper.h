@@ -0,0 +1,76 @@
+/**
+ *
+ * Microvisor Reconnect Helper
+ * Version 1.0.0
+ * Copyright © 2023, Twilio
+ * Licence: Apache 2.0
+ *
+ */
+
+/* Timer-driven retry scheduling with capped exponential backoff and full jitter.
+ *
+ * Each retry waits a random time between zero and min(cap, base * 2^attempt),
+ * so a fleet that loses its broker at the same moment spreads its reconnects
+ * out instead of arriving together.  When the timer expires the scheduler's
+ * work message is pushed onto the work queue.  The attempt count is reset
+ * once a connection has stayed up for RECONNECT_STABLE_MS.
+ */
+#ifndef RECONNECT_HELPER_H
+#define RECONNECT_HELPER_H
+
+/*
+ * INCLUDES
+ */
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "cmsis_os.h"
+#include "work.h"
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * DEFINES
+ */
+#define RECONNECT_STABLE_MS (60*1000)
+#define RECONNECT_MAX_SHIFT 16
+
+/*
+ * TYPES
+ */
+struct ReconnectStats {
+    uint32_t attempts;                      // retries scheduled
+    uint32_t reconnects;                    // outages that ended in a connection
+    uint32_t last_backoff_ms;               // most recent delay chosen
+    uint32_t last_time_to_reconnect_ms;     // first failure to connection, most recent outage
+    uint32_t max_time_to_reconnect_ms;
+};
+
+struct ReconnectScheduler {
+    enum WorkMessageType message;
+    uint32_t base_ms;
+    uint32_t cap_ms;
+    uint32_t attempt;
+    osTimerId_t timer;
+    uint64_t outage_started_microsec;       // 0 while connected
+    uint64_t connected_microsec;            // 0 until the first connection
+    struct ReconnectStats stats;
+};
+
+/*
+ * PROTOTYPES
+ */
+void reconnect_init(struct ReconnectScheduler *scheduler, enum WorkMessageType message,
+                    uint32_t base_ms, uint32_t cap_ms);
+uint32_t reconnect_schedule(struct ReconnectScheduler *scheduler);
+void reconnect_succeeded(struct ReconnectScheduler *scheduler);
+void reconnect_cancel(struct ReconnectScheduler *scheduler);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* RECONNECT_HELPER_H */
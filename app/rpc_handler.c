@@ -0,0 +1,418 @@
+/**
+ *
+ * Microvisor RPC Handler
+ * Version 1.0.0
+ * Copyright © 2023, Twilio
+ * Licence: Apache 2.0
+ *
+ */
+
+#include "rpc_handler.h"
+#include <string.h>
+#include <stdio.h>
+
+
+struct RpcMethod {
+    char method[BUF_RPC_METHOD];
+    RpcMethodHandler handler;
+    uint32_t timeout_ms;
+    struct RpcMethodStats stats;
+};
+
+struct RpcPending {
+    bool in_use;
+    uint32_t request;
+    uint32_t method_index;
+    uint64_t started_microsec;
+    char id[BUF_RPC_ID];
+    char reply_topic[BUF_RPC_REPLY_TOPIC];
+};
+
+static const struct RpcTransport *rpc_transport = NULL;
+static char topic_prefix[BUF_RPC_PREFIX] = {0};
+static size_t topic_prefix_len = 0;
+
+static struct RpcMethod methods[RPC_MAX_METHODS];
+static uint32_t num_methods = 0;
+
+static struct RpcPending pending[RPC_MAX_PENDING];
+static uint32_t next_request = 1;
+
+static char result_buffer[BUF_RPC_RESULT];
+static char response_buffer[BUF_RPC_RESPONSE];
+
+
+/*
+ * JSON HELPERS
+ *
+ * Just enough to pick top-level members out of a request object without
+ * copying it or allocating.
+ */
+static size_t skip_ws(const uint8_t *json, size_t index, size_t len) {
+    while (index < len && (json[index] == ' ' || json[index] == '\t' || json[index] == '\r' || json[index] == '\n')) {
+        index++;
+    }
+    return index;
+}
+
+static size_t skip_string(const uint8_t *json, size_t index, size_t len) {
+    // index is on the opening quote; returns the index after the closing quote
+    for (index++; index < len; index++) {
+        if (json[index] == '\\') {
+            index++;
+        } else if (json[index] == '"') {
+            return index + 1;
+        }
+    }
+    return len;
+}
+
+static size_t skip_value(const uint8_t *json, size_t index, size_t len) {
+    if (index >= len) {
+        return len;
+    }
+
+    if (json[index] == '"') {
+        return skip_string(json, index, len);
+    }
+
+    if (json[index] == '{' || json[index] == '[') {
+        uint32_t depth = 0;
+        while (index < len) {
+            uint8_t c = json[index];
+            if (c == '"') {
+                index = skip_string(json, index, len);
+                continue;
+            }
+            if (c == '{' || c == '[') {
+                depth++;
+            } else if (c == '}' || c == ']') {
+                if (--depth == 0) {
+                    return index + 1;
+                }
+            }
+            index++;
+        }
+        return len;
+    }
+
+    while (index < len && json[index] != ',' && json[index] != '}' && json[index] != ']'
+           && json[index] != ' ' && json[index] != '\r' && json[index] != '\n' && json[index] != '\t') {
+        index++;
+    }
+    return index;
+}
+
+/**
+ * @brief Find a top-level member of a JSON object.
+ *
+ * @retval true if found; strings are returned without their quotes.
+ */
+bool rpc_json_get(const uint8_t *json, size_t len, const char *key,
+                  const uint8_t **value, size_t *value_len) {
+    size_t key_len = strlen(key);
+    size_t index = skip_ws(json, 0, len);
+    if (index >= len || json[index] != '{') {
+        return false;
+    }
+    index++;
+
+    while (true) {
+        index = skip_ws(json, index, len);
+        if (index >= len || json[index] != '"') {
+            return false;
+        }
+
+        size_t name_start = index + 1;
+        index = skip_string(json, index, len);
+        size_t name_len = index - name_start - 1;
+
+        index = skip_ws(json, index, len);
+        if (index >= len || json[index] != ':') {
+            return false;
+        }
+        index = skip_ws(json, index + 1, len);
+
+        size_t value_start = index;
+        if (value_start >= len) {
+            return false;
+        }
+        index = skip_value(json, index, len);
+
+        if (name_len == key_len && memcmp(&json[name_start], key, key_len) == 0) {
+            if (json[value_start] == '"') {
+                if (index - value_start < 2 || json[index - 1] != '"') {
+                    return false;
+                }
+                *value = &json[value_start + 1];
+                *value_len = index - value_start - 2;
+            } else {
+                *value = &json[value_start];
+                *value_len = index - value_start;
+            }
+            return true;
+        }
+
+        index = skip_ws(json, index, len);
+        if (index >= len || json[index] != ',') {
+            return false;
+        }
+        index++;
+    }
+}
+
+
+/*
+ * RESPONSES
+ */
+static void send_response(const char *reply_topic, const char *id, const char *status, const char *value) {
+    int length = snprintf(response_buffer, sizeof(response_buffer),
+                          "{\"id\":\"%s\",\"status\":\"%s\",\"result\":%s}",
+                          id, status, (value != NULL && value[0] != '\0') ? value : "null");
+    if (length < 0 || length >= (int)sizeof(response_buffer)) {
+        length = snprintf(response_buffer, sizeof(response_buffer),
+                          "{\"id\":\"%s\",\"status\":\"error\",\"result\":\"response too large\"}", id);
+    }
+
+    rpc_transport->publish((const uint8_t *)reply_topic, strlen(reply_topic),
+                           (const uint8_t *)response_buffer, (size_t)length);
+}
+
+static void finish_request(struct RpcPending *slot, const char *status, const char *value) {
+    struct RpcMethodStats *stats = &methods[slot->method_index].stats;
+    uint32_t latency = (uint32_t)(rpc_transport->now_microsec() - slot->started_microsec);
+
+    stats->total_latency_us += latency;
+    if (latency > stats->max_latency_us) {
+        stats->max_latency_us = latency;
+    }
+
+    send_response(slot->reply_topic, slot->id, status, value);
+    slot->in_use = false;
+}
+
+static void copy_token(char *dest, size_t dest_size, const uint8_t *src, size_t src_len) {
+    size_t n = src_len < dest_size - 1 ? src_len : dest_size - 1;
+    memcpy(dest, src, n);
+    dest[n] = '\0';
+}
+
+
+/*
+ * PUBLIC API
+ */
+
+/**
+ * @brief Set the transport used to publish responses and read the clock.
+ */
+void rpc_init(const struct RpcTransport *transport) {
+    rpc_transport = transport;
+}
+
+
+/**
+ * @brief Set the topic prefix that requests arrive under, eg. "rpc/device/<id>/".
+ */
+void rpc_set_topic_prefix(const char *prefix) {
+    copy_token(topic_prefix, sizeof(topic_prefix), (const uint8_t *)prefix, strlen(prefix));
+    topic_prefix_len = strlen(topic_prefix);
+}
+
+
+/**
+ * @brief Register a handler for a method.
+ *
+ * @param method     Method name, the last topic level of the request
+ * @param handler    Function to call for each request
+ * @param timeout_ms How long a pending request may wait for rpc_complete(); 0 for the default
+ *
+ * @retval false if the method table is full or the name is too long.
+ */
+bool rpc_register(const char *method, RpcMethodHandler handler, uint32_t timeout_ms) {
+    if (num_methods == RPC_MAX_METHODS || strlen(method) >= BUF_RPC_METHOD) {
+        return false;
+    }
+
+    struct RpcMethod *entry = &methods[num_methods++];
+    memset(entry, 0, sizeof(struct RpcMethod));
+    strcpy(entry->method, method);
+    entry->handler = handler;
+    entry->timeout_ms = timeout_ms != 0 ? timeout_ms : RPC_DEFAULT_TIMEOUT_MS;
+    return true;
+}
+
+
+/**
+ * @brief Does a topic carry an RPC request?
+ */
+bool rpc_is_request(const uint8_t *topic, size_t topic_len) {
+    return topic_prefix_len != 0 && topic_len > topic_prefix_len
+           && memcmp(topic, topic_prefix, topic_prefix_len) == 0;
+}
+
+
+/**
+ * @brief Dispatch a request to its method handler.
+ *
+ * Requests without a usable "id" and "reply" cannot be answered and are dropped.
+ */
+void rpc_handle_request(const uint8_t *topic, size_t topic_len,
+                        const uint8_t *payload, size_t payload_len) {
+    const uint8_t *id, *reply, *params;
+    size_t id_len, reply_len, params_len;
+
+    if (!rpc_json_get(payload, payload_len, "id", &id, &id_len) || id_len >= BUF_RPC_ID
+        || !rpc_json_get(payload, payload_len, "reply", &reply, &reply_len) || reply_len >= BUF_RPC_REPLY_TOPIC) {
+        return;
+    }
+
+    if (!rpc_json_get(payload, payload_len, "params", &params, &params_len)) {
+        params = payload;
+        params_len = 0;
+    }
+
+    struct RpcPending *slot = NULL;
+    for (uint32_t ndx = 0; ndx < RPC_MAX_PENDING; ndx++) {
+        if (!pending[ndx].in_use) {
+            slot = &pending[ndx];
+            break;
+        }
+    }
+
+    char id_str[BUF_RPC_ID];
+    char reply_str[BUF_RPC_REPLY_TOPIC];
+    copy_token(id_str, sizeof(id_str), id, id_len);
+    copy_token(reply_str, sizeof(reply_str), reply, reply_len);
+
+    const uint8_t *method = topic + topic_prefix_len;
+    size_t method_len = topic_len - topic_prefix_len;
+
+    uint32_t method_index = 0;
+    while (method_index < num_methods
+           && (strlen(methods[method_index].method) != method_len
+               || memcmp(methods[method_index].method, method, method_len) != 0)) {
+        method_index++;
+    }
+
+    if (method_index == num_methods) {
+        send_response(reply_str, id_str, "unknown_method", NULL);
+        return;
+    }
+
+    struct RpcMethod *entry = &methods[method_index];
+    entry->stats.calls++;
+
+    if (slot == NULL) {
+        entry->stats.errors++;
+        send_response(reply_str, id_str, "busy", NULL);
+        return;
+    }
+
+    slot->in_use = true;
+    slot->request = next_request++;
+    slot->method_index = method_index;
+    slot->started_microsec = rpc_transport->now_microsec();
+    strcpy(slot->id, id_str);
+    strcpy(slot->reply_topic, reply_str);
+
+    result_buffer[0] = '\0';
+    enum RpcResult result = entry->handler(slot->request, params, params_len,
+                                           result_buffer, sizeof(result_buffer));
+    if (result == RPC_RESULT_PENDING) {
+        return;
+    }
+
+    if (result != RPC_RESULT_OK) {
+        entry->stats.errors++;
+    }
+    finish_request(slot, result == RPC_RESULT_OK ? "ok" : "error", result_buffer);
+}
+
+
+/**
+ * @brief Complete a request whose handler returned RPC_RESULT_PENDING.
+ *
+ * @param request The request handle passed to the handler
+ * @param result  RPC_RESULT_OK or RPC_RESULT_ERROR
+ * @param value   JSON value to return, or NULL
+ *
+ * @retval false if the request is unknown, eg. it has already timed out.
+ */
+bool rpc_complete(uint32_t request, enum RpcResult result, const char *value) {
+    for (uint32_t ndx = 0; ndx < RPC_MAX_PENDING; ndx++) {
+        if (pending[ndx].in_use && pending[ndx].request == request) {
+            if (result != RPC_RESULT_OK) {
+                methods[pending[ndx].method_index].stats.errors++;
+            }
+            finish_request(&pending[ndx], result == RPC_RESULT_OK ? "ok" : "error", value);
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/**
+ * @brief Replace a handler's partly written result with a fixed error value.
+ *
+ * For handlers whose result did not fit in result_size, so the backend never
+ * receives truncated JSON.
+ *
+ * @retval RPC_RESULT_ERROR, for the handler to return.
+ */
+enum RpcResult rpc_result_too_large(char *result, size_t result_size) {
+    snprintf(result, result_size, "%s", RPC_RESULT_TOO_LARGE);
+    return RPC_RESULT_ERROR;
+}
+
+
+/**
+ * @brief Answer any pending requests that have outlived their method's timeout.
+ *
+ * @retval The number of requests still pending.
+ */
+uint32_t rpc_poll() {
+    uint64_t now = rpc_transport->now_microsec();
+    uint32_t still_pending = 0;
+
+    for (uint32_t ndx = 0; ndx < RPC_MAX_PENDING; ndx++) {
+        struct RpcPending *slot = &pending[ndx];
+        if (!slot->in_use) {
+            continue;
+        }
+
+        struct RpcMethod *entry = &methods[slot->method_index];
+        if (now - slot->started_microsec >= (uint64_t)entry->timeout_ms * 1000) {
+            entry->stats.timeouts++;
+            finish_request(slot, "timeout", NULL);
+        } else {
+            still_pending++;
+        }
+    }
+
+    return still_pending;
+}
+
+
+/**
+ * @brief The number of registered methods.
+ */
+uint32_t rpc_method_count() {
+    return num_methods;
+}
+
+
+/**
+ * @brief Copy out a method's name and statistics.
+ *
+ * @retval false if index is out of range.
+ */
+bool rpc_get_method_stats(uint32_t index, const char **method, struct RpcMethodStats *stats) {
+    if (index >= num_methods) {
+        return false;
+    }
+
+    *method = methods[index].method;
+    *stats = methods[index].stats;
+    return true;
+}
@@ -0,0 +1,121 @@
+/**
+ *
+ * Microvisor RPC Handler
+ * Version 1.0.0
+ * Copyright © 2023, Twilio
+ * Licence: Apache 2.0
+ *
+ */
+
+/* Request/response calls carried over MQTT.
+ *
+ * A request is published to "<prefix><method>" with a JSON payload:
+ *
+ *   {"id":"42","reply":"rpc/reply/backend","params":{...}}
+ *
+ * The registered handler for <method> is called with the raw "params" value and
+ * the response is published to the "reply" topic as:
+ *
+ *   {"id":"42","status":"ok","result":...}
+ *
+ * where status is one of "ok", "error", "timeout", "busy" or "unknown_method".
+ *
+ * Handlers may complete synchronously or return RPC_RESULT_PENDING and finish
+ * later with rpc_complete().  Pending requests that outlive their method's
+ * timeout are answered with "timeout" by rpc_poll().
+ *
+ * This file has no Microvisor dependencies: publishing and the clock are
+ * supplied through struct RpcTransport, so the same code can be driven by a
+ * stand-in transport on a host machine.  None of the calls are thread-safe;
+ * make them all from one task.
+ */
+#ifndef RPC_HANDLER_H
+#define RPC_HANDLER_H
+
+/*
+ * INCLUDES
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * DEFINES
+ */
+#define RPC_MAX_METHODS 10
+#define RPC_MAX_PENDING 4
+#define RPC_DEFAULT_TIMEOUT_MS 5000
+
+#define BUF_RPC_PREFIX 96
+#define BUF_RPC_METHOD 32
+#define BUF_RPC_ID 40
+#define BUF_RPC_REPLY_TOPIC 128
+#define BUF_RPC_RESULT 1024
+// A response is the id, status and result plus the JSON around them
+#define BUF_RPC_RESPONSE (BUF_RPC_ID + BUF_RPC_RESULT + 64)
+// Send buffer space one response needs: it, its reply topic and the PUBLISH header
+#define RPC_PUBLISH_OVERHEAD 16
+#define BUF_RPC_PUBLISH (BUF_RPC_RESPONSE + BUF_RPC_REPLY_TOPIC + RPC_PUBLISH_OVERHEAD)
+
+// Returned in place of a result that would not fit; see rpc_result_too_large()
+#define RPC_RESULT_TOO_LARGE "\"result too large\""
+
+/*
+ * TYPES
+ */
+enum RpcResult {
+    RPC_RESULT_OK       = 0x0, //< result holds a JSON value to return
+    RPC_RESULT_ERROR    = 0x1, //< result optionally holds a JSON value describing the error
+    RPC_RESULT_PENDING  = 0x2, //< the handler will call rpc_complete() later
+};
+
+/*
+ * Handler for one method.  params is the raw JSON "params" value (may be empty),
+ * the handler writes a JSON value of at most result_size-1 characters to result.
+ * A handler whose value does not fit returns rpc_result_too_large().
+ */
+typedef enum RpcResult (*RpcMethodHandler)(uint32_t request,
+                                           const uint8_t *params, size_t params_len,
+                                           char *result, size_t result_size);
+
+struct RpcTransport {
+    bool     (*publish)(const uint8_t *topic, size_t topic_len,
+                        const uint8_t *payload, size_t payload_len);
+    uint64_t (*now_microsec)(void);
+};
+
+struct RpcMethodStats {
+    uint32_t calls;
+    uint32_t errors;
+    uint32_t timeouts;
+    uint32_t max_latency_us;
+    uint64_t total_latency_us;
+};
+
+/*
+ * PROTOTYPES
+ */
+void rpc_init(const struct RpcTransport *transport);
+void rpc_set_topic_prefix(const char *prefix);
+bool rpc_register(const char *method, RpcMethodHandler handler, uint32_t timeout_ms);
+bool rpc_is_request(const uint8_t *topic, size_t topic_len);
+void rpc_handle_request(const uint8_t *topic, size_t topic_len,
+                        const uint8_t *payload, size_t payload_len);
+bool rpc_complete(uint32_t request, enum RpcResult result, const char *value);
+enum RpcResult rpc_result_too_large(char *result, size_t result_size);
+uint32_t rpc_poll();
+uint32_t rpc_method_count();
+bool rpc_get_method_stats(uint32_t index, const char **method, struct RpcMethodStats *stats);
+bool rpc_json_get(const uint8_t *json, size_t len, const char *key,
+                  const uint8_t **value, size_t *value_len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* RPC_HANDLER_H */
@@ -0,0 +1,203 @@
+/**
+ *
+ * Microvisor Timing Helper
+ * Version 1.0.0
+ * Copyright © 2023, Twilio
+ * Licence: Apache 2.0
+ *
+ */
+
+#include "timing_helper.h"
+#include <string.h>
+#include <stdio.h>
+
+// Microvisor includes
+#include "mv_syscalls.h"
+
+
+static const char *phase_names[CONNECT_PHASE_COUNT] = {
+    "network_up",
+    "config_requested",
+    "config_received",
+    "config_obtained",
+    "channel_opened",
+    "broker_connected",
+    "subscribed",
+    "first_publish",
+};
+
+static const char *kind_names[CONNECT_KIND_COUNT] = {
+    "boot",
+    "network",
+    "broker",
+};
+
+static struct ConnectRecord current = {0};
+static bool record_open = false;
+static bool awaiting_first_publish = false;
+static uint64_t connected_microsec = 0;
+static enum ConnectKind connected_kind = CONNECT_KIND_BOOT;
+static uint64_t connected_started_microsec = 0;
+static uint32_t boot_to_first_publish_us = 0;
+
+static struct PhaseAggregate phase_aggregates[CONNECT_PHASE_COUNT] = {0};
+static struct PhaseAggregate total_aggregates[CONNECT_KIND_COUNT] = {0};
+
+
+static uint64_t now_microsec() {
+    uint64_t now = 0;
+    mvGetMicroseconds(&now);
+    return now;
+}
+
+static void aggregate(struct PhaseAggregate *agg, uint64_t from, uint64_t to) {
+    uint32_t elapsed = to > from ? (uint32_t)(to - from) : 0;
+    agg->count++;
+    agg->last_us = elapsed;
+    agg->total_us += elapsed;
+    if (elapsed > agg->max_us) {
+        agg->max_us = elapsed;
+    }
+}
+
+
+/**
+ * @brief Start a new record, discarding any that never completed.
+ */
+void timing_begin(enum ConnectKind kind) {
+    memset(&current, 0, sizeof(current));
+    current.kind = kind;
+    current.started_microsec = now_microsec();
+    record_open = true;
+    awaiting_first_publish = false;
+}
+
+
+/**
+ * @brief Is a connection currently being timed?
+ */
+bool timing_is_open() {
+    return record_open;
+}
+
+
+/**
+ * @brief Timestamp a phase of the connection being brought up.
+ */
+void timing_mark(enum ConnectPhase phase) {
+    uint64_t now = now_microsec();
+
+    if (phase == CONNECT_PHASE_FIRST_PUBLISH) {
+        if (awaiting_first_publish) {
+            aggregate(&phase_aggregates[phase], connected_microsec, now);
+            if (connected_kind == CONNECT_KIND_BOOT) {
+                boot_to_first_publish_us = (uint32_t)(now - connected_started_microsec);
+            }
+            awaiting_first_publish = false;
+        }
+        return;
+    }
+
+    if (record_open) {
+        current.phase_microsec[phase] = now;
+    }
+}
+
+
+/**
+ * @brief Close the record now the connection is operational and update the aggregates.
+ *
+ * @param record Populated with the closed record
+ *
+ * @retval false if no record was open.
+ */
+bool timing_connected(struct ConnectRecord *record) {
+    if (!record_open) {
+        return false;
+    }
+
+    timing_mark(CONNECT_PHASE_SUBSCRIBED);
+
+    uint64_t previous = current.started_microsec;
+    for (uint32_t phase = 0; phase <= CONNECT_PHASE_SUBSCRIBED; phase++) {
+        if (current.phase_microsec[phase] != 0) {
+            aggregate(&phase_aggregates[phase], previous, current.phase_microsec[phase]);
+            previous = current.phase_microsec[phase];
+        }
+    }
+    aggregate(&total_aggregates[current.kind], current.started_microsec,
+              current.phase_microsec[CONNECT_PHASE_SUBSCRIBED]);
+
+    *record = current;
+    record_open = false;
+    awaiting_first_publish = true;
+    connected_microsec = current.phase_microsec[CONNECT_PHASE_SUBSCRIBED];
+    connected_kind = current.kind;
+    connected_started_microsec = current.started_microsec;
+    return true;
+}
+
+
+/**
+ * @brief Format a closed record as JSON, each phase as microseconds since the previous one.
+ *
+ * @retval The formatted length; >= size if truncated.
+ */
+size_t timing_format_record(const struct ConnectRecord *record, char *buffer, size_t size) {
+    uint64_t end = record->phase_microsec[CONNECT_PHASE_SUBSCRIBED];
+    size_t used = snprintf(buffer, size, "{\"kind\":\"%s\",\"total_us\":%lu,\"phases_us\":{",
+                           kind_names[record->kind], (uint32_t)(end - record->started_microsec));
+
+    uint64_t previous = record->started_microsec;
+    bool first = true;
+    for (uint32_t phase = 0; phase <= CONNECT_PHASE_SUBSCRIBED && used < size; phase++) {
+        uint64_t stamp = record->phase_microsec[phase];
+        if (stamp == 0) {
+            continue;
+        }
+
+        used += snprintf(&buffer[used], size - used, "%s\"%s\":%lu", first ? "" : ",",
+                         phase_names[phase], (uint32_t)(stamp > previous ? stamp - previous : 0));
+        previous = stamp;
+        first = false;
+    }
+
+    if (used < size) {
+        used += snprintf(&buffer[used], size - used, "}}");
+    }
+    return used;
+}
+
+
+/**
+ * @brief Aggregated duration of one phase across all completed connections.
+ */
+const struct PhaseAggregate *timing_phase_aggregate(enum ConnectPhase phase) {
+    return &phase_aggregates[phase];
+}
+
+
+/**
+ * @brief Aggregated start-to-operational time for one kind of connection.
+ */
+const struct PhaseAggregate *timing_total_aggregate(enum ConnectKind kind) {
+    return &total_aggregates[kind];
+}
+
+
+/**
+ * @brief Work task start to the first acknowledged publish after boot, or 0 if not reached yet.
+ */
+uint32_t timing_boot_to_first_publish() {
+    return boot_to_first_publish_us;
+}
+
+
+const char *timing_phase_name(enum ConnectPhase phase) {
+    return phase_names[phase];
+}
+
+
+const char *timing_kind_name(enum ConnectKind kind) {
+    return kind_names[kind];
+}
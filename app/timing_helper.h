@@ -0,0 +1,92 @@
+/**
+ *
+ * Microvisor Timing Helper
+ * Version 1.0.0
+ * Copyright © 2023, Twilio
+ * Licence: Apache 2.0
+ *
+ */
+
+/* Timestamps each phase of bringing the MQTT connection up, from network-up
+ * through config fetch, channel open, CONNACK and SUBACK, to the first
+ * acknowledged publish.
+ *
+ * One record is kept for the connection currently being brought up.  When it
+ * becomes operational the record is closed, its phase durations are folded into
+ * per-phase aggregates and it can be published.  The time from then to the
+ * first acknowledged publish is aggregated on its own, since not every
+ * application publishes.
+ *
+ * If a phase repeats (eg. a CONNACK failure followed by a retry) the latest
+ * timestamp wins, so each duration describes the attempt that succeeded while
+ * the record's total includes the failed ones.
+ */
+#ifndef TIMING_HELPER_H
+#define TIMING_HELPER_H
+
+/*
+ * INCLUDES
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * TYPES
+ */
+enum ConnectKind {
+    CONNECT_KIND_BOOT       = 0x0, //< first connection after boot
+    CONNECT_KIND_NETWORK    = 0x1, //< after the network came back
+    CONNECT_KIND_BROKER     = 0x2, //< after the broker connection alone was lost
+    CONNECT_KIND_COUNT
+};
+
+enum ConnectPhase {
+    CONNECT_PHASE_NETWORK_UP = 0,   //< OnNetworkConnected
+    CONNECT_PHASE_CONFIG_REQUESTED, //< config channel open, fetch request sent
+    CONNECT_PHASE_CONFIG_RECEIVED,  //< config channel readable
+    CONNECT_PHASE_CONFIG_OBTAINED,  //< all items read and decoded
+    CONNECT_PHASE_CHANNEL_OPENED,   //< mqtt channel open, connect requested
+    CONNECT_PHASE_BROKER_CONNECTED, //< CONNACK received
+    CONNECT_PHASE_SUBSCRIBED,       //< SUBACK received or session resumed; the record closes here
+    CONNECT_PHASE_FIRST_PUBLISH,    //< first application publish acknowledged after that
+    CONNECT_PHASE_COUNT
+};
+
+struct ConnectRecord {
+    enum ConnectKind kind;
+    uint64_t started_microsec;
+    uint64_t phase_microsec[CONNECT_PHASE_COUNT]; // 0 if the phase was not reached
+};
+
+struct PhaseAggregate {
+    uint32_t count;
+    uint32_t last_us;
+    uint32_t max_us;
+    uint64_t total_us;
+};
+
+/*
+ * PROTOTYPES
+ */
+void timing_begin(enum ConnectKind kind);
+bool timing_is_open();
+void timing_mark(enum ConnectPhase phase);
+bool timing_connected(struct ConnectRecord *record);
+size_t timing_format_record(const struct ConnectRecord *record, char *buffer, size_t size);
+const struct PhaseAggregate *timing_phase_aggregate(enum ConnectPhase phase);
+const struct PhaseAggregate *timing_total_aggregate(enum ConnectKind kind);
+uint32_t timing_boot_to_first_publish();
+const char *timing_phase_name(enum ConnectPhase phase);
+const char *timing_kind_name(enum ConnectKind kind);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* TIMING_HELPER_H */
@@ -0,0 +1,171 @@
+/**
+ *
+ * Microvisor Tunables Helper
+ * Version 1.0.0
+ * Copyright © 2023, Twilio
+ * Licence: Apache 2.0
+ *
+ */
+
+#include "tunables_helper.h"
+#include <string.h>
+#include <stdio.h>
+
+#include "log_helper.h"
+#include "rpc_handler.h"
+
+#define LOG_MODULE LOG_MODULE_CONFIG
+
+
+#define TUNABLES_DEFINE_NUMBER(name, value, min, max) \
+    static volatile uint32_t name = (value); \
+    uint32_t tunable_##name() { \
+        return name; \
+    }
+
+// Written by the work task, read by any; each is a single aligned word
+TUNABLES(TUNABLES_DEFINE_NUMBER)
+
+static char topic[BUF_TUNABLES_TOPIC] = {0};
+static size_t topic_len = 0;
+
+static struct TunablesStats stats = {0};
+
+// The log level the last message carried, if it carried one.  The "log" rpc
+// sets levels too, so they are only touched when this changes.
+static enum LogLevel log_level = LOG_LEVEL_DEBUG;
+static bool log_level_tuned = false;
+
+
+/**
+ * @brief Read a number member of the payload.
+ *
+ * @retval false if the member is present but not a whole number within min..max;
+ *         value is left as it was if the member is absent.
+ */
+static bool parse_number(const uint8_t *payload, size_t payload_len, const char *key,
+                         uint32_t min, uint32_t max, uint32_t *value) {
+    const uint8_t *member;
+    size_t member_len;
+    if (!rpc_json_get(payload, payload_len, key, &member, &member_len)) {
+        return true;
+    }
+
+    if (member_len == 0 || member_len > 10) {
+        server_error("tunable %s is not a number", key);
+        return false;
+    }
+
+    uint64_t number = 0;
+    for (size_t ndx = 0; ndx < member_len; ndx++) {
+        if (member[ndx] < '0' || member[ndx] > '9') {
+            server_error("tunable %s is not a number", key);
+            return false;
+        }
+        number = number * 10 + (member[ndx] - '0');
+    }
+
+    if (number < min || number > max) {
+        server_error("tunable %s out of range (%lu..%lu)", key, min, max);
+        return false;
+    }
+
+    *value = (uint32_t)number;
+    return true;
+}
+
+/**
+ * @brief Read the log_level member of the payload.
+ *
+ * @retval false if the member is present but not a level name; present is set
+ *         if the member is there at all.
+ */
+static bool parse_log_level(const uint8_t *payload, size_t payload_len, enum LogLevel *level, bool *present) {
+    const uint8_t *member;
+    size_t member_len;
+    *present = rpc_json_get(payload, payload_len, "log_level", &member, &member_len);
+    if (!*present) {
+        return true;
+    }
+
+    if (log_find_level(member, member_len, level)) {
+        return true;
+    }
+
+    server_error("tunable log_level must be \"error\", \"debug\" or \"trace\"");
+    return false;
+}
+
+
+/**
+ * @brief Set the topic updates arrive on, as subscribed.
+ */
+void tunables_set_topic(const char *update_topic) {
+    strncpy(topic, update_topic, sizeof(topic) - 1);
+    topic[sizeof(topic) - 1] = '\0';
+    topic_len = strlen(topic);
+}
+
+
+bool tunables_is_update(const uint8_t *update_topic, size_t update_topic_len) {
+    return topic_len != 0 && update_topic_len == topic_len && memcmp(update_topic, topic, topic_len) == 0;
+}
+
+
+/**
+ * @brief Check every tunable in the payload, then apply them all.
+ *
+ * @retval false if any value was invalid; nothing is applied.
+ */
+bool tunables_apply(const uint8_t *payload, size_t payload_len) {
+    stats.received++;
+
+#define TUNABLES_PARSE_NUMBER(name, value, min, max) \
+    uint32_t new_##name = (value); \
+    bool valid_##name = parse_number(payload, payload_len, #name, (min), (max), &new_##name);
+    TUNABLES(TUNABLES_PARSE_NUMBER)
+
+    enum LogLevel new_log_level = LOG_LEVEL_DEBUG;
+    bool has_log_level = false;
+    bool valid = parse_log_level(payload, payload_len, &new_log_level, &has_log_level);
+
+#define TUNABLES_CHECK_NUMBER(name, value, min, max) \
+    valid = valid && valid_##name;
+    TUNABLES(TUNABLES_CHECK_NUMBER)
+
+    if (!valid) {
+        stats.rejected++;
+        return false;
+    }
+
+    uint32_t changed = 0;
+#define TUNABLES_COMMIT_NUMBER(name, value, min, max) \
+    if (name != new_##name) { \
+        server_log("tunable " #name " now %lu", new_##name); \
+        name = new_##name; \
+        changed++; \
+    }
+    TUNABLES(TUNABLES_COMMIT_NUMBER)
+
+    if (!has_log_level) {
+        // Levels stay as they are, but a log_level sent later is applied
+        log_level_tuned = false;
+    } else if (!log_level_tuned || log_level != new_log_level) {
+        // Logged before the change, or turning debug logging off would hide it
+        server_log("tunable log_level now %s", log_level_name(new_log_level));
+        log_set_level(new_log_level);
+        log_level = new_log_level;
+        log_level_tuned = true;
+        changed++;
+    }
+
+    if (changed != 0) {
+        stats.applied++;
+    }
+    return true;
+}
+
+
+void tunables_get_stats(struct TunablesStats *out) {
+    *out = stats;
+}
@@ -0,0 +1,87 @@
+/**
+ *
+ * Microvisor Tunables Helper
+ * Version 1.0.0
+ * Copyright © 2023, Twilio
+ * Licence: Apache 2.0
+ *
+ */
+
+/* Non-secret settings the device applies while running.
+ *
+ * With SUBSCRIBE_TUNABLES defined (see mqtt_handler.h), the device subscribes
+ * to TUNABLES_TOPIC and the broker hands it the topic's retained message as
+ * soon as the subscription is made.  The payload is a JSON object, eg.:
+ *
+ *   {"sample_interval_s":30,"flush_threshold":8,"log_level":"error"}
+ *
+ * The retained message is the whole of the desired state: a tunable it leaves
+ * out goes back to its default, and an empty message restores them all.
+ * log_level is the exception, as the "log" rpc also sets the log levels: left
+ * out, the levels stay as they are, and a log_level is only applied when it
+ * differs from the one the previous message carried, so the broker sending
+ * the retained message again does not undo the rpc.
+ *
+ * The payload is checked in full before anything is applied, so one bad
+ * value rejects the message and leaves every tunable as it was.
+ *
+ * Broker settings, credentials and anything else needed to reach the broker
+ * stay in the config and secrets stores; see config_schema.h.
+ */
+#ifndef TUNABLES_HELPER_H
+#define TUNABLES_HELPER_H
+
+/*
+ * INCLUDES
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include "duty_cycle_helper.h"
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * DEFINES
+ */
+// NUMBER(name, default, min, max), each read with tunable_name().
+// flush_threshold and wake_interval_s only have an effect with DUTY_CYCLE:
+// how many samples wake the radio early, and how long it sleeps otherwise.
+#define TUNABLES(NUMBER) \
+    NUMBER(sample_interval_s, 60, 5, 24*60*60) \
+    NUMBER(flush_threshold, DUTY_CYCLE_FLUSH_THRESHOLD, 1, DUTY_CYCLE_MAX_SAMPLES) \
+    NUMBER(wake_interval_s, DUTY_CYCLE_WAKE_INTERVAL_MS / 1000, 60, 24*60*60)
+
+#define BUF_TUNABLES_TOPIC 128
+
+/*
+ * TYPES
+ */
+struct TunablesStats {
+    uint32_t received;
+    uint32_t applied;               // changed at least one tunable
+    uint32_t rejected;
+};
+
+/*
+ * PROTOTYPES
+ */
+#define TUNABLES_DECLARE_NUMBER(name, value, min, max) \
+    uint32_t tunable_##name();
+
+TUNABLES(TUNABLES_DECLARE_NUMBER)
+
+void tunables_set_topic(const char *topic);
+bool tunables_is_update(const uint8_t *topic, size_t topic_len);
+bool tunables_apply(const uint8_t *payload, size_t payload_len);
+void tunables_get_stats(struct TunablesStats *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* TUNABLES_HELPER_H */
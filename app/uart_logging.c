@@ -14,13 +14,31 @@
 
 // Microvisor includes
 #include "stm32u5xx_hal.h"
+#include "mv_syscalls.h"
 
 #include "log_helper.h"
+#include "uart_ring_helper.h"
+
+#define LOG_MODULE LOG_MODULE_LOG
+
+
+/*
+ * FORWARD DECLARATIONS
+ */
+static bool port_transmit(const uint8_t *data, uint16_t length);
+static uint32_t port_lock(void);
+static void port_unlock(uint32_t state);
 
 
 bool uart_available = false;
 UART_HandleTypeDef uart;
 
+static const struct UartRingPort uart_port = {
+    .transmit = port_transmit,
+    .lock = port_lock,
+    .unlock = port_unlock
+};
+
 
 /**
  * @brief Configure STM32U585 UART1.
@@ -41,6 +59,9 @@ bool UART_init() {
       return false;
     }
 
+    uart_ring_init(&uart_port);
+    NVIC_ClearPendingIRQ(UART_LOGGING_IRQ);
+    NVIC_EnableIRQ(UART_LOGGING_IRQ);
     uart_available = true;
 
     server_log("UART logging enabled");
@@ -88,9 +109,11 @@ void HAL_UART_MspInit(UART_HandleTypeDef *uart) {
 }
 
 /**
- * @brief Output a UART-friendly log string, ie. one with
+ * @brief Queue a UART-friendly log string, ie. one with
  *        RETURN+NEWLINE in place of NEWLINE.
  *
+ * Returns without waiting for the string to be sent.
+ *
  * @param buffer: Source string.
  * @param length: String character count.
  */
@@ -99,14 +122,72 @@ void UART_output(uint8_t* buffer, uint16_t length) {
         return;
     }
 
-    const char nls[2] = "\r\n";
-    for (uint32_t i = 0 ; i < length ; ++i) {
-        uint8_t c = *buffer++;
-        if (c == 0) return;
-        if (c == '\n') {
-            HAL_UART_Transmit(&uart, (uint8_t*)nls, 2, 100);
-        } else {
-            HAL_UART_Transmit(&uart, &c, 1, 100);
+    uart_ring_write(buffer, length);
+}
+
+
+/**
+ * @brief Wait for queued output to be sent, for at most timeout_ms.
+ *
+ * Gives up at once if the UART will not start a transfer, rather than wait
+ * out the timeout on output that is not moving.
+ *
+ * @retval false if output was still queued when the time ran out, or stuck.
+ */
+bool UART_flush(uint32_t timeout_ms) {
+    if (!uart_available) {
+        return true;
+    }
+
+    // The Microvisor clock, as the HAL tick may be stopped when this is needed
+    uint64_t start = 0, now = 0;
+    mvGetMicroseconds(&start);
+    while (!uart_ring_is_empty()) {
+        if (!uart_ring_resume()) {
+            return false;
+        }
+        mvGetMicroseconds(&now);
+        if (now - start > (uint64_t)timeout_ms * 1000) {
+            return false;
         }
     }
+
+    return true;
+}
+
+
+/*
+ * RING PORT
+ */
+
+static bool port_transmit(const uint8_t *data, uint16_t length) {
+    return HAL_UART_Transmit_IT(&uart, data, length) == HAL_OK;
+}
+
+static uint32_t port_lock(void) {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    return primask;
+}
+
+static void port_unlock(uint32_t state) {
+    __set_PRIMASK(state);
+}
+
+
+/**
+ * @brief HAL-called function when a transfer from the ring is done.
+ */
+void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart) {
+    if (huart == &uart) {
+        uart_ring_transmitted();
+    }
+}
+
+
+/**
+ *  @brief Logging UART ISR.
+ */
+void USART2_IRQHandler(void) {
+    HAL_UART_IRQHandler(&uart);
 }
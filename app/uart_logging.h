@@ -17,11 +17,17 @@ extern "C" {
 
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
+
+// If you change the UART, you must also rename the Handler function in uart_logging.c
+#define UART_LOGGING_IRQ USART2_IRQn
+#define UART_FLUSH_TIMEOUT_MS 500
 
 extern bool uart_available;
 
 bool    UART_init(void);
 void    UART_output(uint8_t* buffer, uint16_t length);
+bool    UART_flush(uint32_t timeout_ms);
 
 
 #ifdef __cplusplus
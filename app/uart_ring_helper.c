@@ -0,0 +1,170 @@
+/**
+ *
+ * Microvisor UART Ring Helper
+ * Version 1.0.0
+ * Copyright © 2023, Twilio
+ * Licence: Apache 2.0
+ *
+ */
+
+#include "uart_ring_helper.h"
+#include <string.h>
+#include <stddef.h>
+
+
+/*
+ * GLOBALS
+ */
+static uint8_t ring[UART_RING_SIZE];
+
+// Free-running byte counts; a byte's offset in the ring is its count modulo
+// UART_RING_SIZE.  head is written under the port lock, tail by the interrupt.
+static volatile uint32_t ring_head = 0;
+static volatile uint32_t ring_tail = 0;
+static volatile uint32_t in_flight = 0;         // bytes the port is sending from tail
+
+static const struct UartRingPort *ring_port = NULL;
+static struct UartRingStats stats = {0};
+
+
+/*
+ * FORWARD DECLARATIONS
+ */
+static void start_transfer(void);
+
+
+/**
+ * @brief Set the port the ring is sent through, emptying the ring.
+ */
+void uart_ring_init(const struct UartRingPort *port) {
+    ring_port = port;
+    ring_head = ring_tail = in_flight = 0;
+}
+
+
+/**
+ * @brief Queue a message for the UART, with each NEWLINE sent as RETURN+NEWLINE.
+ *
+ * The message ends at length bytes or at a NUL, whichever comes first.
+ *
+ * @retval false if the ring is too full; the message is dropped.
+ */
+bool uart_ring_write(const uint8_t *text, uint32_t length) {
+    if (ring_port == NULL) {
+        return false;
+    }
+
+    // Size the expanded message before taking the lock
+    uint32_t expanded = 0;
+    uint32_t count = 0;
+    while (count < length && text[count] != 0) {
+        expanded += text[count] == '\n' ? 2 : 1;
+        count++;
+    }
+
+    uint32_t state = ring_port->lock();
+
+    uint32_t used = ring_head - ring_tail;
+    if (expanded > UART_RING_SIZE - used) {
+        stats.dropped++;
+        ring_port->unlock(state);
+        return false;
+    }
+
+    uint32_t head = ring_head;
+    for (uint32_t ndx = 0; ndx < count; ndx++) {
+        if (text[ndx] == '\n') {
+            ring[head++ & (UART_RING_SIZE - 1)] = '\r';
+        }
+        ring[head++ & (UART_RING_SIZE - 1)] = text[ndx];
+    }
+    ring_head = head;
+
+    stats.messages++;
+    stats.queued_bytes += expanded;
+    if (used + expanded > stats.high_water) {
+        stats.high_water = used + expanded;
+    }
+
+    if (in_flight == 0) {
+        start_transfer();
+    }
+
+    ring_port->unlock(state);
+    return true;
+}
+
+
+/**
+ * @brief Called by the port, from its interrupt, when a transfer is done.
+ */
+void uart_ring_transmitted(void) {
+    stats.sent_bytes += in_flight;
+    ring_tail += in_flight;
+    in_flight = 0;
+    start_transfer();
+}
+
+
+/**
+ * @brief Start sending the ring again if an earlier transfer could not start.
+ *
+ * @retval false if bytes are queued but the port still will not take them.
+ */
+bool uart_ring_resume(void) {
+    if (ring_port == NULL) {
+        return true;
+    }
+
+    uint32_t state = ring_port->lock();
+    if (in_flight == 0) {
+        start_transfer();
+    }
+    bool moving = in_flight != 0 || ring_tail == ring_head;
+    ring_port->unlock(state);
+    return moving;
+}
+
+
+/**
+ * @brief Has everything queued been sent?
+ */
+bool uart_ring_is_empty(void) {
+    return ring_tail == ring_head;
+}
+
+
+void uart_ring_get_stats(struct UartRingStats *out) {
+    *out = stats;
+}
+
+
+/**
+ * @brief Send the queued bytes from tail up to the end of the ring, or head if nearer.
+ *
+ * Called with the port's interrupt held off, or from it.  If the port cannot
+ * start, the bytes are left for the next write, or uart_ring_resume(), to
+ * try again.
+ */
+static void start_transfer(void) {
+    uint32_t tail = ring_tail;
+    uint32_t available = ring_head - tail;
+    if (available == 0) {
+        return;
+    }
+
+    uint32_t offset = tail & (UART_RING_SIZE - 1);
+    uint32_t length = UART_RING_SIZE - offset;
+    if (length > available) {
+        length = available;
+    }
+
+    // Set before starting, in case the transfer is done before transmit() returns
+    in_flight = length;
+    if (ring_port->transmit(&ring[offset], (uint16_t)length)) {
+        stats.transfers++;
+    } else {
+        in_flight = 0;
+        stats.stalls++;
+    }
+}
@@ -0,0 +1,80 @@
+/**
+ *
+ * Microvisor UART Ring Helper
+ * Version 1.0.0
+ * Copyright © 2023, Twilio
+ * Licence: Apache 2.0
+ *
+ */
+
+/* A transmit ring for the logging UART.
+ *
+ * uart_ring_write() copies a message into the ring, with each NEWLINE
+ * expanded to RETURN+NEWLINE, and returns at once.  The ring is sent a
+ * contiguous run at a time through a UartRingPort, which starts each
+ * transfer and calls uart_ring_transmitted() from its interrupt once the
+ * transfer is done; uart_logging.c provides the port for USART2.  Nothing
+ * here touches the HAL, so a fake port can drive the ring on a host.
+ *
+ * A message that does not fit in the free space is dropped whole, so the
+ * UART never shows part of a line, and counted.  If the port will not start a
+ * transfer, the bytes stay queued until the next write or uart_ring_resume().
+ */
+#ifndef UART_RING_HELPER_H
+#define UART_RING_HELPER_H
+
+/*
+ * INCLUDES
+ */
+#include <stdint.h>
+#include <stdbool.h>
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * DEFINES
+ */
+#define UART_RING_SIZE 2048             // Must be a power of two
+
+
+/*
+ * TYPES
+ */
+struct UartRingPort {
+    // Start sending length bytes from data; false if the transfer could not start
+    bool (*transmit)(const uint8_t *data, uint16_t length);
+    // Hold off the port's interrupt, and any other writer, until unlock()
+    uint32_t (*lock)(void);
+    void (*unlock)(uint32_t state);
+};
+
+struct UartRingStats {
+    uint32_t messages;              // queued
+    uint32_t dropped;               // messages that did not fit
+    uint32_t queued_bytes;          // after NEWLINE expansion
+    uint32_t sent_bytes;
+    uint32_t transfers;
+    uint32_t stalls;                // transfers the port would not start
+    uint32_t high_water;            // most bytes the ring has held
+};
+
+
+/*
+ * PROTOTYPES
+ */
+void uart_ring_init(const struct UartRingPort *port);
+bool uart_ring_write(const uint8_t *text, uint32_t length);
+void uart_ring_transmitted(void);
+bool uart_ring_resume(void);
+bool uart_ring_is_empty(void);
+void uart_ring_get_stats(struct UartRingStats *out);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* UART_RING_HELPER_H */
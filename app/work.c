@@ -12,12 +12,27 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 
 #include "log_helper.h"
 #include "network_helper.h"
 #include "config_handler.h"
 #include "mqtt_handler.h"
 #include "application.h"
+#include "dedup_helper.h"
+#include "rpc_handler.h"
+#include "reconnect_helper.h"
+#include "timing_helper.h"
+#include "broker_selector.h"
+#include "duty_cycle_helper.h"
+#include "command_handler.h"
+#include "channel_buffer_helper.h"
+#include "link_quality_helper.h"
+#include "config_cache_helper.h"
+#include "tunables_helper.h"
+#include "uart_ring_helper.h"
+
+#define LOG_MODULE LOG_MODULE_WORK
 
 
 /*
@@ -28,11 +43,51 @@
 // which the HAL calls.
 #define WORK_NOTIFICATION_IRQ TIM8_BRK_IRQn
 
+// How often pending RPC requests are checked for timeouts
+#define RPC_POLL_INTERVAL_MS 250
+
+// Retry backoff ceilings, see reconnect_helper.h
+#define BROKER_RECONNECT_BASE_MS 1000
+#define BROKER_RECONNECT_CAP_MS (5*60*1000)
+#define CONFIG_RETRY_BASE_MS 2000
+#define CONFIG_RETRY_CAP_MS (5*60*1000)
+
+// Failed fetches in a row before connecting with the last known good config
+// instead.  With none yet, the fetch keeps retrying at the capped backoff.
+#define CONFIG_RETRY_LIMIT 4
+
+// How often config is fetched again in the background once connected; 0 to
+// only refresh when asked to over rpc
+#define CONFIG_REFRESH_INTERVAL_MS (60*60*1000)
+
 /*
  * FORWARD DECLARATIONS
  */
 static void configure_work_notification_center();
 static bool get_mqtt_message();
+static void dispatch_mqtt_message();
+static void record_command_latency(struct CommandLatencyStats *stats);
+static void configure_rpc();
+static void rpc_poll_timer_callback(void *argument);
+static void on_mqtt_operational();
+static void configure_brokers();
+static bool commands_active();
+static void acknowledge_message();
+static void config_refresh_timer_callback(void *argument);
+static void broker_connect_timer_callback(void *argument);
+#if defined(COMMAND_CHANNEL)
+static void command_connect_timer_callback(void *argument);
+#endif
+static void apply_config_refresh();
+static void disconnect_for_config();
+static struct ConfigValues *config_staging();
+static void fetch_config();
+static void commit_config();
+#if defined(DUTY_CYCLE)
+static void wake_radio(bool early);
+static void finish_sleep();
+static void flush_samples();
+#endif
 
 /*
  * STORAGE
@@ -43,222 +98,133 @@ static volatile struct MvNotification work_notification_buffer[WORK_NOTIFICATION
 static volatile uint32_t current_work_notification_index = 0;
 MvNotificationHandle  work_notification_center_handle = 0;
 
-uint8_t work_send_buffer[BUF_SEND_SIZE] __attribute__ ((aligned(512))); // shared by config and mqtt as only one is active at a time
-uint8_t work_receive_buffer[BUF_RECEIVE_SIZE] __attribute__ ((aligned(512))); // shared by config and mqtt as only one is active at a time
 
 bool application_processing_message = false;
 static uint32_t correlation_id = 0;
 static bool mqtt_message_pending = false;
 static bool mqtt_connection_active = false;
 static bool wait_for_config = false;
+static bool config_obtained = false;
+static bool config_refreshing = false;
+static bool config_from_cache = false;   // not yet revalidated by a fetch
+static bool booted_from_cache = false;
+static osTimerId_t config_refresh_timer = NULL;
+static struct ConfigRefreshStats config_refresh_stats = {0};
+static uint32_t config_failures_in_row = 0;
+static uint64_t config_failed_microsec = 0;
+static struct ConfigRecoveryStats config_recovery = {0};
+static uint64_t message_received_microsec = 0;
+static uint64_t pending_message_microsec = 0;   // arrival of the message waiting on mqtt_message_pending
+static struct CommandLatencyStats urgent_latency = {0};
+static struct CommandLatencyStats queued_latency = {0};
+static osTimerId_t rpc_poll_timer = NULL;
+static osTimerId_t broker_connect_timer = NULL;
+
+// Set once our subscriptions have been acknowledged during this boot; a broker
+// session from before that may hold a different (older firmware's) set
+static bool subscribed_this_boot = false;
+static uint32_t session_resumed_connects = 0;
+static uint32_t subscribed_connects = 0;
+
+static struct ReconnectScheduler broker_reconnect;
+static struct ReconnectScheduler config_retry;
+
+#if defined(COMMAND_CHANNEL)
+static bool command_connection_active = false;
+static bool command_subscribed_this_boot = false;
+static struct ReconnectScheduler command_reconnect;
+static osTimerId_t command_connect_timer = NULL;
+#endif
+
+#if defined(DUTY_CYCLE)
+enum RadioState {
+    RADIO_AWAKE,        // network wanted, connecting or uploading
+    RADIO_SLEEPING,     // disconnecting from the broker before releasing the network
+    RADIO_ASLEEP        // network released, samples held until the next wake
+};
+
+// Boot counts as the first wake
+static enum RadioState radio_state = RADIO_AWAKE;
+static bool sample_in_flight = false;
+// A sample that should wake the radio came while it was going to sleep
+static bool wake_after_sleep = false;
+#endif
 
 uint8_t *incoming_message_topic;
 uint32_t incoming_message_topic_len;
 uint8_t *incoming_message_payload;
 uint32_t incoming_message_payload_len;
+static uint32_t incoming_message_qos = 0;
 
 // CONFIG DATA
 
 uint8_t  client[BUF_CLIENT_SIZE];
 size_t   client_len;
 
-uint8_t  broker_host[BUF_BROKER_HOST] = {0};
-size_t   broker_host_len = 0;
-uint16_t broker_port = 0;
-
-#if defined(CERTIFICATE_CA)
-uint8_t  root_ca[BUF_ROOT_CA] = {0};
-size_t   root_ca_len = 0;
-#endif // CERTIFICATE_CA
-
-#if defined(CERTIFICATE_AUTH)
-uint8_t  cert[BUF_CERT] = {0};
-size_t   cert_len = 0;
-uint8_t  private_key[BUF_PRIVATE_KEY] = {0};
-size_t   private_key_len = 0;
-#endif // CERTIFICATE_AUTH
-
-#if defined(USERNAMEPASSWORD_AUTH)
-uint8_t  username[BUF_USERNAME] = {0};
-size_t   username_len = 0;
-uint8_t  password[BUF_PASSWORD] = {0};
-size_t   password_len = 0;
-#endif // USERNAMEPASSWORD_AUTH
-
-struct ConfigHelperItem config_items[] = {
-    /*
-     * Broker host name or ip address
-     *
-     * Store:       CONFIG
-     * Store Scope: DEVICE
-     * Store Key:   broker-host
-     */
-    {
-        .config_type = CONFIG_ITEM_TYPE_UINT8,
-        .item = {
-            .scope = MV_CONFIGKEYFETCHSCOPE_DEVICE,
-            .store = MV_CONFIGKEYFETCHSTORE_CONFIG,
-            STRING_ITEM(key, "broker-host"),
-        },
-        .u8_item = {
-            .buf = (uint8_t*)broker_host,
-            .buf_size = BUF_BROKER_HOST,
-            .buf_len = &broker_host_len
-        }
-    },
+// Two generations of the items in config_schema.h: the live one readers
+// snapshot, and the one being fetched into
+static struct ConfigValues config_generations[2];
+const struct ConfigValues *volatile config_live = &config_generations[0];
 
-    /*
-     * Broker port
-     *
-     * Store:       CONFIG
-     * Store Scope: DEVICE
-     * Store Key:   broker-port
-     */
-    {
-        .config_type = CONFIG_ITEM_TYPE_ULONG,
-        .item = {
-            .scope = MV_CONFIGKEYFETCHSCOPE_DEVICE,
-            .store = MV_CONFIGKEYFETCHSTORE_CONFIG,
-            STRING_ITEM(key, "broker-port"),
-        },
-        .ulong_item = {
-            .val = &broker_port
-        }
+// The fetch table, one entry per item in config_schema.h
+#define CONFIG_ITEM_BUFFER(name, store_key, store_name, type, size, reconnect) \
+    { \
+        .config_type = CONFIG_ITEM_TYPE_##type, \
+        .needs_reconnect = reconnect, \
+        .item = { \
+            .scope = MV_CONFIGKEYFETCHSCOPE_DEVICE, \
+            .store = MV_CONFIGKEYFETCHSTORE_##store_name, \
+            STRING_ITEM(key, store_key), \
+        }, \
+        .u8_item = { \
+            .buf_offset = offsetof(struct ConfigValues, name), \
+            .buf_size = sizeof(((struct ConfigValues *)0)->name), \
+            .len_offset = offsetof(struct ConfigValues, name##_len) \
+        } \
     },
-
-    /*
-     * Defining CUSTOM_CLIENT_ID allows you to specify the MQTT client id via a
-     * configuration value instead of the Microvisor device identifier.
-     *
-     * Store:       CONFIG
-     * Store Scope: DEVICE
-     * Store Key:   client-id
-     */
-#if defined(CUSTOM_CLIENT_ID)
-    {
-        .config_type = CONFIG_ITEM_TYPE_UINT8,
-        .item = {
-            .scope = MV_CONFIGKEYFETCHSCOPE_DEVICE,
-            .store = MV_CONFIGKEYFETCHSTORE_CONFIG,
-            STRING_ITEM(key, "client-id"),
-        },
-        .u8_item = {
-            .buf = (uint8_t*)client,
-            .buf_size = BUF_CLIENT_SIZE,
-            .buf_len = &client_len
-        }
-    },
-#endif // CUSTOM_CLIENT_ID
-
-    /*
-     * Defining CERTIFICATE_CA allows you to specify certificate
-     * details for CA validation.
-     *
-     * Store:       CONFIG
-     * Store Scope: DEVICE
-     * Store Key:   root-CA
-     */
-#if defined(CERTIFICATE_CA)
-    {
-        .config_type = CONFIG_ITEM_TYPE_B64,
-        .item = {
-            .scope = MV_CONFIGKEYFETCHSCOPE_DEVICE,
-            .store = MV_CONFIGKEYFETCHSTORE_CONFIG,
-            STRING_ITEM(key, "root-CA"),
-        },
-        .u8_item = {
-            .buf = (uint8_t*)root_ca,
-            .buf_size = BUF_ROOT_CA,
-            .buf_len = &root_ca_len
-        }
+#define CONFIG_ITEM_NUMBER(name, store_key, store_name, ctype, lo, hi, reconnect) \
+    { \
+        .config_type = (ctype)-1 < 0 ? CONFIG_ITEM_TYPE_LONG : CONFIG_ITEM_TYPE_ULONG, \
+        .needs_reconnect = reconnect, \
+        .item = { \
+            .scope = MV_CONFIGKEYFETCHSCOPE_DEVICE, \
+            .store = MV_CONFIGKEYFETCHSTORE_##store_name, \
+            STRING_ITEM(key, store_key), \
+        }, \
+        .number_item = { \
+            .val_offset = offsetof(struct ConfigValues, name), \
+            .size = sizeof(ctype), \
+            .min = lo, \
+            .max = hi \
+        } \
     },
-#endif // CERTIFICATE_CA
-
-    /*
-     * Defining CERTIFICATE_AUTH allows you to specify certificate
-     * details for authentication.
-     *
-     * Store:       CONFIG
-     * Store Scope: DEVICE
-     * Store Key:   cert
-     *
-     * Store:       SECRET
-     * Store Scope: DEVICE
-     * Store Key:   private_key
-     */
-#if defined(CERTIFICATE_AUTH)
-    {
-        .config_type = CONFIG_ITEM_TYPE_B64,
-        .item = {
-            .scope = MV_CONFIGKEYFETCHSCOPE_DEVICE,
-            .store = MV_CONFIGKEYFETCHSTORE_CONFIG,
-            STRING_ITEM(key, "cert"),
-        },
-        .u8_item = {
-            .buf = (uint8_t*)cert,
-            .buf_size = BUF_CERT,
-            .buf_len = &cert_len
-        }
-    },
-    {
-        .config_type = CONFIG_ITEM_TYPE_B64,
-        .item = {
-            .scope = MV_CONFIGKEYFETCHSCOPE_DEVICE,
-            .store = MV_CONFIGKEYFETCHSTORE_SECRET,
-            STRING_ITEM(key, "private_key"),
-        },
-        .u8_item = {
-            .buf = (uint8_t*)private_key,
-            .buf_size = BUF_PRIVATE_KEY,
-            .buf_len = &private_key_len
-        }
-    },
-#endif // CERTIFICATE_AUTH
-
-    /*
-     * Defining USERNAMEPASSWORD_AUTH allows you to specify username/password
-     * details for authentication.
-     *
-     * Store:       CONFIG
-     * Store Scope: DEVICE
-     * Store Key:   username
-     *
-     * Store:       CONFIG
-     * Store Scope: DEVICE
-     * Store Key:   password
-     */
-#if defined(USERNAMEPASSWORD_AUTH)
-    {
-        .config_type = CONFIG_ITEM_TYPE_UINT8,
-        .item = {
-            .scope = MV_CONFIGKEYFETCHSCOPE_DEVICE,
-            .store = MV_CONFIGKEYFETCHSTORE_CONFIG,
-            STRING_ITEM(key, "username"),
-        },
-        .u8_item = {
-            .buf = (uint8_t*)username,
-            .buf_size = BUF_USERNAME,
-            .buf_len = &username_len
-        }
-    },
-    {
-        .config_type = CONFIG_ITEM_TYPE_UINT8,
-        .item = {
-            .scope = MV_CONFIGKEYFETCHSCOPE_DEVICE,
-            .store = MV_CONFIGKEYFETCHSTORE_SECRET,
-            STRING_ITEM(key, "password"),
-        },
-        .u8_item = {
-            .buf = (uint8_t*)password,
-            .buf_size = BUF_PASSWORD,
-            .buf_len = &password_len
-        }
-    },
-#endif // USERNAMEPASSWORD_AUTH
 
+const struct ConfigHelperItem config_items[] = {
+    CONFIG_SCHEMA(CONFIG_ITEM_BUFFER, CONFIG_ITEM_NUMBER)
 };
 
-uint8_t num_items = sizeof(config_items)/sizeof(struct ConfigHelperItem);
+const uint8_t num_items = CONFIG_SCHEMA_ITEMS;
+
+// Schema mistakes fail the build rather than the fetch
+#define CONFIG_CHECK_BUFFER(name, store_key, store, type, size, reconnect) \
+    _Static_assert((size) > 0 && (size) <= UINT16_MAX && CONFIG_ENCODED_SIZE_##type(size) <= UINT16_MAX, \
+                   "config item " #name " must hold 1 to 65535 bytes");
+#define CONFIG_CHECK_NUMBER(name, store_key, store, ctype, min, max, reconnect) \
+    _Static_assert(sizeof(ctype) <= sizeof(uint32_t), "config item " #name " is wider than 32 bits"); \
+    _Static_assert((min) <= (max) && ((min) >= 0 || (ctype)-1 < 0) \
+                   && (ctype)(min) == (min) && (ctype)(max) == (max), \
+                   "config item " #name " range does not fit " #ctype);
+
+CONFIG_SCHEMA(CONFIG_CHECK_BUFFER, CONFIG_CHECK_NUMBER)
+_Static_assert(CONFIG_SCHEMA_ITEMS <= CONFIG_MAX_ITEMS, "too many config items");
+
+#if defined(CONFIG_CACHE)
+// Cached items are stored decoded, each with its key, type and length
+#define CONFIG_CACHE_BYTES_BUFFER(name, store_key, store, type, size, reconnect) + 4 + sizeof(store_key) - 1 + (size)
+#define CONFIG_CACHE_BYTES_NUMBER(name, store_key, store, ctype, min, max, reconnect) + 4 + sizeof(store_key) - 1 + sizeof(ctype)
+_Static_assert(0 CONFIG_SCHEMA(CONFIG_CACHE_BYTES_BUFFER, CONFIG_CACHE_BYTES_NUMBER) <= FLASH_PAGE_SIZE - 16,
+               "config items do not fit the config cache page");
+#endif
 
 /**
  * @brief Push message into work queue.
@@ -280,6 +246,8 @@ void pushWorkMessage(enum WorkMessageType type) {
 void start_work_task(void *argument) {
     bool network_on = false;
     
+    timing_begin(CONNECT_KIND_BOOT);
+
     configure_work_notification_center();
 
     workMessageQueue = osMessageQueueNew(16, sizeof(enum WorkMessageType), NULL);
@@ -288,6 +256,44 @@ void start_work_task(void *argument) {
         return;
     }
 
+    configure_rpc();
+
+    reconnect_init(&broker_reconnect, ConnectMQTTBroker, BROKER_RECONNECT_BASE_MS, BROKER_RECONNECT_CAP_MS);
+    reconnect_init(&config_retry, PopulateConfig, CONFIG_RETRY_BASE_MS, CONFIG_RETRY_CAP_MS);
+
+    config_refresh_timer = osTimerNew(config_refresh_timer_callback, osTimerPeriodic, NULL, NULL);
+    assert(config_refresh_timer != NULL);
+
+    broker_connect_timer = osTimerNew(broker_connect_timer_callback, osTimerOnce, NULL, NULL);
+    assert(broker_connect_timer != NULL);
+
+#if defined(CONFIG_CACHE)
+#if !defined(CUSTOM_CLIENT_ID)
+    mvGetDeviceId(client, BUF_CLIENT_SIZE);
+    client_len = BUF_CLIENT_SIZE;
+#endif
+    if (config_cache_load(config_items, num_items, config_staging())) {
+        commit_config();
+        configure_brokers();
+        config_obtained = true;
+        config_from_cache = true;
+        booted_from_cache = true;
+        if (CONFIG_REFRESH_INTERVAL_MS != 0) {
+            osTimerStart(config_refresh_timer, CONFIG_REFRESH_INTERVAL_MS);
+        }
+    }
+#endif
+#if defined(COMMAND_CHANNEL)
+    reconnect_init(&command_reconnect, ConnectCommandChannel, BROKER_RECONNECT_BASE_MS, BROKER_RECONNECT_CAP_MS);
+    command_connect_timer = osTimerNew(command_connect_timer_callback, osTimerOnce, NULL, NULL);
+    assert(command_connect_timer != NULL);
+#endif
+
+#if defined(DUTY_CYCLE)
+    duty_cycle_init();
+    duty_cycle_woke(false, 0);
+#endif
+
     pushWorkMessage(ConnectNetwork);
     
     enum WorkMessageType messageType;
@@ -298,91 +304,221 @@ void start_work_task(void *argument) {
         if (osMessageQueueGet(workMessageQueue, &messageType, NULL, osWaitForever) == osOK) {
             switch (messageType) {
                 case ConnectNetwork:
-                    want_network = true;
+                    set_want_network(true);
                     break;
                 case OnNetworkConnected:
                     network_on = true;
+                    link_quality_network_up();
+                    if (!timing_is_open()) {
+                        timing_begin(CONNECT_KIND_NETWORK);
+                    }
+                    timing_mark(CONNECT_PHASE_NETWORK_UP);
+#if defined(DUTY_CYCLE) || defined(CONFIG_CACHE)
+                    if (config_obtained) {
+                        // Config does not change between wakes, or reconnects, often enough to
+                        // wait on fetching it every time
+                        pushWorkMessage(ConnectMQTTBroker);
+#if defined(COMMAND_CHANNEL)
+                        pushWorkMessage(ConnectCommandChannel);
+#endif
+                        if (config_from_cache) {
+                            // Check the cached config is still current once, in the background
+                            pushWorkMessage(RefreshConfig);
+                        }
+                        break;
+                    }
+#endif
                     pushWorkMessage(PopulateConfig);
                     break;
                 case OnNetworkDisconnected:
                     network_on = false;
+#if defined(DUTY_CYCLE)
+                    link_quality_network_down(radio_state == RADIO_ASLEEP);
+#else
+                    link_quality_network_down(false);
+#endif
+                    // Everything restarts from PopulateConfig once the network is back
+                    reconnect_cancel(&config_retry);
+                    reconnect_cancel(&broker_reconnect);
+                    osTimerStop(broker_connect_timer);
+                    mqtt_abandon_connect("network lost", false);
+#if defined(COMMAND_CHANNEL)
+                    reconnect_cancel(&command_reconnect);
+                    osTimerStop(command_connect_timer);
+#endif
                     break;
                 case PopulateConfig:
+                    if (wait_for_config) {
+                        // A refresh is already fetching; let it complete as the full fetch
+                        config_refreshing = false;
+                        break;
+                    }
                     wait_for_config = true;
 #if !defined(CUSTOM_CLIENT_ID)
                     mvGetDeviceId(client, BUF_CLIENT_SIZE);
                     client_len = BUF_CLIENT_SIZE;
 #endif
-#if defined(WORK_DEBUGGING)
-                    server_log("starting config fetch");
-#endif
-                    start_configuration_fetch(config_items, num_items);
+                    server_trace("starting config fetch");
+                    fetch_config();
                     break;
                 case OnConfigRequestReturn:
-#if defined(WORK_DEBUGGING)
-                    server_log("config returned");
-#endif
-                    wait_for_config = false;
-                    receive_configuration_items(config_items, num_items);
+                    server_trace("config returned");
+                    // Still waiting: with CONFIG_DELTA the response may trigger a second request
+                    timing_mark(CONNECT_PHASE_CONFIG_RECEIVED);
+                    receive_configuration_items(config_items, num_items, config_live, config_staging());
                     break;
                 case OnConfigObtained:
-#if defined(WORK_DEBUGGING)
-                    server_log("config obtained");
-#endif
+                    server_trace("config obtained");
+                    wait_for_config = false;
                     finish_configuration_fetch();
+                    config_from_cache = false;
+                    server_trace("work task stack: %lu bytes never used", osThreadGetStackSpace(osThreadGetId()));
+                    if (configuration_changed_items() != 0) {
+                        commit_config();
+#if defined(CONFIG_CACHE)
+                        config_cache_save(config_items, num_items, config_live);
+#endif
+                    }
+                    if (config_refreshing) {
+                        config_refreshing = false;
+                        apply_config_refresh();
+                        break;
+                    }
+                    timing_mark(CONNECT_PHASE_CONFIG_OBTAINED);
+                    configure_brokers();
+                    reconnect_succeeded(&config_retry);
+                    config_failures_in_row = 0;
+                    if (!config_obtained && CONFIG_REFRESH_INTERVAL_MS != 0) {
+                        osTimerStart(config_refresh_timer, CONFIG_REFRESH_INTERVAL_MS);
+                    }
+                    config_obtained = true;
                     pushWorkMessage(ConnectMQTTBroker);
+#if defined(COMMAND_CHANNEL)
+                    // Queued after the main connect so it follows the same broker endpoint
+                    pushWorkMessage(ConnectCommandChannel);
+#endif
                     break;
                 case OnConfigFailed:
-                    server_error("we failed to obtain the needed configuration");
                     wait_for_config = false;
                     finish_configuration_fetch();
+                    if (config_refreshing) {
+                        // The live config is intact; the next refresh tries again
+                        config_refreshing = false;
+                        config_refresh_stats.failed++;
+                        server_error("config refresh failed, keeping current configuration");
+                        break;
+                    }
+                    server_error("we failed to obtain the needed configuration");
+                    config_recovery.failures++;
+                    config_failures_in_row++;
+                    if (config_failed_microsec == 0) {
+                        mvGetMicroseconds(&config_failed_microsec);
+                    }
+                    if (!network_on) {
+                        break;
+                    }
+                    if (config_obtained && config_failures_in_row >= CONFIG_RETRY_LIMIT) {
+                        // Carry on with the config we already have; the periodic refresh picks up any change later
+                        server_log("config fetch failed %lu times, connecting with last known good config", config_failures_in_row);
+                        config_failures_in_row = 0;
+                        config_recovery.fallbacks++;
+                        pushWorkMessage(ConnectMQTTBroker);
+#if defined(COMMAND_CHANNEL)
+                        pushWorkMessage(ConnectCommandChannel);
+#endif
+                        break;
+                    }
+                    server_log("retrying config fetch in %lu ms", reconnect_schedule(&config_retry));
+                    break;
+                case RefreshConfig:
+                    config_refresh_stats.requested++;
+                    if (!network_on || !config_obtained || wait_for_config) {
+                        config_refresh_stats.skipped++;
+                        break;
+                    }
+                    server_trace("refreshing config");
+                    wait_for_config = true;
+                    config_refreshing = true;
+                    fetch_config();
                     break;
                 case ConnectMQTTBroker:
-#if defined(WORK_DEBUGGING)
-                    server_log("connecting broker");
-#endif
+                    server_trace("connecting broker");
+                    if (!timing_is_open()) {
+                        timing_begin(CONNECT_KIND_BROKER);
+                    }
                     start_mqtt_connect();
+                    if (mqtt_is_connecting()) {
+                        osTimerStart(broker_connect_timer, MQTT_CONNECT_TIMEOUT_MS);
+                    }
+                    break;
+                case OnBrokerConnectTimeout:
+                    // Without the network, the endpoint never had a chance to answer
+                    mqtt_abandon_connect("no connect response", network_on);
+                    break;
+                case OnBrokerConnectDropped:
+                    mqtt_abandon_connect("channel closed", false);
                     break;
                 case OnBrokerConnected:
-#if defined(WORK_DEBUGGING)
-                    server_log("broker connected");
-#endif
+                    server_trace("broker connected");
+                    osTimerStop(broker_connect_timer);
                     mqtt_connection_active = true;
-                    start_subscriptions();
+#if defined(COMMAND_CHANNEL)
+                    // Subscriptions live on the command channel, this connection only publishes
+                    on_mqtt_operational();
+#else
+                    if (subscribed_this_boot && is_session_present()) {
+                        // The broker kept our session and its subscriptions, no need to wait on a SUBACK
+                        session_resumed_connects++;
+                        server_trace("session resumed, skipping subscribe (%lu times)", session_resumed_connects);
+                        on_mqtt_operational();
+                    } else {
+                        start_subscriptions();
+                    }
+#endif
                     break;
                 case OnBrokerSubscribeSucceeded:
-#if defined(WORK_DEBUGGING)
-                    server_log("topics subscribed");
-#endif
-                    pushApplicationMessage(OnMqttConnected);
+                    server_trace("topics subscribed");
+                    subscribed_this_boot = true;
+                    subscribed_connects++;
+                    on_mqtt_operational();
                     break;
                 case OnBrokerSubscribeFailed:
                     server_error("subscription failed");
-                    mqtt_disconnect();
+                    mqtt_disconnect_on_error();
                     break;
                 case OnBrokerUnsubscribeSucceeded:
                     break;
                 case OnBrokerUnsubscribeFailed:
                     server_error("unsubscription failed");
-                    mqtt_disconnect();
+                    mqtt_disconnect_on_error();
                     break;
                 case OnBrokerPublishSucceeded:
-#if defined(WORK_DEBUGGING)
-                    server_log("publish succeeded");
+                    server_trace("publish succeeded");
+                    break;
+                case OnBrokerApplicationPublishSucceeded:
+                    server_trace("application publish succeeded");
+                    timing_mark(CONNECT_PHASE_FIRST_PUBLISH);
+#if defined(DUTY_CYCLE)
+                    if (sample_in_flight) {
+                        sample_in_flight = false;
+                        duty_cycle_sample_sent();
+                        flush_samples();
+                    }
 #endif
                     break;
                 case OnBrokerPublishFailed:
                     server_error("publish failed");
-                    mqtt_disconnect();
+                    mqtt_disconnect_on_error();
                     break;
                 case OnBrokerPublishRateLimited:
                     server_error("publish was rate limited");
                     break;
                 case OnBrokerMessageAcknowledgeFailed:
                     server_error("message acknowledgement failed");
-                    mqtt_disconnect();
+                    mqtt_disconnect_on_error();
                     break;
                 case OnBrokerConnectFailed:
+                    osTimerStop(broker_connect_timer);
                     server_error("broker connect failed - cleaning up mqtt broker...");
                     teardown_mqtt_connect();
                     break;
@@ -394,99 +530,222 @@ void start_work_task(void *argument) {
                 case OnBrokerDisconnected:
                     mqtt_connection_active = false;
                     pushApplicationMessage(OnMqttDisconnected);
-                    if (network_on) {
-                        server_log("reconnect to mqtt broker");
-                        pushWorkMessage(ConnectMQTTBroker);
+#if defined(DUTY_CYCLE)
+                    // Anything unacknowledged is sent again on the next connection
+                    sample_in_flight = false;
+                    if (radio_state == RADIO_SLEEPING) {
+                        finish_sleep();
+                        break;
+                    }
+#endif
+                    if (network_on && config_obtained) {
+                        server_log("reconnect to mqtt broker in %lu ms", reconnect_schedule(&broker_reconnect));
                     }
                     break;
                 case OnBrokerDroppedConnection:
                     mqtt_connection_active = false;
                     teardown_mqtt_connect();
-#if defined(WORK_DEBUGGING)
-                    server_log("mqtt channel closed by server");
-#endif
+                    server_trace("mqtt channel closed by server");
                     break;
                 case OnMQTTReadable:
                     mqtt_handle_readable_event();
                     break;
                 case OnMQTTEventConnectResponse:
-#if defined(WORK_DEBUGGING)
-                    server_log("received mqtt connect response");
-#endif
+                    server_trace("received mqtt connect response");
                     mqtt_handle_connect_response_event();
                     break;
                 case OnMQTTEventMessageReceived:
+                    // Latency is timed from arrival, so it includes any wait behind the previous message
                     if (application_processing_message) {
+                        if (!mqtt_message_pending) {
+                            mvGetMicroseconds(&pending_message_microsec);
+                        }
                         mqtt_message_pending = true;
                     } else {
-                        application_processing_message = false;
-                        if(!get_mqtt_message()) {
-                            server_error("reading mqtt message failed");
-                            mqtt_disconnect();
-                        } else {
-                            pushApplicationMessage(OnIncomingMqttMessage);
-                        }
+                        mvGetMicroseconds(&message_received_microsec);
+                        dispatch_mqtt_message();
                     }
                     break;
                 case OnMQTTEventMessageLost:
                     if (!mqtt_handle_lost_message_data()) {
                         server_error("handling lost mqtt message failed");
-                        mqtt_disconnect();
+                        mqtt_disconnect_on_error();
                     }
                     break;
                 case OnMQTTEventSubscribeResponse:
-#if defined(WORK_DEBUGGING)
-                    server_log("received mqtt subscribe response");
-#endif
+                    server_trace("received mqtt subscribe response");
                     mqtt_handle_subscribe_response_event();
                     break;
                 case OnMQTTEventUnsubscribeResponse:
-#if defined(WORK_DEBUGGING)
-                    server_log("received mqtt unsubscribe response");
-#endif
+                    server_trace("received mqtt unsubscribe response");
                     mqtt_handle_unsubscribe_response_event();
                     break;
                 case OnMQTTEventPublishResponse:
-#if defined(WORK_DEBUGGING)
-                    server_log("received mqtt publish response");
-#endif
+                    server_trace("received mqtt publish response");
                     mqtt_handle_publish_response_event();
                     break;
                 case OnMQTTEventDisconnectResponse:
-#if defined(WORK_DEBUGGING)
-                    server_log("received mqtt disconnect response");
-#endif
+                    server_trace("received mqtt disconnect response");
                     teardown_mqtt_connect();
                     break;
                 case OnApplicationConsumedMessage:
-#if defined(WORK_DEBUGGING)
-                    server_log("application consumed message");
-#endif
+                    server_trace("application consumed message");
                     if(application_processing_message) {
-                        mqtt_acknowledge_message(correlation_id);
+                        if (message_received_microsec != 0) {
+                            record_command_latency(&queued_latency);
+                        }
+                        acknowledge_message();
+                        application_processing_message = false;
 
                         if (mqtt_message_pending) {
                             mqtt_message_pending = false;
-                            if(!get_mqtt_message()) {
-                                server_error("reading mqtt message failed");
-                                mqtt_disconnect();
-                            } else {
-                                pushApplicationMessage(OnIncomingMqttMessage);
-                            }
-                        } else {
-                            application_processing_message = false;
-                     }
+                            message_received_microsec = pending_message_microsec;
+                            dispatch_mqtt_message();
+                        }
                     }
                   break;
 
                 case OnApplicationProducedMessage:
-#if defined(WORK_DEBUGGING)
-                    server_log("application produced message, publishing");
-#endif
+                case OnApplicationProducedUrgentMessage:
+#if defined(DUTY_CYCLE)
+                  if (duty_cycle_add_sample(application_message_payload, messageType == OnApplicationProducedUrgentMessage)) {
+                      if (radio_state == RADIO_ASLEEP) {
+                          wake_radio(true);
+                      } else if (radio_state == RADIO_SLEEPING) {
+                          // The connections are closing; wake again once they have
+                          wake_after_sleep = true;
+                      }
+                  }
+                  flush_samples();
+#else
+                    server_trace("application produced message, publishing");
                   publish_message(application_message_payload);
+#endif
                   pushApplicationMessage(OnMqttMessageSent);
                   break;
 
+                case OnRpcPollTimer:
+                    // Leave pending requests alone while there is no broker to answer them through
+                    if (commands_active() && rpc_poll() == 0) {
+                        osTimerStop(rpc_poll_timer);
+                    }
+                    break;
+
+#if defined(COMMAND_CHANNEL)
+                case ConnectCommandChannel:
+                    server_trace("connecting command channel");
+                    command_connect();
+                    if (command_is_connecting()) {
+                        osTimerStart(command_connect_timer, MQTT_CONNECT_TIMEOUT_MS);
+                    }
+                    break;
+                case OnCommandChannelConnectTimeout:
+                    command_abandon_connect("no connect response");
+                    break;
+                case OnCommandChannelConnectDropped:
+                    command_abandon_connect("channel closed");
+                    break;
+                case OnCommandChannelReadable:
+                    command_handle_readable_event();
+                    break;
+                case OnCommandChannelConnected:
+                    osTimerStop(command_connect_timer);
+                    command_connection_active = true;
+                    if (command_subscribed_this_boot && command_is_session_present()) {
+                        session_resumed_connects++;
+                        reconnect_succeeded(&command_reconnect);
+                    } else {
+                        command_subscribe();
+                    }
+                    break;
+                case OnCommandChannelSubscribed:
+                    server_trace("command topics subscribed");
+                    command_subscribed_this_boot = true;
+                    subscribed_connects++;
+                    reconnect_succeeded(&command_reconnect);
+                    break;
+                case OnCommandChannelConnectFailed:
+                    osTimerStop(command_connect_timer);
+                    command_teardown();
+                    break;
+                case OnCommandChannelFailed:
+                    server_error("command channel failed, disconnecting");
+                    command_disconnect();
+                    break;
+                case OnCommandChannelDropped:
+                    command_connection_active = false;
+                    command_teardown();
+                    break;
+                case OnCommandChannelDisconnected:
+                    command_connection_active = false;
+#if defined(DUTY_CYCLE)
+                    if (radio_state == RADIO_SLEEPING) {
+                        finish_sleep();
+                        break;
+                    }
+#endif
+                    if (network_on && config_obtained) {
+                        server_log("reconnect command channel in %lu ms", reconnect_schedule(&command_reconnect));
+                    }
+                    break;
+#endif
+
+#if defined(DUTY_CYCLE)
+                case OnDutyCycleWake:
+                    if (radio_state == RADIO_ASLEEP) {
+                        wake_radio(false);
+                    }
+                    break;
+
+                case OnDutyCycleLinger:
+                    if (radio_state != RADIO_AWAKE) {
+                        break;
+                    }
+                    if (sample_in_flight || duty_cycle_pending() != 0 || application_processing_message
+                        || osTimerIsRunning(rpc_poll_timer) || wait_for_config) {
+                        // Still busy, look again later
+                        duty_cycle_activity();
+                        break;
+                    }
+                    if (mqtt_connection_active) {
+                        // Released once the broker confirms, see finish_sleep()
+                        radio_state = RADIO_SLEEPING;
+                        mqtt_disconnect();
+#if defined(COMMAND_CHANNEL)
+                        if (command_connection_active) {
+                            command_disconnect();
+                        }
+#endif
+                    }
+                    break;
+
+                case OnDutyCycleMaxAwake:
+                    if (radio_state == RADIO_ASLEEP) {
+                        break;
+                    }
+                    server_error("radio on for %lu ms, releasing the network", (uint32_t)DUTY_CYCLE_MAX_AWAKE_MS);
+                    duty_cycle_forced_sleep();
+                    radio_state = RADIO_SLEEPING;
+                    sample_in_flight = false;
+                    osTimerStop(broker_connect_timer);
+                    reconnect_cancel(&config_retry);
+                    reconnect_cancel(&broker_reconnect);
+#if defined(COMMAND_CHANNEL)
+                    reconnect_cancel(&command_reconnect);
+                    if (command_connection_active) {
+                        command_teardown();
+                    }
+#endif
+                    // Close the channels without waiting on the broker; their
+                    // Disconnected events release the network, see finish_sleep()
+                    if (mqtt_connection_active || mqtt_is_connecting()) {
+                        mqtt_disconnect_now();
+                    } else {
+                        finish_sleep();
+                    }
+                    break;
+#endif
+
                 default:
                     server_error("received a message we haven't implemented yet: %d", messageType);
                     break;
@@ -521,13 +780,711 @@ void configure_work_notification_center() {
 }
 
 bool get_mqtt_message() {
-    uint32_t _qos;
     uint8_t _retain;
+#if defined(COMMAND_CHANNEL)
+    return command_get_received_message_data(&correlation_id,
+                                             &incoming_message_topic, &incoming_message_topic_len,
+                                             &incoming_message_payload, &incoming_message_payload_len,
+                                             &incoming_message_qos, &_retain);
+#else
     return mqtt_get_received_message_data(&correlation_id,
                                           &incoming_message_topic, &incoming_message_topic_len,
                                           &incoming_message_payload, &incoming_message_payload_len,
-                                          &_qos, &_retain);
- 
+                                          &incoming_message_qos, &_retain);
+#endif
+}
+
+/**
+ * @brief Acknowledge the message last read by get_mqtt_message().
+ */
+static void acknowledge_message() {
+#if defined(COMMAND_CHANNEL)
+    command_acknowledge_message(correlation_id);
+#else
+    mqtt_acknowledge_message(correlation_id);
+#endif
+}
+
+/**
+ * @brief Is the connection carrying commands and rpc requests up?
+ */
+static bool commands_active() {
+#if defined(COMMAND_CHANNEL)
+    return command_connection_active;
+#else
+    return mqtt_connection_active;
+#endif
+}
+
+/**
+ * @brief The broker connection is up and subscribed: tell the application and report how long it took.
+ */
+static void on_mqtt_operational() {
+    reconnect_succeeded(&broker_reconnect);
+
+    if (config_failed_microsec != 0) {
+        uint64_t now = 0;
+        mvGetMicroseconds(&now);
+        uint32_t elapsed = (uint32_t)((now - config_failed_microsec) / 1000);
+        config_recovery.recoveries++;
+        config_recovery.last_ms = elapsed;
+        config_recovery.total_ms += elapsed;
+        if (elapsed > config_recovery.max_ms) {
+            config_recovery.max_ms = elapsed;
+        }
+        config_failed_microsec = 0;
+        server_log("operational %lu ms after config failure", elapsed);
+    }
+    pushApplicationMessage(OnMqttConnected);
+#if defined(DUTY_CYCLE)
+    flush_samples();
+#endif
+
+    struct ConnectRecord record;
+    if (timing_connected(&record)) {
+        char report[256];
+        if (timing_format_record(&record, report, sizeof(report)) < sizeof(report)) {
+            server_log("connect timing: %s", report);
+            publish_metrics("connect", report);
+        }
+    }
+}
+
+#if defined(DUTY_CYCLE)
+/**
+ * @brief Request the network again to upload held samples; OnNetworkConnected takes it from there.
+ *
+ * @param early Woken by the batch rather than the wake timer
+ */
+static void wake_radio(bool early) {
+    server_log("radio on, %lu samples to upload", duty_cycle_pending());
+    radio_state = RADIO_AWAKE;
+    duty_cycle_woke(early, mqtt_bytes_published());
+    set_want_network(true);
+}
+
+/**
+ * @brief Release the network once every broker connection has closed.
+ */
+static void finish_sleep() {
+#if defined(COMMAND_CHANNEL)
+    if (mqtt_connection_active || command_connection_active) {
+        return;
+    }
+#endif
+
+    radio_state = RADIO_ASLEEP;
+    set_want_network(false);
+    duty_cycle_released(mqtt_bytes_published());
+    server_log("radio off, %lu samples held", duty_cycle_pending());
+
+    if (wake_after_sleep) {
+        wake_after_sleep = false;
+        wake_radio(true);
+    }
+}
+
+/**
+ * @brief Publish the next held sample, or start lingering once there are none left.
+ *
+ * Nothing is published while the radio is going to sleep, though the broker
+ * connection may still be up; the samples wait for the next wake.
+ */
+static void flush_samples() {
+    if (sample_in_flight || !mqtt_connection_active || radio_state != RADIO_AWAKE) {
+        return;
+    }
+
+    const char *sample = duty_cycle_next_sample();
+    if (sample == NULL) {
+        duty_cycle_activity();
+        return;
+    }
+
+    server_trace("uploading held sample, %lu waiting", duty_cycle_pending());
+    sample_in_flight = true;
+    publish_message(sample);
+}
+#endif
+
+/**
+ * @brief Rebuild the broker endpoint list from freshly obtained config.
+ *
+ * Endpoints that were already known keep their connect times and health.
+ */
+static void configure_brokers() {
+    const struct ConfigValues *config = config_snapshot();
+    broker_selector_begin_update();
+    size_t len;
+    const uint8_t *host = config_broker_host(config, &len);
+    broker_selector_add(host, len, config_broker_port(config));
+#if defined(BROKER_FAILOVER)
+    const uint8_t *list = config_broker_list(config, &len);
+    broker_selector_add_list(list, len, config_broker_port(config));
+#endif
+    server_trace("%lu broker endpoint(s) configured", broker_selector_count());
+}
+
+static void config_refresh_timer_callback(void *argument) {
+    pushWorkMessage(RefreshConfig);
+}
+
+static void broker_connect_timer_callback(void *argument) {
+    pushWorkMessage(OnBrokerConnectTimeout);
+}
+
+#if defined(COMMAND_CHANNEL)
+static void command_connect_timer_callback(void *argument) {
+    pushWorkMessage(OnCommandChannelConnectTimeout);
+}
+#endif
+
+/**
+ * @brief Act on the items a background refresh changed.
+ *
+ * The endpoint list is rebuilt in place.  A change the broker connection was
+ * made with (host, port, client id or credentials) takes the connections
+ * down; they come back up with the new values through the usual reconnect.
+ */
+static void apply_config_refresh() {
+    uint32_t changed = configuration_changed_items();
+    if (changed == 0) {
+        config_refresh_stats.unchanged++;
+        server_trace("config refreshed, nothing changed");
+        return;
+    }
+
+    bool reconnect = false;
+    for (uint32_t ndx = 0; ndx < num_items; ndx++) {
+        if ((changed & (1UL << ndx)) != 0 && config_items[ndx].needs_reconnect) {
+            reconnect = true;
+        }
+    }
+
+    configure_brokers();
+
+    if (!reconnect) {
+        config_refresh_stats.hot_applied++;
+        server_log("config refreshed, changes applied (0x%08lx)", changed);
+        return;
+    }
+
+    config_refresh_stats.reconnects++;
+    server_log("config refreshed, broker settings changed (0x%08lx), reconnecting", changed);
+    disconnect_for_config();
+}
+
+/**
+ * @brief Take the broker connections down so they come back with the current config.
+ *
+ * With config_obtained clear they stay down until a fetch succeeds.
+ */
+static void disconnect_for_config() {
+    if (mqtt_connection_active) {
+        mqtt_disconnect();
+    }
+    if (!config_obtained) {
+        reconnect_cancel(&broker_reconnect);
+    }
+#if defined(COMMAND_CHANNEL)
+    if (command_connection_active) {
+        command_disconnect();
+    }
+    if (!config_obtained) {
+        reconnect_cancel(&command_reconnect);
+    }
+#endif
+}
+
+/**
+ * @brief The generation of config values not live, for a fetch or cache load to fill.
+ */
+static struct ConfigValues *config_staging() {
+    return config_live == &config_generations[0] ? &config_generations[1] : &config_generations[0];
+}
+
+/**
+ * @brief Fetch config into the staging generation, starting from a copy of the live one.
+ *
+ * A delta fetch only writes the items that changed, and the copy carries the
+ * rest over.  This also overwrites whatever a snapshot from before the last
+ * commit pointed to.
+ */
+static void fetch_config() {
+    memcpy(config_staging(), config_live, sizeof(struct ConfigValues));
+    start_configuration_fetch(config_items, num_items);
+}
+
+/**
+ * @brief Make the staging generation live, once every item in it has been validated.
+ */
+static void commit_config() {
+    struct ConfigValues *staging = config_staging();
+    // Every value is in place before the pointer that publishes them
+    __DMB();
+    config_live = staging;
+#if defined(CUSTOM_CLIENT_ID)
+    size_t len;
+    const uint8_t *id = config_client(staging, &len);
+    memcpy(client, id, len);
+    client_len = len;
+#endif
+}
+
+/**
+ * @brief Read the next mqtt message and hand it to the application.
+ *
+ * Messages delivered at QoS > 0 and already dispatched recently (eg. redelivered
+ * by the broker after a reconnect) are acknowledged without being passed on.
+ */
+static void dispatch_mqtt_message() {
+#if defined(DUTY_CYCLE)
+    duty_cycle_activity();
+#endif
+
+    if (!get_mqtt_message()) {
+        server_error("reading mqtt message failed");
+        mqtt_disconnect_on_error();
+        return;
+    }
+
+    application_processing_message = true;
+
+    if (dedup_is_duplicate(incoming_message_qos, incoming_message_topic, incoming_message_topic_len,
+                           incoming_message_payload, incoming_message_payload_len)) {
+        if (LOG_ENABLED(LOG_LEVEL_TRACE)) {
+            struct DedupStats stats;
+            dedup_get_stats(&stats);
+            server_trace("dropping duplicate message on %.*s (%lu hits, %lu evictions)",
+                         LOG_STRING(incoming_message_topic, incoming_message_topic_len),
+                         stats.hits, stats.evictions);
+        }
+        // Acknowledge and move on exactly as if the application had consumed it
+        message_received_microsec = 0;
+        pushWorkMessage(OnApplicationConsumedMessage);
+        return;
+    }
+
+    if (tunables_is_update(incoming_message_topic, incoming_message_topic_len)) {
+        tunables_apply(incoming_message_payload, incoming_message_payload_len);
+        message_received_microsec = 0;
+        pushWorkMessage(OnApplicationConsumedMessage);
+        return;
+    }
+
+    if (rpc_is_request(incoming_message_topic, incoming_message_topic_len)) {
+        rpc_handle_request(incoming_message_topic, incoming_message_topic_len,
+                           incoming_message_payload, incoming_message_payload_len);
+        if (rpc_poll() != 0 && !osTimerIsRunning(rpc_poll_timer)) {
+            osTimerStart(rpc_poll_timer, RPC_POLL_INTERVAL_MS);
+        }
+        message_received_microsec = 0;
+        pushWorkMessage(OnApplicationConsumedMessage);
+        return;
+    }
+
+    // Urgent commands are actioned here and now rather than queued for the application
+    if (application_handle_urgent_message(incoming_message_topic, incoming_message_topic_len,
+                                          incoming_message_payload, incoming_message_payload_len)) {
+        record_command_latency(&urgent_latency);
+        server_trace("urgent command actioned in %lu us", urgent_latency.last_us);
+        message_received_microsec = 0;
+        pushWorkMessage(OnApplicationConsumedMessage);
+        return;
+    }
+
+    pushApplicationMessage(OnIncomingMqttMessage);
+}
+
+/**
+ * @brief Record the time since the current message arrived.
+ */
+static void record_command_latency(struct CommandLatencyStats *stats) {
+    uint64_t now = 0;
+    mvGetMicroseconds(&now);
+
+    uint32_t elapsed = (uint32_t)(now - message_received_microsec);
+    stats->count++;
+    stats->last_us = elapsed;
+    stats->total_us += elapsed;
+    if (elapsed > stats->max_us) {
+        stats->max_us = elapsed;
+    }
+}
+
+/**
+ * @brief Copy out the inbound command latency statistics.
+ *
+ * @param urgent Populated with figures for commands taking the urgent path
+ * @param queued Populated with figures for commands queued to the application
+ */
+void work_get_command_latency(struct CommandLatencyStats *urgent, struct CommandLatencyStats *queued) {
+    *urgent = urgent_latency;
+    *queued = queued_latency;
+}
+
+/*
+ * RPC
+ */
+static uint64_t rpc_now_microsec() {
+    uint64_t now = 0;
+    mvGetMicroseconds(&now);
+    return now;
+}
+
+static const struct RpcTransport rpc_mqtt_transport = {
+#if defined(COMMAND_CHANNEL)
+    // Replies go back the way requests came, clear of telemetry
+    .publish = command_publish,
+#else
+    .publish = mqtt_publish,
+#endif
+    .now_microsec = rpc_now_microsec,
+};
+
+/**
+ * @brief RPC method "ping": reply with the device's uptime.
+ */
+static enum RpcResult rpc_ping(uint32_t request, const uint8_t *params, size_t params_len,
+                               char *result, size_t result_size) {
+    snprintf(result, result_size, "{\"uptime_ms\":%lu}", (uint32_t)(rpc_now_microsec() / 1000));
+    return RPC_RESULT_OK;
+}
+
+/**
+ * @brief RPC method "stats": reply with inbound command and RPC statistics.
+ */
+static enum RpcResult rpc_stats(uint32_t request, const uint8_t *params, size_t params_len,
+                                char *result, size_t result_size) {
+    struct DedupStats dedup;
+    dedup_get_stats(&dedup);
+    struct LogStats log;
+    log_get_stats(&log);
+    struct UartRingStats uart;
+    uart_ring_get_stats(&uart);
+
+    size_t used = snprintf(result, result_size,
+                           "{\"dedup\":{\"checks\":%lu,\"hits\":%lu,\"evictions\":%lu},"
+                           "\"log\":{\"messages\":%lu,\"dropped\":%lu,\"high_water\":%lu},"
+                           "\"uart\":{\"sent\":%lu,\"transfers\":%lu,\"stalls\":%lu,\"dropped\":%lu,\"high_water\":%lu},"
+                           "\"urgent\":{\"count\":%lu,\"max_us\":%lu},"
+                           "\"queued\":{\"count\":%lu,\"max_us\":%lu},"
+                           "\"connects\":{\"resumed\":%lu,\"subscribed\":%lu},\"rpc\":{",
+                           dedup.checks, dedup.hits, dedup.evictions,
+                           log.messages, log.dropped, log.high_water,
+                           uart.sent_bytes, uart.transfers, uart.stalls, uart.dropped, uart.high_water,
+                           urgent_latency.count, urgent_latency.max_us,
+                           queued_latency.count, queued_latency.max_us,
+                           session_resumed_connects, subscribed_connects);
+
+    const char *method;
+    struct RpcMethodStats stats;
+    for (uint32_t ndx = 0; used < result_size && rpc_get_method_stats(ndx, &method, &stats); ndx++) {
+        used += snprintf(&result[used], result_size - used,
+                         "%s\"%s\":{\"calls\":%lu,\"errors\":%lu,\"timeouts\":%lu,\"max_us\":%lu}",
+                         ndx == 0 ? "" : ",", method,
+                         stats.calls, stats.errors, stats.timeouts, stats.max_latency_us);
+    }
+
+    if (used + 3 > result_size) {
+        return rpc_result_too_large(result, result_size);
+    }
+    strcat(result, "}}");
+    return RPC_RESULT_OK;
+}
+
+static size_t format_reconnect_stats(char *buffer, size_t size, const char *name,
+                                     const struct ReconnectScheduler *scheduler) {
+    const struct ReconnectStats *stats = &scheduler->stats;
+    return snprintf(buffer, size,
+                    "\"%s\":{\"attempts\":%lu,\"reconnects\":%lu,\"backoff_ms\":%lu,"
+                    "\"last_ttr_ms\":%lu,\"max_ttr_ms\":%lu}",
+                    name, stats->attempts, stats->reconnects, stats->last_backoff_ms,
+                    stats->last_time_to_reconnect_ms, stats->max_time_to_reconnect_ms);
+}
+
+/**
+ * @brief RPC method "connection": reply with reconnect statistics and broker endpoint health.
+ */
+static enum RpcResult rpc_connection(uint32_t request, const uint8_t *params, size_t params_len,
+                                     char *result, size_t result_size) {
+    size_t used = snprintf(result, result_size, "{");
+    used += format_reconnect_stats(&result[used], result_size - used, "broker", &broker_reconnect);
+    if (used < result_size) {
+        used += snprintf(&result[used], result_size - used, ",");
+    }
+    if (used < result_size) {
+        used += format_reconnect_stats(&result[used], result_size - used, "config", &config_retry);
+    }
+#if defined(COMMAND_CHANNEL)
+    if (used < result_size) {
+        used += snprintf(&result[used], result_size - used, ",");
+    }
+    if (used < result_size) {
+        used += format_reconnect_stats(&result[used], result_size - used, "command", &command_reconnect);
+    }
+#endif
+
+    if (used < result_size) {
+        struct NetworkStats network;
+        network_get_stats(&network);
+        used += snprintf(&result[used], result_size - used,
+                         ",\"network\":{\"event_wakeups\":%lu,\"poll_wakeups\":%lu,\"event_changes\":%lu,"
+                         "\"poll_changes\":%lu,\"last_detect_us\":%lu,\"max_detect_us\":%lu}",
+                         network.event_wakeups, network.poll_wakeups, network.event_changes,
+                         network.poll_changes, network.last_detect_us, network.max_detect_us);
+    }
+
+    if (used < result_size) {
+        used += snprintf(&result[used], result_size - used, ",\"endpoints\":[");
+    }
+    for (uint32_t ndx = 0; ndx < broker_selector_count() && used < result_size; ndx++) {
+        const struct BrokerEndpoint *endpoint = broker_selector_endpoint(ndx);
+        used += snprintf(&result[used], result_size - used,
+                         "%s{\"host\":\"%.*s:%u\",\"connect_us\":%lu,\"samples\":%lu,\"health\":%lu,"
+                         "\"failures\":%lu,\"quarantined\":%s}",
+                         ndx == 0 ? "" : ",", (int)endpoint->host_len, endpoint->host, endpoint->port,
+                         endpoint->connect_us, endpoint->samples, endpoint->health,
+                         endpoint->consecutive_failures, endpoint->quarantined_until_us != 0 ? "true" : "false");
+    }
+
+    if (used + 3 > result_size) {
+        return rpc_result_too_large(result, result_size);
+    }
+    strcat(result, "]}");
+    return RPC_RESULT_OK;
+}
+
+static size_t format_phase_aggregate(char *buffer, size_t size, const char *name,
+                                     const struct PhaseAggregate *agg) {
+    return snprintf(buffer, size, "\"%s\":{\"count\":%lu,\"last_us\":%lu,\"max_us\":%lu,\"avg_us\":%lu}",
+                    name, agg->count, agg->last_us, agg->max_us,
+                    agg->count != 0 ? (uint32_t)(agg->total_us / agg->count) : 0);
+}
+
+/**
+ * @brief RPC method "timing": reply with aggregated connect phase timings, and boot to first
+ *        publish for comparing boots with and without the config cache.
+ */
+static enum RpcResult rpc_timing(uint32_t request, const uint8_t *params, size_t params_len,
+                                 char *result, size_t result_size) {
+    size_t used = snprintf(result, result_size, "{\"phases\":{");
+    for (uint32_t phase = 0; phase < CONNECT_PHASE_COUNT && used < result_size; phase++) {
+        if (phase != 0) {
+            used += snprintf(&result[used], result_size - used, ",");
+        }
+        if (used < result_size) {
+            used += format_phase_aggregate(&result[used], result_size - used,
+                                           timing_phase_name(phase), timing_phase_aggregate(phase));
+        }
+    }
+
+    if (used < result_size) {
+        used += snprintf(&result[used], result_size - used, "},\"totals\":{");
+    }
+    for (uint32_t kind = 0; kind < CONNECT_KIND_COUNT && used < result_size; kind++) {
+        if (kind != 0) {
+            used += snprintf(&result[used], result_size - used, ",");
+        }
+        if (used < result_size) {
+            used += format_phase_aggregate(&result[used], result_size - used,
+                                           timing_kind_name(kind), timing_total_aggregate(kind));
+        }
+    }
+
+    if (used < result_size) {
+        used += snprintf(&result[used], result_size - used, "},\"boot_to_first_publish_us\":%lu,\"boot_config\":\"%s\"}",
+                         timing_boot_to_first_publish(), booted_from_cache ? "cache" : "fetched");
+    }
+    return used < result_size ? RPC_RESULT_OK : rpc_result_too_large(result, result_size);
+}
+
+/**
+ * @brief RPC method "refresh": fetch config again in the background, reply with refresh and
+ *        failed fetch counts so far, what the fetches cost and tunables updates received.
+ */
+static enum RpcResult rpc_refresh(uint32_t request, const uint8_t *params, size_t params_len,
+                                  char *result, size_t result_size) {
+    pushWorkMessage(RefreshConfig);
+
+    struct ConfigFetchStats fetch;
+    configuration_fetch_stats(&fetch);
+    struct TunablesStats tunables;
+    tunables_get_stats(&tunables);
+
+    size_t used = snprintf(result, result_size,
+                           "{\"queued\":true,\"requested\":%lu,\"skipped\":%lu,\"failed\":%lu,"
+                           "\"unchanged\":%lu,\"hot_applied\":%lu,\"reconnects\":%lu,"
+                           "\"recovery\":{\"failures\":%lu,\"fallbacks\":%lu,\"recoveries\":%lu,"
+                           "\"last_ms\":%lu,\"max_ms\":%lu,\"avg_ms\":%lu},"
+                           "\"fetch\":{\"full\":%lu,\"delta\":%lu,\"unchanged\":%lu,\"stale_manifest\":%lu,"
+                           "\"last_bytes\":%lu,\"total_bytes\":%lu,\"last_ms\":%lu,\"max_ms\":%lu},"
+                           "\"tunables\":{\"received\":%lu,\"applied\":%lu,\"rejected\":%lu}}",
+                           config_refresh_stats.requested, config_refresh_stats.skipped,
+                           config_refresh_stats.failed, config_refresh_stats.unchanged,
+                           config_refresh_stats.hot_applied, config_refresh_stats.reconnects,
+                           config_recovery.failures, config_recovery.fallbacks, config_recovery.recoveries,
+                           config_recovery.last_ms, config_recovery.max_ms,
+                           config_recovery.recoveries != 0 ? (uint32_t)(config_recovery.total_ms / config_recovery.recoveries) : 0,
+                           fetch.full, fetch.delta, fetch.unchanged, fetch.stale_manifest,
+                           fetch.last_bytes, fetch.total_bytes, fetch.last_ms, fetch.max_ms,
+                           tunables.received, tunables.applied, tunables.rejected);
+    return used < result_size ? RPC_RESULT_OK : rpc_result_too_large(result, result_size);
+}
+
+/**
+ * @brief RPC method "link": reply with network and broker connection history, and the keepalive chosen from it.
+ */
+static enum RpcResult rpc_link(uint32_t request, const uint8_t *params, size_t params_len,
+                               char *result, size_t result_size) {
+    struct LinkQualityStats link;
+    link_quality_get_stats(&link);
+
+    size_t used = snprintf(result, result_size,
+                           "{\"keepalive_s\":%u,\"keepalive_reason\":\"%s\",\"recent_drops\":%lu,"
+                           "\"network_ups\":%lu,\"network_drops\":%lu,\"network_releases\":%lu,"
+                           "\"last_outage_ms\":%lu,\"max_outage_ms\":%lu,"
+                           "\"broker_connects\":%lu,\"broker_drops\":%lu,\"broker_disconnects\":%lu,"
+                           "\"last_lifetime_ms\":%lu,\"max_lifetime_ms\":%lu,\"avg_lifetime_ms\":%lu,\"codes\":{",
+                           link_quality_keepalive(), link_quality_reason_name(link_quality_keepalive_reason()),
+                           link_quality_recent_drops(), link.network_ups, link.network_drops, link.network_releases,
+                           link.last_outage_ms, link.max_outage_ms,
+                           link.broker_connects, link.broker_drops, link.broker_disconnects,
+                           link.last_lifetime_ms, link.max_lifetime_ms,
+                           (link.broker_drops + link.broker_disconnects) != 0
+                               ? (uint32_t)(link.total_lifetime_ms / (link.broker_drops + link.broker_disconnects)) : 0);
+
+    for (uint32_t ndx = 0; ndx < LINK_QUALITY_MAX_CODES && link.codes[ndx].count != 0 && used < result_size; ndx++) {
+        if (link.codes[ndx].code == LINK_QUALITY_CODE_UNAVAILABLE) {
+            used += snprintf(&result[used], result_size - used, "%s\"none\":%lu", ndx == 0 ? "" : ",", link.codes[ndx].count);
+        } else {
+            used += snprintf(&result[used], result_size - used, "%s\"0x%02lx\":%lu", ndx == 0 ? "" : ",",
+                             link.codes[ndx].code, link.codes[ndx].count);
+        }
+    }
+
+    if (used < result_size) {
+        used += snprintf(&result[used], result_size - used, "},\"other_codes\":%lu}", link.other_codes);
+    }
+    return used < result_size ? RPC_RESULT_OK : rpc_result_too_large(result, result_size);
+}
+
+/**
+ * @brief RPC method "channels": reply with channel buffer pool use, failed opens per channel,
+ *        and the least stack this task has had left.
+ */
+static enum RpcResult rpc_channels(uint32_t request, const uint8_t *params, size_t params_len,
+                                   char *result, size_t result_size) {
+    size_t used = snprintf(result, result_size, "{\"blocks_free\":%lu,\"blocks_high_water\":%lu,\"work_stack_free\":%lu",
+                           channel_buffers_blocks_free(), channel_buffers_blocks_high_water(),
+                           osThreadGetStackSpace(osThreadGetId()));
+
+    for (uint32_t owner = 0; owner < CHANNEL_BUFFERS_OWNERS && used < result_size; owner++) {
+        struct ChannelBufferStats stats;
+        channel_buffers_get_stats(owner, &stats);
+        used += snprintf(&result[used], result_size - used,
+                         ",\"%s\":{\"opens\":%lu,\"pool_failures\":%lu,\"open_failures\":%lu,"
+                         "\"last_open_status\":%u,\"blocks_held\":%lu}",
+                         channel_buffers_owner_name(owner), stats.opens, stats.pool_failures,
+                         stats.open_failures, (unsigned)stats.last_open_status, stats.blocks_held);
+    }
+
+    if (used + 2 > result_size) {
+        return rpc_result_too_large(result, result_size);
+    }
+    strcat(result, "}");
+    return RPC_RESULT_OK;
+}
+
+/**
+ * @brief RPC method "log": set log levels, then reply with the level compiled in and each module's level.
+ *
+ * {"level":"trace"} sets every module; {"module":"mqtt","level":"trace"} sets one.
+ * With no params the levels are left as they are.
+ */
+static enum RpcResult rpc_log(uint32_t request, const uint8_t *params, size_t params_len,
+                              char *result, size_t result_size) {
+    const uint8_t *name;
+    size_t name_len;
+    if (rpc_json_get(params, params_len, "level", &name, &name_len)) {
+        enum LogLevel level;
+        if (!log_find_level(name, name_len, &level)) {
+            snprintf(result, result_size, "\"unknown level\"");
+            return RPC_RESULT_ERROR;
+        }
+
+        if (rpc_json_get(params, params_len, "module", &name, &name_len)) {
+            enum LogModule module;
+            if (!log_find_module(name, name_len, &module)) {
+                snprintf(result, result_size, "\"unknown module\"");
+                return RPC_RESULT_ERROR;
+            }
+            log_set_module_level(module, level);
+        } else {
+            log_set_level(level);
+        }
+    }
+
+    size_t used = snprintf(result, result_size, "{\"compiled\":\"%s\",\"levels\":{",
+                           log_level_name(LOG_COMPILE_LEVEL));
+    for (uint32_t module = 0; module < LOG_MODULE_COUNT && used < result_size; module++) {
+        used += snprintf(&result[used], result_size - used, "%s\"%s\":\"%s\"", module == 0 ? "" : ",",
+                         log_module_name(module), log_level_name(log_get_module_level(module)));
+    }
+
+    if (used + 3 > result_size) {
+        return rpc_result_too_large(result, result_size);
+    }
+    strcat(result, "}}");
+    return RPC_RESULT_OK;
+}
+
+#if defined(DUTY_CYCLE)
+/**
+ * @brief RPC method "radio": reply with duty cycle radio-on time and upload sizes.
+ */
+static enum RpcResult rpc_radio(uint32_t request, const uint8_t *params, size_t params_len,
+                                char *result, size_t result_size) {
+    struct DutyCycleStats stats;
+    duty_cycle_get_stats(&stats);
+
+    size_t used = snprintf(result, result_size,
+                           "{\"wakes\":%lu,\"early_wakes\":%lu,\"forced_sleeps\":%lu,\"last_on_ms\":%lu,"
+                           "\"max_on_ms\":%lu,\"avg_on_ms\":%lu,\"last_bytes\":%lu,\"avg_bytes\":%lu,"
+                           "\"queued\":%lu,\"published\":%lu,\"dropped\":%lu,\"pending\":%lu}",
+                           stats.wakes, stats.early_wakes, stats.forced_sleeps, stats.last_radio_on_ms,
+                           stats.max_radio_on_ms,
+                           stats.wakes != 0 ? (uint32_t)(stats.total_radio_on_ms / stats.wakes) : 0,
+                           stats.last_bytes, stats.wakes != 0 ? (uint32_t)(stats.total_bytes / stats.wakes) : 0,
+                           stats.samples_queued, stats.samples_published, stats.samples_dropped,
+                           duty_cycle_pending());
+    return used < result_size ? RPC_RESULT_OK : rpc_result_too_large(result, result_size);
+}
+#endif
+
+/**
+ * @brief Bind the RPC handler to the MQTT channel and register the built-in methods.
+ */
+static void configure_rpc() {
+    rpc_init(&rpc_mqtt_transport);
+    rpc_register("ping", rpc_ping, 0);
+    rpc_register("stats", rpc_stats, 0);
+    rpc_register("connection", rpc_connection, 0);
+    rpc_register("link", rpc_link, 0);
+    rpc_register("timing", rpc_timing, 0);
+    rpc_register("channels", rpc_channels, 0);
+    rpc_register("refresh", rpc_refresh, 0);
+    rpc_register("log", rpc_log, 0);
+#if defined(DUTY_CYCLE)
+    rpc_register("radio", rpc_radio, 0);
+#endif
+
+    rpc_poll_timer = osTimerNew(rpc_poll_timer_callback, osTimerPeriodic, NULL, NULL);
+    assert(rpc_poll_timer != NULL);
+}
+
+static void rpc_poll_timer_callback(void *argument) {
+    pushWorkMessage(OnRpcPollTimer);
 }
 
 /**
@@ -557,6 +1514,8 @@ void TIM8_BRK_IRQHandler(void) {
             case MV_EVENTTYPE_CHANNELNOTCONNECTED:
                 if (mqtt_connection_active) {
                     pushWorkMessage(OnBrokerDroppedConnection);
+                } else if (mqtt_is_connecting()) {
+                    pushWorkMessage(OnBrokerConnectDropped);
                 }
                 break;
             case MV_EVENTTYPE_CHANNELDATAWRITESPACE: // NOTE: this may be removed in a future kernel release
@@ -564,6 +1523,23 @@ void TIM8_BRK_IRQHandler(void) {
             default:
                 break;
         }
+#if defined(COMMAND_CHANNEL)
+    } else if (notification.tag == TAG_CHANNEL_MQTT_COMMAND) {
+        switch (notification.event_type) {
+            case MV_EVENTTYPE_CHANNELDATAREADABLE:
+                pushWorkMessage(OnCommandChannelReadable);
+                break;
+            case MV_EVENTTYPE_CHANNELNOTCONNECTED:
+                if (command_connection_active) {
+                    pushWorkMessage(OnCommandChannelDropped);
+                } else if (command_is_connecting()) {
+                    pushWorkMessage(OnCommandChannelConnectDropped);
+                }
+                break;
+            default:
+                break;
+        }
+#endif
     }
 
     // Point to the next record to be written
@@ -22,6 +22,8 @@
 #include "mv_syscalls.h"
 #include "cmsis_os.h"
 
+#include "config_handler.h"
+
 
 #ifdef __cplusplus
 extern "C" {
@@ -31,34 +33,43 @@ extern "C" {
 /*
  * DEFINES
  */
+// Main mqtt connection's channel buffers, leased from the channel buffer pool
+// (see channel_buffer_helper.h)
 #define BUF_SEND_SIZE 4*1024
 #define BUF_RECEIVE_SIZE 7*1024
 
+// Defining DUTY_CYCLE holds application samples offline and only brings the
+// network up to upload them in batches, see duty_cycle_helper.h
+//#define DUTY_CYCLE
+
 // CONFIG DATA
 
+// Defining CONFIG_CACHE keeps the last validated config in flash, so the
+// device connects with it straight away and revalidates in the background,
+// see config_cache_helper.h
+//#define CONFIG_CACHE
+
+// Defining CONFIG_DELTA has refreshes fetch the "config-manifest" item first
+// and then only the items whose hash it shows have changed, see config_handler.h
+//#define CONFIG_DELTA
+
 #define CERTIFICATE_CA
 #define CERTIFICATE_AUTH
 //#define USERNAMEPASSWORD_AUTH
 
+// Defining CONFIG_BASE64 expects root-CA, cert and private_key to be stored
+// base64 encoded, which is a third smaller than the default hex
+//#define CONFIG_BASE64
+
 //#define CUSTOM_CLIENT_ID
 
 #define BUF_CLIENT_SIZE 34
 
-#define BUF_BROKER_HOST 128
-
-#if defined(CERTIFICATE_CA)
-#define BUF_ROOT_CA 1536
-#endif // CERTIFICATE_CA
-
-#if defined(CERTIFICATE_AUTH)
-#define BUF_CERT 1024
-#define BUF_PRIVATE_KEY 1536
-#endif // CERTIFICATE_AUTH
+// Defining BROKER_FAILOVER adds a broker-list config item of further
+// equivalent endpoints to fail over to, see broker_selector.h
+//#define BROKER_FAILOVER
 
-#if defined(USERNAMEPASSWORD_AUTH)
-#define BUF_USERNAME 128
-#define BUF_PASSWORD 128
-#endif // USERNAMEPASSWORD_AUTH
+// The config items themselves, and their sizes, are in config_schema.h
 
 /*
  * TYPES
@@ -72,11 +83,14 @@ enum WorkMessageType {
     OnConfigRequestReturn,
     OnConfigObtained,
     OnConfigFailed,
+    RefreshConfig,
 
     // Managed MQTT operations and connection events
     ConnectMQTTBroker = 0x50,
     OnMqttChannelFailed,
     OnBrokerConnectFailed,
+    OnBrokerConnectTimeout,
+    OnBrokerConnectDropped,
     OnBrokerConnected,
     OnBrokerSubscriptionRequestFailed,
     OnBrokerSubscribeFailed,
@@ -86,6 +100,7 @@ enum WorkMessageType {
     OnBrokerUnsubscribeSucceeded,
     OnBrokerPublishFailed,
     OnBrokerPublishSucceeded,
+    OnBrokerApplicationPublishSucceeded,
     OnBrokerPublishRateLimited,
     OnBrokerMessageAcknowledgeFailed,
     OnBrokerDisconnected,
@@ -105,6 +120,56 @@ enum WorkMessageType {
     // Application events
     OnApplicationConsumedMessage = 0x90,
     OnApplicationProducedMessage,
+    OnApplicationProducedUrgentMessage,
+
+    // RPC events
+    OnRpcPollTimer = 0xB0,
+
+    // Duty cycle events
+    OnDutyCycleWake = 0xC0,
+    OnDutyCycleLinger,
+    OnDutyCycleMaxAwake,
+
+    // Command channel operations and events, see command_handler.h
+    ConnectCommandChannel = 0xD0,
+    OnCommandChannelReadable,
+    OnCommandChannelConnectFailed,
+    OnCommandChannelConnected,
+    OnCommandChannelSubscribed,
+    OnCommandChannelFailed,
+    OnCommandChannelDropped,
+    OnCommandChannelDisconnected,
+    OnCommandChannelConnectTimeout,
+    OnCommandChannelConnectDropped,
+};
+
+// Receive-to-action latency of inbound commands, from the message arriving
+// to it being actioned (urgent) or consumed by the application (queued)
+struct CommandLatencyStats {
+    uint32_t count;
+    uint32_t last_us;
+    uint32_t max_us;
+    uint64_t total_us;
+};
+
+// Background config refreshes, see RefreshConfig
+struct ConfigRefreshStats {
+    uint32_t requested;
+    uint32_t skipped;               // no network, or a fetch already under way
+    uint32_t failed;
+    uint32_t unchanged;
+    uint32_t hot_applied;           // changes applied with the broker connection left up
+    uint32_t reconnects;            // broker host, port or credentials changed
+};
+
+// Config fetches that failed at connect time, see CONFIG_RETRY_LIMIT
+struct ConfigRecoveryStats {
+    uint32_t failures;
+    uint32_t fallbacks;             // retries ran out and the last known good config was used
+    uint32_t recoveries;            // operational again after a failure
+    uint32_t last_ms;               // first failure to operational
+    uint32_t max_ms;
+    uint64_t total_ms;
 };
 
 /*
@@ -112,6 +177,7 @@ enum WorkMessageType {
  */
 void start_work_task(void *argument);
 void pushWorkMessage(enum WorkMessageType type);
+void work_get_command_latency(struct CommandLatencyStats *urgent, struct CommandLatencyStats *queued);
 
 
 /*
@@ -119,8 +185,6 @@ void pushWorkMessage(enum WorkMessageType type);
  */
 extern MvNotificationHandle work_notification_center_handle;
 extern osMessageQueueId_t workMessageQueue;
-extern uint8_t work_send_buffer[BUF_SEND_SIZE]; // shared by config and mqtt as only one is active at a time
-extern uint8_t work_receive_buffer[BUF_RECEIVE_SIZE]; // shared by config and mqtt as only one is active at a time
 
 extern uint8_t *incoming_message_topic;
 extern uint32_t incoming_message_topic_len;
@@ -134,31 +198,12 @@ extern uint32_t incoming_message_topic_len;
 extern uint8_t *incoming_message_payload;
 extern uint32_t incoming_message_payload_len;
 
+// The MQTT client id: the device's, or the client-id item with CUSTOM_CLIENT_ID
 extern uint8_t  client[BUF_CLIENT_SIZE];
 extern size_t   client_len;
 
-extern uint8_t  broker_host[BUF_BROKER_HOST];
-extern size_t   broker_host_len;
-extern uint16_t broker_port;
-
-#if defined(CERTIFICATE_CA)
-extern uint8_t  root_ca[BUF_ROOT_CA];
-extern size_t   root_ca_len;
-#endif // CERTIFICATE_CA
-
-#if defined(CERTIFICATE_AUTH)
-extern uint8_t  cert[BUF_CERT];
-extern size_t   cert_len;
-extern uint8_t  private_key[BUF_PRIVATE_KEY];
-extern size_t   private_key_len;
-#endif // CERTIFICATE_AUTH
-
-#if defined(USERNAMEPASSWORD_AUTH)
-extern uint8_t  username[BUF_USERNAME];
-extern size_t   username_len;
-extern uint8_t  password[BUF_PASSWORD];
-extern size_t   password_len;
-#endif // USERNAMEPASSWORD_AUTH
+// Declares the config items, once the defines above have chosen them
+#include "config_schema.h"
 
 
 #ifdef __cplusplus
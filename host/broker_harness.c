@@ -0,0 +1,342 @@
+/**
+ *
+ * Microvisor Broker Selector Host Harness
+ * Version 1.0.0
+ * Copyright © 2023, Twilio
+ * Licence: Apache 2.0
+ *
+ */
+
+/* Runs app/broker_selector.c on a host machine against several stand-in
+ * brokers listening on localhost.  Each stand-in answers an MQTT CONNECT with
+ * a CONNACK after its own delay, or refuses it, or never answers, or closes
+ * the connection first; one endpoint has nothing listening at all.  The
+ * harness connects the way the device does and reports each outcome to the
+ * selector as mqtt_handler.c does: refusals and timeouts count against the
+ * endpoint, a connection closed before CONNACK does not.  It checks that the
+ * selector quarantines the endpoints that fail, settles on the fastest one,
+ * fails over when that one goes down and returns to it afterwards.  Build and
+ * run with "make -C host".
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "broker_selector.h"
+
+
+/*
+ * DEFINES
+ */
+// Scaled down from MQTT_CONNECT_TIMEOUT_MS so the harness runs quickly
+#define CONNECT_TIMEOUT_MS 150
+#define ATTEMPTS 24
+
+#define CHECK(condition) do { \
+    if (!(condition)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+        failures++; \
+    } \
+} while (0)
+
+
+/*
+ * TYPES
+ */
+enum StandInMode {
+    STAND_IN_ACK,           // CONNACK after delay_ms
+    STAND_IN_REFUSE,        // CONNACK with reason "server unavailable"
+    STAND_IN_SILENT,        // never answers
+    STAND_IN_CLOSE          // closes the connection before answering
+};
+
+struct StandIn {
+    uint16_t port;
+    int listener;
+    uint32_t delay_ms;
+    _Atomic int mode;
+    pthread_t thread;
+};
+
+enum Outcome {
+    OUTCOME_CONNECTED,
+    OUTCOME_REFUSED,        // a failed CONNACK, or nothing listening
+    OUTCOME_CLOSED,         // channel closed before CONNACK, not reported
+    OUTCOME_TIMEOUT         // no CONNACK within CONNECT_TIMEOUT_MS
+};
+
+
+/*
+ * GLOBALS
+ */
+static uint32_t failures = 0;
+
+// Added to the clock, to step past quarantines without waiting them out
+static uint64_t clock_offset_us = 0;
+
+static struct StandIn fast = { .delay_ms = 2 };
+static struct StandIn slow = { .delay_ms = 40 };
+static struct StandIn silent = { .mode = STAND_IN_SILENT };
+static uint16_t dead_port = 0;
+
+static const uint8_t connack[] = { 0x20, 0x02, 0x00, 0x00 };
+static const uint8_t connack_refused[] = { 0x20, 0x02, 0x00, 0x88 };
+
+
+/*
+ * STAND-IN BROKERS
+ */
+static uint64_t now_microsec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000 + clock_offset_us;
+}
+
+static int listen_on_any_port(uint16_t *port) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in address = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t length = sizeof(address);
+
+    if (sock < 0 || bind(sock, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(sock, 8) != 0
+        || getsockname(sock, (struct sockaddr *)&address, &length) != 0) {
+        perror("stand-in broker");
+        exit(EXIT_FAILURE);
+    }
+    *port = ntohs(address.sin_port);
+    return sock;
+}
+
+static void *stand_in_thread(void *argument) {
+    struct StandIn *broker = argument;
+    uint8_t request[256];
+
+    while (true) {
+        int client = accept(broker->listener, NULL, NULL);
+        if (client < 0) {
+            continue;
+        }
+
+        switch (atomic_load(&broker->mode)) {
+            case STAND_IN_ACK:
+                if (recv(client, request, sizeof(request), 0) > 0) {
+                    usleep(broker->delay_ms * 1000);
+                    send(client, connack, sizeof(connack), MSG_NOSIGNAL);
+                }
+                break;
+            case STAND_IN_REFUSE:
+                if (recv(client, request, sizeof(request), 0) > 0) {
+                    send(client, connack_refused, sizeof(connack_refused), MSG_NOSIGNAL);
+                }
+                break;
+            case STAND_IN_SILENT:
+                // Hold the connection until the client gives up on it
+                while (recv(client, request, sizeof(request), 0) > 0) { }
+                break;
+            default:
+                break;
+        }
+        close(client);
+    }
+    return NULL;
+}
+
+static void start_stand_in(struct StandIn *broker) {
+    broker->listener = listen_on_any_port(&broker->port);
+    pthread_create(&broker->thread, NULL, stand_in_thread, broker);
+    broker_selector_add((const uint8_t *)"127.0.0.1", 9, broker->port);
+}
+
+
+/*
+ * CLIENT
+ */
+/**
+ * @brief Connect to an endpoint as the device does: open, send CONNECT, wait for CONNACK.
+ */
+static enum Outcome try_connect(const struct BrokerEndpoint *endpoint) {
+    // Fixed header, then protocol "MQTT" v5, clean start, keepalive 60, no properties, client id "h"
+    static const uint8_t connect_packet[] = { 0x10, 0x0E, 0x00, 0x04, 'M', 'Q', 'T', 'T', 0x05, 0x02,
+                                              0x00, 0x3C, 0x00, 0x00, 0x01, 'h' };
+    struct sockaddr_in address = { .sin_family = AF_INET, .sin_port = htons(endpoint->port),
+                                   .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(sock, (struct sockaddr *)&address, sizeof(address)) != 0) {
+        close(sock);
+        return OUTCOME_REFUSED;
+    }
+    send(sock, connect_packet, sizeof(connect_packet), MSG_NOSIGNAL);
+
+    struct pollfd readable = { .fd = sock, .events = POLLIN };
+    enum Outcome outcome = OUTCOME_TIMEOUT;
+    if (poll(&readable, 1, CONNECT_TIMEOUT_MS) == 1) {
+        uint8_t response[sizeof(connack)];
+        ssize_t length = recv(sock, response, sizeof(response), MSG_WAITALL);
+        if (length != sizeof(response) || response[0] != 0x20) {
+            outcome = OUTCOME_CLOSED;
+        } else {
+            outcome = response[3] == 0x00 ? OUTCOME_CONNECTED : OUTCOME_REFUSED;
+        }
+    }
+    close(sock);
+    return outcome;
+}
+
+/**
+ * @brief One attempt, reported to the selector as mqtt_handler.c does.
+ *
+ * @retval The port of the endpoint tried.
+ */
+static uint16_t attempt(enum Outcome *outcome) {
+    uint64_t started = now_microsec();
+    const struct BrokerEndpoint *endpoint = broker_selector_choose(started);
+    if (endpoint == NULL) {
+        *outcome = OUTCOME_REFUSED;
+        return 0;
+    }
+
+    *outcome = try_connect(endpoint);
+    if (*outcome == OUTCOME_CONNECTED) {
+        broker_selector_report_success((uint32_t)(now_microsec() - started));
+    } else if (*outcome != OUTCOME_CLOSED) {
+        broker_selector_report_failure(now_microsec());
+    }
+    return endpoint->port;
+}
+
+static const struct BrokerEndpoint *find_endpoint(uint16_t port) {
+    for (uint32_t ndx = 0; ndx < broker_selector_count(); ndx++) {
+        if (broker_selector_endpoint(ndx)->port == port) {
+            return broker_selector_endpoint(ndx);
+        }
+    }
+    return NULL;
+}
+
+static void print_endpoints(const char *heading) {
+    printf("%s\n", heading);
+    for (uint32_t ndx = 0; ndx < broker_selector_count(); ndx++) {
+        const struct BrokerEndpoint *endpoint = broker_selector_endpoint(ndx);
+        const char *name = endpoint->port == fast.port ? "fast" : endpoint->port == slow.port ? "slow"
+                         : endpoint->port == silent.port ? "silent" : "dead";
+        printf("  %-6s connect %6lu us samples %2lu health %3lu failures %lu%s\n", name,
+               (unsigned long)endpoint->connect_us, (unsigned long)endpoint->samples,
+               (unsigned long)endpoint->health, (unsigned long)endpoint->consecutive_failures,
+               endpoint->quarantined_until_us != 0 ? " quarantined" : "");
+    }
+}
+
+
+/*
+ * TESTS
+ */
+static void test_settles_on_fastest() {
+    uint32_t outcomes[4] = {0};
+    uint16_t last_port = 0;
+    for (uint32_t ndx = 0; ndx < ATTEMPTS; ndx++) {
+        enum Outcome outcome;
+        last_port = attempt(&outcome);
+        outcomes[outcome]++;
+    }
+    print_endpoints("after start-up:");
+
+    CHECK(outcomes[OUTCOME_REFUSED] == BROKER_FAILOVER_THRESHOLD);
+    CHECK(outcomes[OUTCOME_TIMEOUT] == BROKER_FAILOVER_THRESHOLD);
+    CHECK(find_endpoint(dead_port)->quarantined_until_us != 0);
+    CHECK(find_endpoint(silent.port)->quarantined_until_us != 0);
+    CHECK(find_endpoint(slow.port)->samples >= 1);
+    CHECK(find_endpoint(fast.port)->samples > find_endpoint(slow.port)->samples);
+    CHECK(find_endpoint(fast.port)->connect_us < find_endpoint(slow.port)->connect_us);
+    CHECK(last_port == fast.port);
+}
+
+static void test_closed_not_counted() {
+    atomic_store(&fast.mode, STAND_IN_CLOSE);
+
+    // On the device a channel that closes before CONNACK is most likely the
+    // network going, so the endpoint is not charged with it
+    for (uint32_t ndx = 0; ndx < BROKER_FAILOVER_THRESHOLD + 1; ndx++) {
+        enum Outcome outcome;
+        CHECK(attempt(&outcome) == fast.port);
+        CHECK(outcome == OUTCOME_CLOSED);
+    }
+    CHECK(find_endpoint(fast.port)->consecutive_failures == 0);
+    CHECK(find_endpoint(fast.port)->quarantined_until_us == 0);
+}
+
+static void test_fails_over() {
+    atomic_store(&fast.mode, STAND_IN_REFUSE);
+
+    uint32_t refused = 0;
+    uint16_t last_port = 0;
+    for (uint32_t ndx = 0; ndx < BROKER_FAILOVER_THRESHOLD + 3; ndx++) {
+        enum Outcome outcome;
+        last_port = attempt(&outcome);
+        if (outcome == OUTCOME_REFUSED) {
+            refused++;
+        } else {
+            CHECK(outcome == OUTCOME_CONNECTED);
+        }
+    }
+    print_endpoints("after the fast broker went down:");
+
+    CHECK(refused == BROKER_FAILOVER_THRESHOLD);
+    CHECK(find_endpoint(fast.port)->quarantined_until_us != 0);
+    CHECK(last_port == slow.port);
+}
+
+static void test_returns_after_quarantine() {
+    atomic_store(&fast.mode, STAND_IN_ACK);
+    clock_offset_us += (uint64_t)BROKER_QUARANTINE_MS * 1000 + 1;
+
+    // The endpoints never measured come first, and get one more chance each
+    enum Outcome outcome = OUTCOME_REFUSED;
+    uint16_t port = 0;
+    uint32_t tries = 0;
+    while (outcome != OUTCOME_CONNECTED && tries < 4) {
+        port = attempt(&outcome);
+        tries++;
+    }
+    print_endpoints("after the quarantine:");
+
+    CHECK(outcome == OUTCOME_CONNECTED);
+    CHECK(tries == 3);
+    CHECK(port == fast.port);
+    CHECK(find_endpoint(fast.port)->consecutive_failures == 0);
+    CHECK(find_endpoint(dead_port)->quarantined_until_us != 0);
+    CHECK(find_endpoint(silent.port)->quarantined_until_us != 0);
+}
+
+
+int main() {
+    // Nothing listens on this port once the socket is closed
+    close(listen_on_any_port(&dead_port));
+
+    broker_selector_begin_update();
+    broker_selector_add((const uint8_t *)"127.0.0.1", 9, dead_port);
+    start_stand_in(&silent);
+    start_stand_in(&slow);
+    start_stand_in(&fast);
+
+    test_settles_on_fastest();
+    test_closed_not_counted();
+    test_fails_over();
+    test_returns_after_quarantine();
+
+    if (failures != 0) {
+        printf("broker harness: %lu checks failed\n", (unsigned long)failures);
+        return EXIT_FAILURE;
+    }
+    printf("broker harness: passed\n");
+    return EXIT_SUCCESS;
+}
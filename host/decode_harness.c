@@ -0,0 +1,296 @@
+/**
+ *
+ * Microvisor Decode Helper Host Harness
+ * Version 1.0.0
+ * Copyright © 2023, Twilio
+ * Licence: Apache 2.0
+ *
+ */
+
+/* Runs app/decode_helper.c on a host machine.  Random values are encoded with
+ * a plain reference encoder and must decode back exactly, both into a
+ * separate buffer and in place, as config_handler.c once did.  Invalid
+ * characters, odd hex lengths, misplaced base64 padding and values too long
+ * for the output must be rejected, and base64 without padding must decode.
+ * Finally the per-character nibble loop the config handler used before
+ * decode_helper.c is timed against decode_hex() and decode_base64() on a
+ * certificate-sized value.  Build and run with "make -C host".
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "decode_helper.h"
+
+
+/*
+ * DEFINES
+ */
+// The largest DER item in config_schema.h
+#define VALUE_SIZE 1536
+#define ROUND_TRIPS 2000
+#define BENCH_RUNS 20000
+
+#define CHECK(condition) do { \
+    if (!(condition)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+        failures++; \
+    } \
+} while (0)
+
+
+/*
+ * GLOBALS
+ */
+static uint32_t failures = 0;
+
+static const char base64_alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// Keeps the benchmark loops from being optimised away
+static volatile uint8_t sink;
+
+
+/*
+ * REFERENCE CODECS
+ */
+static size_t encode_hex(const uint8_t *in, size_t len, uint8_t *out, bool upper) {
+    const char *digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+    for (size_t ndx = 0; ndx < len; ndx++) {
+        out[2 * ndx] = digits[in[ndx] >> 4];
+        out[2 * ndx + 1] = digits[in[ndx] & 0x0F];
+    }
+    return 2 * len;
+}
+
+static size_t encode_base64(const uint8_t *in, size_t len, uint8_t *out, bool pad) {
+    size_t out_len = 0;
+    for (size_t ndx = 0; ndx < len; ndx += 3) {
+        uint32_t triple = (uint32_t)in[ndx] << 16;
+        if (ndx + 1 < len) triple |= (uint32_t)in[ndx + 1] << 8;
+        if (ndx + 2 < len) triple |= in[ndx + 2];
+        size_t chars = len - ndx >= 3 ? 4 : len - ndx + 1;
+        for (size_t n = 0; n < chars; n++) {
+            out[out_len++] = base64_alphabet[(triple >> (18 - 6 * n)) & 0x3F];
+        }
+        while (pad && chars++ < 4) {
+            out[out_len++] = '=';
+        }
+    }
+    return out_len;
+}
+
+/**
+ * @brief The config handler's hex decode before decode_helper.c, one character at a time.
+ */
+static size_t nibble_loop(const uint8_t *in, size_t in_len, uint8_t *out) {
+    size_t out_len = 0;
+    for (size_t read_ndx = 0; read_ndx < in_len; read_ndx += 2) {
+        uint8_t val = 0;
+        for (int n = 0; n < 2; n++) {
+            char byte = in[read_ndx + n];
+            if (byte >= '0' && byte <= '9') byte = byte - '0';
+            else if (byte >= 'a' && byte <= 'f') byte = byte - 'a' + 10;
+            else if (byte >= 'A' && byte <= 'F') byte = byte - 'A' + 10;
+            val = (val << 4) | (byte & 0xf);
+        }
+        out[out_len++] = val;
+    }
+    return out_len;
+}
+
+static bool hex_is(const char *text, const uint8_t *expected, size_t expected_len) {
+    uint8_t out[16];
+    size_t out_len = 0;
+    return decode_hex((const uint8_t *)text, strlen(text), out, sizeof(out), &out_len)
+           && out_len == expected_len && memcmp(out, expected, out_len) == 0;
+}
+
+static bool base64_is(const char *text, const char *expected) {
+    uint8_t out[16];
+    size_t out_len = 0;
+    return decode_base64((const uint8_t *)text, strlen(text), out, sizeof(out), &out_len)
+           && out_len == strlen(expected) && memcmp(out, expected, out_len) == 0
+           && decode_base64_length((const uint8_t *)text, strlen(text)) == out_len;
+}
+
+static bool hex_rejects(const char *text) {
+    uint8_t out[16];
+    size_t out_len = 0;
+    return !decode_hex((const uint8_t *)text, strlen(text), out, sizeof(out), &out_len);
+}
+
+static bool base64_rejects(const char *text) {
+    uint8_t out[16];
+    size_t out_len = 0;
+    return !decode_base64((const uint8_t *)text, strlen(text), out, sizeof(out), &out_len);
+}
+
+static double seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/*
+ * TESTS
+ */
+static void test_round_trips() {
+    static uint8_t value[VALUE_SIZE];
+    static uint8_t encoded[2 * VALUE_SIZE];
+    static uint8_t decoded[VALUE_SIZE];
+
+    for (uint32_t trip = 0; trip < ROUND_TRIPS; trip++) {
+        size_t len = (size_t)rand() % (VALUE_SIZE + 1);
+        for (size_t ndx = 0; ndx < len; ndx++) {
+            value[ndx] = (uint8_t)rand();
+        }
+        size_t decoded_len = 0;
+
+        size_t encoded_len = encode_hex(value, len, encoded, trip & 1);
+        CHECK(decode_hex_length(encoded_len) == len);
+        CHECK(decode_hex(encoded, encoded_len, decoded, sizeof(decoded), &decoded_len));
+        CHECK(decoded_len == len && memcmp(decoded, value, len) == 0);
+        CHECK(decode_hex(encoded, encoded_len, encoded, sizeof(encoded), &decoded_len));
+        CHECK(decoded_len == len && memcmp(encoded, value, len) == 0);
+
+        encoded_len = encode_base64(value, len, encoded, trip & 1);
+        CHECK(decode_base64_length(encoded, encoded_len) == len);
+        CHECK(decode_base64(encoded, encoded_len, decoded, sizeof(decoded), &decoded_len));
+        CHECK(decoded_len == len && memcmp(decoded, value, len) == 0);
+        CHECK(decode_base64(encoded, encoded_len, encoded, sizeof(encoded), &decoded_len));
+        CHECK(decoded_len == len && memcmp(encoded, value, len) == 0);
+
+        if (failures != 0) {
+            return;
+        }
+    }
+}
+
+static void test_hex() {
+    CHECK(hex_is("", (const uint8_t *)"", 0));
+    CHECK(hex_is("00fF", (const uint8_t *)"\x00\xff", 2));
+    CHECK(hex_is("0123456789abcdefABCDEF", (const uint8_t *)"\x01\x23\x45\x67\x89\xab\xcd\xef\xab\xcd\xef", 11));
+
+    // Odd lengths, in the word loop's tail and on its own
+    CHECK(hex_rejects("0"));
+    CHECK(hex_rejects("012"));
+    CHECK(hex_rejects("01234"));
+
+    // Characters the nibble loop quietly mapped to a value
+    const char *invalid[] = { "0g", "g0", "0G00", "00 0", "000:", "/0", "@0", "`0", "0x12" };
+    for (size_t ndx = 0; ndx < sizeof(invalid) / sizeof(invalid[0]); ndx++) {
+        CHECK(hex_rejects(invalid[ndx]));
+    }
+    uint8_t high[4] = { '0', '0', '0', 0xB0 };
+    size_t out_len = 0;
+    CHECK(!decode_hex(high, sizeof(high), high, sizeof(high), &out_len));
+
+    // One byte more than the output holds
+    uint8_t out[2];
+    CHECK(!decode_hex((const uint8_t *)"001122", 6, out, sizeof(out), &out_len));
+    CHECK(decode_hex((const uint8_t *)"0011", 4, out, sizeof(out), &out_len) && out_len == 2);
+}
+
+static void test_base64() {
+    CHECK(base64_is("", ""));
+    CHECK(base64_is("TWFu", "Man"));
+    CHECK(base64_is("TWE=", "Ma"));
+    CHECK(base64_is("TQ==", "M"));
+    CHECK(base64_is("+/+/", "\xfb\xff\xbf"));
+
+    // Padding may be left off
+    CHECK(base64_is("TWE", "Ma"));
+    CHECK(base64_is("TQ", "M"));
+    CHECK(base64_is("TWFuTWE", "ManMa"));
+
+    // A lone character left over, padded or not, is never valid
+    CHECK(base64_rejects("T"));
+    CHECK(base64_rejects("TWFuT"));
+    CHECK(base64_rejects("T==="));
+
+    // Padding only at the end, and then only to a multiple of four
+    CHECK(base64_rejects("TQ=="  "TQ=="));
+    CHECK(base64_rejects("T=Fu"));
+    CHECK(base64_rejects("TW=u"));
+    CHECK(base64_rejects("=WFu"));
+    CHECK(base64_rejects("TWE=="));
+    CHECK(base64_rejects("TQ="));
+    CHECK(base64_rejects("===="));
+
+    // Characters outside the standard alphabet
+    const char *invalid[] = { "TW-u", "TW_u", "TW u", "TW\nu", "TWF.", "TWF*" };
+    for (size_t ndx = 0; ndx < sizeof(invalid) / sizeof(invalid[0]); ndx++) {
+        CHECK(base64_rejects(invalid[ndx]));
+    }
+
+    // One byte more than the output holds
+    uint8_t out[2];
+    size_t out_len = 0;
+    CHECK(!decode_base64((const uint8_t *)"TWFu", 4, out, sizeof(out), &out_len));
+    CHECK(decode_base64((const uint8_t *)"TWE=", 4, out, sizeof(out), &out_len) && out_len == 2);
+}
+
+static void test_benchmark() {
+    static uint8_t value[VALUE_SIZE];
+    static uint8_t hex[2 * VALUE_SIZE];
+    static uint8_t base64[2 * VALUE_SIZE];
+    static uint8_t out[VALUE_SIZE];
+
+    for (size_t ndx = 0; ndx < VALUE_SIZE; ndx++) {
+        value[ndx] = (uint8_t)rand();
+    }
+    size_t hex_len = encode_hex(value, VALUE_SIZE, hex, false);
+    size_t base64_len = encode_base64(value, VALUE_SIZE, base64, true);
+    size_t out_len = 0;
+
+    double started = seconds();
+    for (uint32_t run = 0; run < BENCH_RUNS; run++) {
+        out_len = nibble_loop(hex, hex_len, out);
+        sink = out[run % out_len];
+    }
+    double nibble_s = seconds() - started;
+    CHECK(out_len == VALUE_SIZE && memcmp(out, value, VALUE_SIZE) == 0);
+
+    started = seconds();
+    for (uint32_t run = 0; run < BENCH_RUNS; run++) {
+        CHECK(decode_hex(hex, hex_len, out, sizeof(out), &out_len));
+        sink = out[run % out_len];
+    }
+    double hex_s = seconds() - started;
+    CHECK(out_len == VALUE_SIZE && memcmp(out, value, VALUE_SIZE) == 0);
+
+    started = seconds();
+    for (uint32_t run = 0; run < BENCH_RUNS; run++) {
+        CHECK(decode_base64(base64, base64_len, out, sizeof(out), &out_len));
+        sink = out[run % out_len];
+    }
+    double base64_s = seconds() - started;
+    CHECK(out_len == VALUE_SIZE && memcmp(out, value, VALUE_SIZE) == 0);
+
+    double bytes = (double)VALUE_SIZE * BENCH_RUNS;
+    printf("  %u byte value, %u runs\n", VALUE_SIZE, BENCH_RUNS);
+    printf("  nibble loop    %7.2f ns/byte\n", nibble_s * 1e9 / bytes);
+    printf("  decode_hex     %7.2f ns/byte, %.1fx the nibble loop\n", hex_s * 1e9 / bytes, nibble_s / hex_s);
+    printf("  decode_base64  %7.2f ns/byte, %.1fx the nibble loop\n", base64_s * 1e9 / bytes, nibble_s / base64_s);
+}
+
+
+int main() {
+    srand(1);
+
+    test_round_trips();
+    test_hex();
+    test_base64();
+    test_benchmark();
+
+    if (failures != 0) {
+        printf("decode harness: %lu checks failed\n", (unsigned long)failures);
+        return EXIT_FAILURE;
+    }
+    printf("decode harness: passed\n");
+    return EXIT_SUCCESS;
+}
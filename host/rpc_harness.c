@@ -0,0 +1,251 @@
+/**
+ *
+ * Microvisor RPC Host Harness
+ * Version 1.0.0
+ * Copyright © 2023, Twilio
+ * Licence: Apache 2.0
+ *
+ */
+
+/* Runs app/rpc_handler.c on a host machine against a stand-in transport: a
+ * fake publish that records each response, and a clock the harness moves by
+ * hand.  Checks the ok, error, unknown_method, busy and timeout replies, then
+ * pushes a large number of requests through to look for lost or misrouted
+ * responses.  Build and run with "make -C host".
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "rpc_handler.h"
+
+
+/*
+ * DEFINES
+ */
+#define PREFIX "rpc/device/UVTEST/"
+#define REPLY_TOPIC "rpc/reply/harness"
+#define SLOW_TIMEOUT_MS 100
+#define LOAD_REQUESTS 200000
+
+#define CHECK(condition) do { \
+    if (!(condition)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+        failures++; \
+    } \
+} while (0)
+
+
+/*
+ * GLOBALS
+ */
+static uint64_t now_us = 0;
+static uint32_t failures = 0;
+
+static char last_topic[BUF_RPC_REPLY_TOPIC];
+static char last_payload[BUF_RPC_RESPONSE];
+static uint32_t published = 0;
+
+static uint32_t slow_requests[RPC_MAX_PENDING];
+static uint32_t slow_count = 0;
+
+
+/*
+ * STAND-IN TRANSPORT
+ */
+static bool fake_publish(const uint8_t *topic, size_t topic_len, const uint8_t *payload, size_t payload_len) {
+    snprintf(last_topic, sizeof(last_topic), "%.*s", (int)topic_len, topic);
+    snprintf(last_payload, sizeof(last_payload), "%.*s", (int)payload_len, payload);
+    published++;
+    return true;
+}
+
+static uint64_t fake_now_microsec(void) {
+    return now_us;
+}
+
+static const struct RpcTransport fake_transport = {
+    .publish = fake_publish,
+    .now_microsec = fake_now_microsec,
+};
+
+
+/*
+ * METHODS
+ */
+static enum RpcResult method_echo(uint32_t request, const uint8_t *params, size_t params_len,
+                                  char *result, size_t result_size) {
+    snprintf(result, result_size, "%.*s", (int)params_len, params);
+    return RPC_RESULT_OK;
+}
+
+static enum RpcResult method_fail(uint32_t request, const uint8_t *params, size_t params_len,
+                                  char *result, size_t result_size) {
+    snprintf(result, result_size, "\"failed\"");
+    return RPC_RESULT_ERROR;
+}
+
+static enum RpcResult method_big(uint32_t request, const uint8_t *params, size_t params_len,
+                                 char *result, size_t result_size) {
+    size_t used = snprintf(result, result_size, "[");
+    for (uint32_t ndx = 0; ndx < 1000 && used < result_size; ndx++) {
+        used += snprintf(&result[used], result_size - used, "%s%lu", ndx == 0 ? "" : ",", (unsigned long)ndx);
+    }
+    return used < result_size ? RPC_RESULT_OK : rpc_result_too_large(result, result_size);
+}
+
+static enum RpcResult method_slow(uint32_t request, const uint8_t *params, size_t params_len,
+                                  char *result, size_t result_size) {
+    if (slow_count < RPC_MAX_PENDING) {
+        slow_requests[slow_count++] = request;
+    }
+    return RPC_RESULT_PENDING;
+}
+
+
+/*
+ * HELPERS
+ */
+static void call(const char *method, const char *id, const char *params) {
+    char topic[128];
+    char payload[256];
+    snprintf(topic, sizeof(topic), PREFIX "%s", method);
+    snprintf(payload, sizeof(payload), "{\"id\":\"%s\",\"reply\":\"" REPLY_TOPIC "\",\"params\":%s}", id, params);
+    rpc_handle_request((const uint8_t *)topic, strlen(topic), (const uint8_t *)payload, strlen(payload));
+}
+
+static bool replied(const char *id, const char *status) {
+    char expected[96];
+    snprintf(expected, sizeof(expected), "{\"id\":\"%s\",\"status\":\"%s\",", id, status);
+    return strcmp(last_topic, REPLY_TOPIC) == 0 && strncmp(last_payload, expected, strlen(expected)) == 0;
+}
+
+
+/*
+ * TESTS
+ */
+static void test_replies() {
+    const char *topic = PREFIX "echo";
+    CHECK(rpc_is_request((const uint8_t *)topic, strlen(topic)));
+    topic = "command/device/UVTEST";
+    CHECK(!rpc_is_request((const uint8_t *)topic, strlen(topic)));
+
+    call("echo", "1", "{\"a\":\"}\"}");
+    CHECK(replied("1", "ok"));
+    CHECK(strstr(last_payload, "\"result\":{\"a\":\"}\"}}") != NULL);
+
+    call("fail", "2", "{}");
+    CHECK(replied("2", "error"));
+    CHECK(strstr(last_payload, "\"result\":\"failed\"}") != NULL);
+
+    call("nope", "3", "{}");
+    CHECK(replied("3", "unknown_method"));
+
+    call("big", "4", "{}");
+    CHECK(replied("4", "error"));
+    CHECK(strstr(last_payload, "\"result\":" RPC_RESULT_TOO_LARGE "}") != NULL);
+
+    // A request with no reply topic cannot be answered
+    uint32_t before = published;
+    const char *payload = "{\"id\":\"5\"}";
+    topic = PREFIX "echo";
+    rpc_handle_request((const uint8_t *)topic, strlen(topic), (const uint8_t *)payload, strlen(payload));
+    CHECK(published == before);
+}
+
+static void test_busy_and_timeout() {
+    slow_count = 0;
+    char id[16];
+    for (uint32_t ndx = 0; ndx < RPC_MAX_PENDING; ndx++) {
+        snprintf(id, sizeof(id), "s%lu", (unsigned long)ndx);
+        uint32_t before = published;
+        call("slow", id, "{}");
+        CHECK(published == before);
+    }
+    CHECK(slow_count == RPC_MAX_PENDING);
+
+    call("slow", "over", "{}");
+    CHECK(replied("over", "busy"));
+
+    // One completes in time; the others time out
+    CHECK(rpc_complete(slow_requests[0], RPC_RESULT_OK, "true"));
+    CHECK(replied("s0", "ok"));
+
+    now_us += (SLOW_TIMEOUT_MS - 1) * 1000;
+    CHECK(rpc_poll() == RPC_MAX_PENDING - 1);
+
+    now_us += 2 * 1000;
+    uint32_t before = published;
+    CHECK(rpc_poll() == 0);
+    CHECK(published == before + RPC_MAX_PENDING - 1);
+    CHECK(replied("s3", "timeout"));
+
+    // Too late: the request was answered with "timeout"
+    CHECK(!rpc_complete(slow_requests[1], RPC_RESULT_OK, "true"));
+}
+
+static void test_load() {
+    char id[16];
+    char params[32];
+    uint32_t before = published;
+
+    for (uint32_t ndx = 0; ndx < LOAD_REQUESTS; ndx++) {
+        snprintf(id, sizeof(id), "%lu", (unsigned long)ndx);
+        switch (ndx % 4) {
+            case 0:
+                snprintf(params, sizeof(params), "%lu", (unsigned long)ndx);
+                call("echo", id, params);
+                CHECK(replied(id, "ok"));
+                CHECK(strstr(last_payload, params) != NULL);
+                break;
+            case 1:
+                call("fail", id, "{}");
+                CHECK(replied(id, "error"));
+                break;
+            case 2:
+                call("nope", id, "{}");
+                CHECK(replied(id, "unknown_method"));
+                break;
+            default:
+                // Fills one slot, which the next poll times out
+                call("slow", id, "{}");
+                now_us += (SLOW_TIMEOUT_MS + 1) * 1000;
+                CHECK(rpc_poll() == 0);
+                CHECK(replied(id, "timeout"));
+                break;
+        }
+        if (failures != 0) {
+            return;
+        }
+    }
+    CHECK(published - before == LOAD_REQUESTS);
+
+    const char *method;
+    struct RpcMethodStats stats;
+    for (uint32_t ndx = 0; rpc_get_method_stats(ndx, &method, &stats); ndx++) {
+        printf("  %-5s calls %lu errors %lu timeouts %lu max latency %lu us\n", method, (unsigned long)stats.calls,
+               (unsigned long)stats.errors, (unsigned long)stats.timeouts, (unsigned long)stats.max_latency_us);
+    }
+}
+
+
+int main() {
+    rpc_init(&fake_transport);
+    rpc_set_topic_prefix(PREFIX);
+    CHECK(rpc_register("echo", method_echo, 0));
+    CHECK(rpc_register("fail", method_fail, 0));
+    CHECK(rpc_register("big", method_big, 0));
+    CHECK(rpc_register("slow", method_slow, SLOW_TIMEOUT_MS));
+
+    test_replies();
+    test_busy_and_timeout();
+    test_load();
+
+    if (failures != 0) {
+        printf("rpc harness: %lu checks failed\n", (unsigned long)failures);
+        return EXIT_FAILURE;
+    }
+    printf("rpc harness: passed, %lu responses published\n", (unsigned long)published);
+    return EXIT_SUCCESS;
+}
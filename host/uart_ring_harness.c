@@ -0,0 +1,252 @@
+/**
+ *
+ * Microvisor UART Ring Helper Host Harness
+ * Version 1.0.0
+ * Copyright © 2023, Twilio
+ * Licence: Apache 2.0
+ *
+ */
+
+/* Runs app/uart_ring_helper.c on a host machine through a fake port.  The
+ * port records each transfer the ring starts and completes it only when told
+ * to, standing in for the UART interrupt, and can be made to refuse
+ * transfers as the HAL does when busy.  The harness checks that NEWLINE goes
+ * out as RETURN+NEWLINE, that a run which wraps the end of the ring goes out
+ * as two transfers, that a message which does not fit is dropped whole, that
+ * a refused transfer is retried by uart_ring_resume(), and that the
+ * statistics agree.  Build and run with "make -C host".
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "uart_ring_helper.h"
+
+
+/*
+ * DEFINES
+ */
+#define CHECK(condition) do { \
+    if (!(condition)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+        failures++; \
+    } \
+} while (0)
+
+
+/*
+ * GLOBALS
+ */
+static uint32_t failures = 0;
+
+// The transfer the fake port is sending, if any
+static const uint8_t *pending_data = NULL;
+static uint16_t pending_length = 0;
+static bool refuse = false;
+static uint32_t locked = 0;
+
+// Everything the fake port has finished sending, and the length of each transfer
+static uint8_t wire[4 * UART_RING_SIZE];
+static uint32_t wire_len = 0;
+static uint16_t transfer_lengths[64];
+static uint32_t transfer_count = 0;
+
+
+/*
+ * FAKE PORT
+ */
+static bool fake_transmit(const uint8_t *data, uint16_t length) {
+    CHECK(pending_data == NULL);
+    CHECK(length != 0);
+    if (refuse) {
+        return false;
+    }
+    pending_data = data;
+    pending_length = length;
+    if (transfer_count < sizeof(transfer_lengths) / sizeof(transfer_lengths[0])) {
+        transfer_lengths[transfer_count] = length;
+    }
+    transfer_count++;
+    return true;
+}
+
+static uint32_t fake_lock(void) {
+    return locked++;
+}
+
+static void fake_unlock(uint32_t state) {
+    locked = state;
+}
+
+static const struct UartRingPort fake_port = {
+    .transmit = fake_transmit,
+    .lock = fake_lock,
+    .unlock = fake_unlock
+};
+
+/**
+ * @brief Finish the transfer in progress, as the UART interrupt would.
+ *
+ * @retval false if there was none.
+ */
+static bool complete() {
+    if (pending_data == NULL) {
+        return false;
+    }
+    CHECK(wire_len + pending_length <= sizeof(wire));
+    memcpy(&wire[wire_len], pending_data, pending_length);
+    wire_len += pending_length;
+    pending_data = NULL;
+    pending_length = 0;
+    uart_ring_transmitted();
+    return true;
+}
+
+static void drain() {
+    while (complete()) { }
+    CHECK(uart_ring_is_empty());
+}
+
+static void reset() {
+    drain();
+    uart_ring_init(&fake_port);
+    wire_len = 0;
+    transfer_count = 0;
+    refuse = false;
+}
+
+static bool write_text(const char *text) {
+    return uart_ring_write((const uint8_t *)text, (uint32_t)strlen(text));
+}
+
+static bool wire_is(const char *expected) {
+    return wire_len == strlen(expected) && memcmp(wire, expected, wire_len) == 0;
+}
+
+
+/*
+ * TESTS
+ */
+static void test_newlines() {
+    reset();
+    struct UartRingStats before, after;
+    uart_ring_get_stats(&before);
+
+    CHECK(write_text("one\ntwo\n"));
+    CHECK(write_text("\n"));
+    CHECK(uart_ring_write((const uint8_t *)"three\0four", 10));
+    CHECK(!uart_ring_is_empty());
+    drain();
+    CHECK(wire_is("one\r\ntwo\r\n\r\nthree"));
+    CHECK(locked == 0);
+
+    uart_ring_get_stats(&after);
+    CHECK(after.messages - before.messages == 3);
+    CHECK(after.queued_bytes - before.queued_bytes == wire_len);
+    CHECK(after.sent_bytes - before.sent_bytes == wire_len);
+    CHECK(after.dropped == before.dropped);
+}
+
+static void test_wrapped_run() {
+    reset();
+    static char filler[UART_RING_SIZE];
+
+    // Leave the tail 8 bytes short of the end of the ring
+    memset(filler, 'f', UART_RING_SIZE - 8);
+    filler[UART_RING_SIZE - 8] = '\0';
+    CHECK(write_text(filler));
+    drain();
+    wire_len = 0;
+    transfer_count = 0;
+
+    // Held behind a transfer in flight, then sent as one run that wraps
+    CHECK(write_text("x"));
+    CHECK(write_text("abcdefghijklmnopqrs"));
+    CHECK(complete());
+    CHECK(transfer_count == 2);
+    CHECK(transfer_lengths[1] == 7);
+    CHECK(complete());
+    CHECK(transfer_count == 3);
+    CHECK(transfer_lengths[2] == 12);
+    CHECK(complete());
+    CHECK(!complete());
+    CHECK(wire_is("xabcdefghijklmnopqrs"));
+}
+
+static void test_overflow() {
+    reset();
+    static char message[UART_RING_SIZE + 1];
+    struct UartRingStats before, after;
+    uart_ring_get_stats(&before);
+
+    // Nothing completes, so the ring fills
+    memset(message, 'a', 1000);
+    message[1000] = '\0';
+    CHECK(write_text(message));
+    CHECK(write_text(message));
+
+    // 48 bytes are free: 47 characters and a NEWLINE make 49, one too many
+    memset(message, 'b', 47);
+    strcpy(&message[47], "\n");
+    CHECK(!write_text(message));
+    message[46] = '\n';
+    message[47] = '\0';
+    CHECK(write_text(message));
+    CHECK(!write_text("c"));
+
+    uart_ring_get_stats(&after);
+    CHECK(after.dropped - before.dropped == 2);
+    CHECK(after.messages - before.messages == 3);
+    CHECK(after.high_water == UART_RING_SIZE);
+
+    drain();
+    CHECK(wire_len == UART_RING_SIZE);
+    CHECK(memchr(wire, 'c', wire_len) == NULL);
+    CHECK(wire[UART_RING_SIZE - 2] == '\r' && wire[UART_RING_SIZE - 1] == '\n');
+}
+
+static void test_refused_transfer() {
+    reset();
+    struct UartRingStats before, after;
+    uart_ring_get_stats(&before);
+
+    refuse = true;
+    CHECK(write_text("held\n"));
+    CHECK(pending_data == NULL);
+    CHECK(!uart_ring_resume());
+    CHECK(!uart_ring_is_empty());
+
+    // The port is free again: resume sends it without waiting for another write
+    refuse = false;
+    CHECK(uart_ring_resume());
+    CHECK(pending_data != NULL);
+    drain();
+    CHECK(wire_is("held\r\n"));
+    CHECK(uart_ring_resume());
+
+    uart_ring_get_stats(&after);
+    CHECK(after.stalls - before.stalls == 2);
+    CHECK(after.transfers - before.transfers == 1);
+}
+
+
+int main() {
+    test_newlines();
+    test_wrapped_run();
+    test_overflow();
+    test_refused_transfer();
+
+    struct UartRingStats stats;
+    uart_ring_get_stats(&stats);
+    CHECK(stats.sent_bytes == stats.queued_bytes);
+
+    if (failures != 0) {
+        printf("uart ring harness: %lu checks failed\n", (unsigned long)failures);
+        return EXIT_FAILURE;
+    }
+    printf("uart ring harness: passed, %lu messages, %lu transfers, %lu dropped, %lu stalls\n",
+           (unsigned long)stats.messages, (unsigned long)stats.transfers,
+           (unsigned long)stats.dropped, (unsigned long)stats.stalls);
+    return EXIT_SUCCESS;
+}
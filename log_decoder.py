@@ -0,0 +1,161 @@
+#!/usr/bin/env python3
+
+#
+# log_decoder.py
+#
+# Rebuild the text of tokenized log lines, as written with LOG_TOKENIZED
+# defined (see app/log_token_helper.h), from the application's ELF file.
+# Lines that are not tokenized pass through unchanged.
+#
+# Usage:
+#   ./deploy.sh --logonly | python3 log_decoder.py build/app/mv-mqtt-demo.elf
+#   python3 log_decoder.py build/app/mv-mqtt-demo.elf saved.log
+#
+# @copyright 2023, Twilio
+# @license   MIT
+#
+
+import base64
+import re
+import struct
+import sys
+
+SECTION = ".log_strings"
+# Tokens are 16-bit offsets into the section
+SECTION_MAX = 0xFFFF
+
+LINE = re.compile(r"#([DET])([A-Za-z0-9+/]+=*)\s*$")
+LEVELS = {"E": "[ERROR] ", "D": "[DEBUG] ", "T": "[TRACE] "}
+SPEC = re.compile(r"%([-+ #0]*)(\*|\d+)?(?:\.(\*|\d*))?(hh|h|ll|l|z|j|t|L)?([diouxXcsfFeEgGp%])")
+
+
+def load_strings(elf_path):
+    """Return the bytes of the format string section, which starts at address 0."""
+    with open(elf_path, "rb") as file:
+        elf = file.read()
+
+    if elf[:4] != b"\x7fELF" or elf[5] != 1:
+        sys.exit(f"{elf_path} is not a little-endian ELF file")
+
+    if elf[4] == 1:
+        shoff, = struct.unpack_from("<I", elf, 0x20)
+        shentsize, shnum, shstrndx = struct.unpack_from("<HHH", elf, 0x2E)
+        header = lambda index: struct.unpack_from("<IIIIII", elf, shoff + index * shentsize)
+    else:
+        shoff, = struct.unpack_from("<Q", elf, 0x28)
+        shentsize, shnum, shstrndx = struct.unpack_from("<HHH", elf, 0x3A)
+        header = lambda index: struct.unpack_from("<IIQQQQ", elf, shoff + index * shentsize)
+
+    names_offset = header(shstrndx)[4]
+    for index in range(shnum):
+        name, _, _, address, offset, size = header(index)
+        end = elf.index(b"\0", names_offset + name)
+        if elf[names_offset + name:end].decode() == SECTION:
+            if address != 0:
+                sys.exit(f"{SECTION} is at {address:#x}, not 0: tokens will not match")
+            if size > SECTION_MAX:
+                sys.exit(f"{SECTION} is {size} bytes, over {SECTION_MAX:#x}: tokens will have wrapped")
+            return elf[offset:offset + size]
+
+    sys.exit(f"{elf_path} has no {SECTION} section: was it built with LOG_TOKENIZED?")
+
+
+class Args:
+    """The raw argument bytes of one record, read in order."""
+
+    def __init__(self, data):
+        self.data = data
+        self.offset = 0
+
+    def take(self, fmt):
+        value = struct.unpack_from(fmt, self.data, self.offset)
+        self.offset += struct.calcsize(fmt)
+        return value[0]
+
+    def string(self):
+        length = self.take("<B")
+        text = self.data[self.offset:self.offset + length]
+        if len(text) != length:
+            raise struct.error("string runs past the record")
+        self.offset += length
+        return text.decode("utf-8", errors="replace")
+
+
+def format_record(strings, record):
+    token, = struct.unpack_from("<H", record)
+    end = strings.find(b"\0", token)
+    if token >= len(strings) or end < 0:
+        return f"<unknown log token {token:#06x}>"
+
+    format_string = strings[token:end].decode("utf-8", errors="replace")
+    args = Args(record[2:])
+    output = []
+    last = 0
+    for spec in SPEC.finditer(format_string):
+        output.append(format_string[last:spec.start()])
+        last = spec.end()
+        flags, width, precision, length, conversion = spec.groups()
+        if conversion == "%":
+            output.append("%")
+            continue
+
+        try:
+            if width == "*":
+                width = str(args.take("<i"))
+            if precision == "*":
+                precision = str(args.take("<i"))
+
+            if conversion == "s":
+                value = args.string()
+            elif conversion in "fFeEg":
+                value = args.take("<d")
+                conversion = conversion.replace("F", "f")
+            elif conversion in "di":
+                value = args.take("<q" if length == "ll" else "<i")
+                conversion = "d"
+            elif conversion == "p":
+                value = args.take("<I")
+                flags, conversion = "#", "x"
+            else:
+                value = args.take("<Q" if length == "ll" else "<I")
+                if conversion == "c":
+                    value = chr(value & 0xFF)
+        except struct.error:
+            output.append("<truncated>")
+            return "".join(output)
+
+        python_spec = "%" + flags + (width or "") + ("." + precision if precision is not None else "") + conversion
+        output.append(python_spec % value)
+
+    output.append(format_string[last:])
+    return "".join(output)
+
+
+def decode_line(strings, line):
+    match = LINE.search(line)
+    if match is None:
+        return line
+
+    try:
+        record = base64.b64decode(match.group(2), validate=True)
+    except ValueError:
+        return line
+    if len(record) < 2:
+        return line
+
+    return line[:match.start()] + LEVELS[match.group(1)] + format_record(strings, record) + "\n"
+
+
+def main():
+    if len(sys.argv) not in (2, 3):
+        sys.exit("Usage: log_decoder.py {path/to/app.elf} [path/to/log]")
+
+    strings = load_strings(sys.argv[1])
+    source = open(sys.argv[2], encoding="utf-8", errors="replace") if len(sys.argv) == 3 else sys.stdin
+    for line in source:
+        sys.stdout.write(decode_line(strings, line))
+        sys.stdout.flush()
+
+
+if __name__ == "__main__":
+    main()